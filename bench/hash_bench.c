@@ -0,0 +1,201 @@
+// Microbenchmark for hashString() and the intern table.
+//
+// For several string length distributions it reports the hashing
+// throughput of hashString() next to the FNV-1a it replaced, the cost of
+// tableFindString() hits and misses, and for how many groups past their
+// first one a lookup has to probe to reach the entries of vm.strings.
+//
+// usage: hash-bench [strings per distribution]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../src/spl_object.h"
+#include "../src/spl_table.h"
+#include "../src/spl_vm.h"
+
+typedef struct {
+    const char* name;
+    int minLength;
+    int maxLength;
+} Distribution;
+
+static const Distribution distributions[] = {
+    {"names 3-12", 3, 12},
+    {"short 1-8", 1, 8},
+    {"medium 16-64", 16, 64},
+    {"long 256-4096", 256, 4096},
+};
+
+#define PROBE_BUCKETS 6
+static const char* probeLabels[PROBE_BUCKETS] = {"0", "1", "2", "3-4", "5-8", "9+"};
+
+static uint64_t state = 88172645463325252ull;
+
+static uint64_t nextRandom() {
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return state;
+}
+
+static double nowSeconds() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static uint32_t fnv1a(const char* key, int length) {
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < length; i++) {
+        hash ^= (uint8_t)key[i];
+        hash *= 16777619;
+    }
+    return hash;
+}
+
+// Half random characters, half a shared prefix and a counter, which is
+// what generated names tend to look like.
+static char* makeString(int index, int length) {
+    char* chars = malloc(length + 1);
+    if (index % 2 == 0) {
+        for (int i = 0; i < length; i++) {
+            chars[i] = "abcdefghijklmnopqrstuvwxyz_0123456789"[nextRandom() % 37];
+        }
+    } else {
+        char counter[16];
+        int digits = snprintf(counter, sizeof(counter), "%d", index);
+        for (int i = 0; i < length; i++) {
+            int fromEnd = length - 1 - i;
+            chars[i] = fromEnd < digits ? counter[digits - 1 - fromEnd] : 'k';
+        }
+    }
+    chars[length] = '\0';
+    return chars;
+}
+
+static int bucketFor(int distance) {
+    if (distance <= 2) return distance;
+    if (distance <= 4) return 3;
+    if (distance <= 8) return 4;
+    return 5;
+}
+
+// Follows the table's probe sequence from each entry's first group to
+// the group it is in.
+static void countProbes(Entry* entries, int8_t* control, int capacity, int* probes,
+                        long* totalDistance, int* maxDistance) {
+    uint32_t groupMask = capacity / TABLE_GROUP_WIDTH - 1;
+    for (int i = 0; i < capacity; i++) {
+        if (!CTRL_IS_FULL(control[i])) continue;
+        ObjString* key = entries[i].key;
+        int distance = 0;
+        uint32_t group = (key->hash >> 7) & groupMask;
+        while (group != (uint32_t)i / TABLE_GROUP_WIDTH) {
+            distance++;
+            group = (group + distance) & groupMask;
+        }
+        probes[bucketFor(distance)]++;
+        *totalDistance += distance;
+        if (distance > *maxDistance) *maxDistance = distance;
+    }
+}
+
+static double hashRate(uint32_t (*hash)(const char*, int), char** strings,
+                       int* lengths, int count, size_t totalBytes) {
+    volatile uint32_t sink = 0;
+    int rounds = 0;
+    double start = nowSeconds();
+    double elapsed;
+    do {
+        for (int i = 0; i < count; i++) sink ^= hash(strings[i], lengths[i]);
+        rounds++;
+        elapsed = nowSeconds() - start;
+    } while (elapsed < 0.2);
+    (void)sink;
+    return totalBytes * (double)rounds / elapsed / 1e6;
+}
+
+static void run(const Distribution* distribution, int count) {
+    char** strings = malloc(sizeof(char*) * count);
+    int* lengths = malloc(sizeof(int) * count);
+    size_t totalBytes = 0;
+    for (int i = 0; i < count; i++) {
+        int span = distribution->maxLength - distribution->minLength + 1;
+        lengths[i] = distribution->minLength + (int)(nextRandom() % span);
+        strings[i] = makeString(i, lengths[i]);
+        totalBytes += lengths[i];
+    }
+
+    double fnvRate = hashRate(fnv1a, strings, lengths, count, totalBytes);
+    double rate = hashRate(hashString, strings, lengths, count, totalBytes);
+
+    SplVM vm;
+    initVM(&vm);
+    // An empty script sets up the stack that copyString() roots into.
+    interpret(&vm, "");
+    for (int i = 0; i < count; i++) {
+        // Keep every string alive; the intern table alone does not.
+        writeValueArray(&vm, &vm.globalNames,
+                        OBJ_VAL(copyString(&vm, strings[i], lengths[i])));
+    }
+
+    uint32_t* hashes = malloc(sizeof(uint32_t) * count);
+    for (int i = 0; i < count; i++) hashes[i] = hashString(strings[i], lengths[i]);
+    int found = 0;
+    double start = nowSeconds();
+    for (int i = 0; i < count; i++) {
+        found += tableFindString(&vm.strings, strings[i], lengths[i], hashes[i]) != NULL;
+    }
+    double hitNanos = (nowSeconds() - start) * 1e9 / count;
+    // Misses: the same strings with their first character changed.
+    for (int i = 0; i < count; i++) {
+        strings[i][0] = '#';
+        hashes[i] = hashString(strings[i], lengths[i]);
+    }
+    start = nowSeconds();
+    for (int i = 0; i < count; i++) {
+        found += tableFindString(&vm.strings, strings[i], lengths[i], hashes[i]) != NULL;
+    }
+    double missNanos = (nowSeconds() - start) * 1e9 / count;
+
+    int probes[PROBE_BUCKETS] = {0};
+    long totalDistance = 0;
+    int maxDistance = 0;
+    countProbes(vm.strings.oldEntries, vm.strings.oldControl, vm.strings.oldCapacity, probes,
+                &totalDistance, &maxDistance);
+    countProbes(vm.strings.entries, vm.strings.control, vm.strings.capacity, probes,
+                &totalDistance, &maxDistance);
+    int capacity = vm.strings.oldCapacity + vm.strings.capacity;
+
+    printf("%-14s %10.0f %10.0f %8.1f %8.1f %7.2f %5d ", distribution->name,
+           fnvRate, rate, hitNanos, missNanos,
+           (double)totalDistance / vm.strings.count, maxDistance);
+    for (int i = 0; i < PROBE_BUCKETS; i++) {
+        printf(" %5.1f%%", 100.0 * probes[i] / vm.strings.count);
+    }
+    printf("   (%d strings, %d slots%s)\n", vm.strings.count, capacity,
+           found == count ? "" : ", LOOKUP MISMATCH");
+
+    freeVM(&vm);
+    for (int i = 0; i < count; i++) free(strings[i]);
+    free(strings);
+    free(lengths);
+    free(hashes);
+}
+
+int main(int argc, const char* argv[]) {
+    int count = argc > 1 ? atoi(argv[1]) : 200000;
+    printf("%-14s %10s %10s %8s %8s %7s %5s ", "strings", "fnv MB/s", "hash MB/s",
+           "hit ns", "miss ns", "groups", "max");
+    for (int i = 0; i < PROBE_BUCKETS; i++) printf(" %6s", probeLabels[i]);
+    printf("\n");
+    for (size_t i = 0; i < sizeof(distributions) / sizeof(distributions[0]); i++) {
+        // Long strings take a lot of memory; fewer of them do.
+        int n = distributions[i].minLength >= 256 ? count / 20 : count;
+        run(&distributions[i], n);
+    }
+    return 0;
+}
@@ -0,0 +1,37 @@
+#!/bin/sh
+# Runs every bench/*.spl script against each given interpreter binary and
+# prints the best wall-clock time out of $RUNS runs.
+#
+# usage: bench/run.sh "<spl binary> [flags]"...
+
+RUNS=${RUNS:-5}
+DIR=$(dirname "$0")
+
+now_ms() {
+    date +%s%N | cut -c1-13
+}
+
+printf "%-14s" "script"
+for bin in "$@"; do
+    printf "%26s" "$(basename "$bin")"
+done
+printf "\n"
+
+for script in "$DIR"/*.spl; do
+    printf "%-14s" "$(basename "$script")"
+    for bin in "$@"; do
+        best=""
+        i=0
+        while [ $i -lt "$RUNS" ]; do
+            start=$(now_ms)
+            $bin "$script" > /dev/null || exit 1
+            elapsed=$(( $(now_ms) - start ))
+            if [ -z "$best" ] || [ "$elapsed" -lt "$best" ]; then
+                best=$elapsed
+            fi
+            i=$((i + 1))
+        done
+        printf "%24sms" "$best"
+    done
+    printf "\n"
+done
@@ -0,0 +1,241 @@
+// Microbenchmark for Table against the linear-probing table it replaced.
+//
+// For several table sizes it fills a table with interned strings, looks
+// every key up, looks up as many keys that are not there, and deletes
+// every key again, and reports nanoseconds per operation for both
+// implementations. Then it reports the slowest single set while one
+// table of each kind grows to the largest size, which is where growing
+// shows up.
+//
+// usage: table-bench [largest table size]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../src/spl_object.h"
+#include "../src/spl_table.h"
+#include "../src/spl_vm.h"
+
+// The previous table: 'hash % capacity', linear probing over key/value
+// records, tombstones marked by a NULL key with a non-nil value.
+typedef struct {
+    ObjString* key;
+    Value value;
+} LinearEntry;
+
+typedef struct {
+    int count;
+    int capacity;
+    LinearEntry* entries;
+} LinearTable;
+
+// Table's functions live in another translation unit; keep these out of
+// line too so both pay for a call.
+#define NOINLINE __attribute__((noinline))
+
+static LinearEntry* linearFind(LinearEntry* entries, int capacity, ObjString* key) {
+    uint32_t index = key->hash % capacity;
+    LinearEntry* tombstone = NULL;
+    for (;;) {
+        LinearEntry* entry = &entries[index];
+        if (entry->key == NULL) {
+            if (IS_NIL(entry->value)) return tombstone != NULL ? tombstone : entry;
+            if (tombstone == NULL) tombstone = entry;
+        } else if (entry->key == key) {
+            return entry;
+        }
+        index = (index + 1) % capacity;
+    }
+}
+
+NOINLINE static bool linearGet(LinearTable* table, ObjString* key,
+                                Value* value) {
+    if (table->count == 0) return false;
+    LinearEntry* entry = linearFind(table->entries, table->capacity, key);
+    if (entry->key == NULL) return false;
+    *value = entry->value;
+    return true;
+}
+
+NOINLINE static void linearSet(LinearTable* table, ObjString* key, Value value) {
+    if (table->count + 1 > table->capacity * 0.75) {
+        int capacity = table->capacity < 8 ? 8 : table->capacity * 2;
+        LinearEntry* entries = malloc(sizeof(LinearEntry) * capacity);
+        for (int i = 0; i < capacity; i++) {
+            entries[i].key = NULL;
+            entries[i].value = NIL_VAL;
+        }
+        table->count = 0;
+        for (int i = 0; i < table->capacity; i++) {
+            LinearEntry* entry = &table->entries[i];
+            if (entry->key == NULL) continue;
+            *linearFind(entries, capacity, entry->key) = *entry;
+            table->count++;
+        }
+        free(table->entries);
+        table->entries = entries;
+        table->capacity = capacity;
+    }
+    LinearEntry* entry = linearFind(table->entries, table->capacity, key);
+    if (entry->key == NULL && IS_NIL(entry->value)) table->count++;
+    entry->key = key;
+    entry->value = value;
+}
+
+NOINLINE static void linearDelete(LinearTable* table, ObjString* key) {
+    if (table->count == 0) return;
+    LinearEntry* entry = linearFind(table->entries, table->capacity, key);
+    if (entry->key == NULL) return;
+    entry->key = NULL;
+    entry->value = BOOL_VAL(true);
+}
+
+typedef enum { SET, GET_HIT, GET_MISS, DELETE, OPERATION_COUNT } Operation;
+
+static const char* operationNames[OPERATION_COUNT] = {"set", "get hit", "get miss", "delete"};
+
+static double nowSeconds() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+// Runs whole rounds of set, get, miss and delete for at least a third
+// of a second and stores nanoseconds per operation in 'nanos'.
+static void runLinear(ObjString** keys, ObjString** absent, int size, double* nanos) {
+    double total[OPERATION_COUNT] = {0};
+    Value value;
+    int found = 0;
+    int rounds = 0;
+    double start = nowSeconds();
+    do {
+        LinearTable table = {0, 0, NULL};
+        double t0 = nowSeconds();
+        for (int i = 0; i < size; i++) linearSet(&table, keys[i], NUMBER_VAL(i));
+        double t1 = nowSeconds();
+        for (int i = 0; i < size; i++) found += linearGet(&table, keys[i], &value);
+        double t2 = nowSeconds();
+        for (int i = 0; i < size; i++) found += linearGet(&table, absent[i], &value);
+        double t3 = nowSeconds();
+        for (int i = 0; i < size; i++) linearDelete(&table, keys[i]);
+        double t4 = nowSeconds();
+        free(table.entries);
+        total[SET] += t1 - t0;
+        total[GET_HIT] += t2 - t1;
+        total[GET_MISS] += t3 - t2;
+        total[DELETE] += t4 - t3;
+        rounds++;
+    } while (nowSeconds() - start < 0.3);
+    if (found != size * rounds) printf("linear table lost keys\n");
+    for (int i = 0; i < OPERATION_COUNT; i++) nanos[i] = total[i] * 1e9 / rounds / size;
+}
+
+static void runTable(SplVM* vm, ObjString** keys, ObjString** absent, int size,
+                     double* nanos) {
+    double total[OPERATION_COUNT] = {0};
+    Value value;
+    int found = 0;
+    int rounds = 0;
+    double start = nowSeconds();
+    do {
+        Table table;
+        initTable(&table);
+        double t0 = nowSeconds();
+        for (int i = 0; i < size; i++) tableSet(vm, &table, keys[i], NUMBER_VAL(i));
+        double t1 = nowSeconds();
+        for (int i = 0; i < size; i++) found += tableGet(&table, keys[i], &value);
+        double t2 = nowSeconds();
+        for (int i = 0; i < size; i++) found += tableGet(&table, absent[i], &value);
+        double t3 = nowSeconds();
+        for (int i = 0; i < size; i++) tableDelete(&table, keys[i]);
+        double t4 = nowSeconds();
+        freeTable(vm, &table);
+        total[SET] += t1 - t0;
+        total[GET_HIT] += t2 - t1;
+        total[GET_MISS] += t3 - t2;
+        total[DELETE] += t4 - t3;
+        rounds++;
+    } while (nowSeconds() - start < 0.3);
+    if (found != size * rounds) printf("table lost keys\n");
+    for (int i = 0; i < OPERATION_COUNT; i++) nanos[i] = total[i] * 1e9 / rounds / size;
+}
+
+// Returns the longest time one set took, in microseconds, while adding
+// all 'size' keys to an empty table.
+static double slowestLinearSet(ObjString** keys, int size) {
+    LinearTable table = {0, 0, NULL};
+    double slowest = 0;
+    for (int i = 0; i < size; i++) {
+        double start = nowSeconds();
+        linearSet(&table, keys[i], NUMBER_VAL(i));
+        double elapsed = nowSeconds() - start;
+        if (elapsed > slowest) slowest = elapsed;
+    }
+    free(table.entries);
+    return slowest * 1e6;
+}
+
+static double slowestTableSet(SplVM* vm, ObjString** keys, int size) {
+    Table table;
+    initTable(&table);
+    double slowest = 0;
+    for (int i = 0; i < size; i++) {
+        double start = nowSeconds();
+        tableSet(vm, &table, keys[i], NUMBER_VAL(i));
+        double elapsed = nowSeconds() - start;
+        if (elapsed > slowest) slowest = elapsed;
+    }
+    freeTable(vm, &table);
+    return slowest * 1e6;
+}
+
+int main(int argc, const char* argv[]) {
+    int largest = argc > 1 ? atoi(argv[1]) : 1 << 20;
+
+    SplVM vm;
+    initVM(&vm);
+    // An empty script sets up the stack that copyString() roots into.
+    interpret(&vm, "");
+    // Half of the strings go into the tables, the other half are misses.
+    ObjString** strings = malloc(sizeof(ObjString*) * 2 * largest);
+    char name[32];
+    for (int i = 0; i < 2 * largest; i++) {
+        int length = snprintf(name, sizeof(name), "name%d", i);
+        strings[i] = copyString(&vm, name, length);
+        writeValueArray(&vm, &vm.globalNames, OBJ_VAL(strings[i]));
+    }
+    // Keep the collector out of the timings; every key is reachable anyway.
+    vm.nextGC = SIZE_MAX;
+
+    printf("%-9s %-9s %10s %10s %8s\n", "size", "operation", "linear ns", "table ns", "speedup");
+    for (int size = 64; size <= largest; size *= 16) {
+        double linear[OPERATION_COUNT];
+        double table[OPERATION_COUNT];
+        // Interleave keys and misses so both spread over the whole set.
+        ObjString** keys = malloc(sizeof(ObjString*) * size);
+        ObjString** absent = malloc(sizeof(ObjString*) * size);
+        int step = largest / size;
+        for (int i = 0; i < size; i++) {
+            keys[i] = strings[2 * i * step];
+            absent[i] = strings[2 * i * step + 1];
+        }
+        runLinear(keys, absent, size, linear);
+        runTable(&vm, keys, absent, size, table);
+        for (int i = 0; i < OPERATION_COUNT; i++) {
+            printf("%-9d %-9s %10.1f %10.1f %7.2fx\n", size, operationNames[i],
+                   linear[i], table[i], linear[i] / table[i]);
+        }
+        free(keys);
+        free(absent);
+    }
+
+    printf("\nslowest set while growing to %d entries: linear %.1f us, table %.1f us\n",
+           2 * largest, slowestLinearSet(strings, 2 * largest),
+           slowestTableSet(&vm, strings, 2 * largest));
+
+    free(strings);
+    freeVM(&vm);
+    return 0;
+}
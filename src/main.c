@@ -8,7 +8,7 @@
 #define MAG "\e[0;35m"
 #define CYN "\e[0;36m"
 
-static void repl() {
+static void repl(SplVM* vm) {
     char line[1024];
     for (;;) {
         printf("%s> %s", CYN, ANSI_COLOR_RESET);
@@ -18,7 +18,13 @@ static void repl() {
             printf("\n");
             break;
         }
-        interpret(line);
+        interpret(vm, line);
+        if (vm->outOfMemory) {
+            // The arena is spent; start over rather than refuse every
+            // line that follows.
+            fprintf(stderr, "Starting over: all globals are gone.\n");
+            resetVM(vm);
+        }
     }
 }
 
@@ -47,26 +53,77 @@ static char* readFile(const char* path) {
     return buffer;
 }
 
-static void runFile(const char* path) {
+static int runFile(SplVM* vm, const char* path) {
     char* source = readFile(path);
-    InterpretResult result = interpret(source);
+    InterpretResult result = interpret(vm, source);
     free(source);
-    if (result == INTERPRET_COMPILE_ERROR) exit(65);
-    if (result == INTERPRET_RUNTIME_ERROR) exit(70);
+    if (result == INTERPRET_COMPILE_ERROR) return 65;
+    if (result == INTERPRET_RUNTIME_ERROR) return 70;
+    return 0;
 }
 
 
 
+static size_t parseSize(const char* text) {
+    char* end;
+    unsigned long long size = strtoull(text, &end, 10);
+    if (*end == 'k' || *end == 'K') {
+        size <<= 10;
+        end++;
+    } else if (*end == 'm' || *end == 'M') {
+        size <<= 20;
+        end++;
+    }
+    return end == text || *end != '\0' ? 0 : (size_t)size;
+}
+
+static void usage() {
+    fprintf(stderr, "Usage: spl [-O] [--registers] [--jit] [--mem-stats[=json]] [--arena=<bytes>[k|m]] [path]\n");
+    exit(64);
+}
+
 int main(int argc, const char * argv[]) {
-    initVM();
-    if (argc == 1) {
-        repl();
-    } else if (argc == 2) {
-        runFile(argv[1]);
+    SplVM vm;
+    initVM(&vm);
+    const char* path = NULL;
+    bool memStats = false;
+    bool memStatsJson = false;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-O") == 0) {
+            vm.optimize = true;
+        } else if (strcmp(argv[i], "--registers") == 0) {
+            vm.useRegisters = true;
+        } else if (strcmp(argv[i], "--jit") == 0) {
+#ifndef SPL_JIT
+            fprintf(stderr, "This build has no JIT; ignoring --jit.\n");
+#endif
+            vm.useJit = true;
+        } else if (strcmp(argv[i], "--mem-stats") == 0) {
+            memStats = true;
+        } else if (strcmp(argv[i], "--mem-stats=json") == 0) {
+            memStats = true;
+            memStatsJson = true;
+        } else if (strncmp(argv[i], "--arena=", 8) == 0) {
+            size_t limit = parseSize(argv[i] + 8);
+            if (limit == 0 || vm.arena != NULL) usage();
+            initArena(&vm, limit);
+        } else if (argv[i][0] == '-' || path != NULL) {
+            usage();
+        } else {
+            path = argv[i];
+        }
+    }
+    int status = 0;
+    if (path == NULL) {
+        repl(&vm);
     } else {
-        fprintf(stderr, "Usage: clox [path]\n");
-        exit(64);
+        status = runFile(&vm, path);
     }
-    freeVM();
-    return 0;
+    if (memStats) {
+        MemStats stats;
+        getMemStats(&vm, &stats);
+        printMemStats(&vm, &stats, stderr, memStatsJson);
+    }
+    freeVM(&vm);
+    return status;
 }
\ No newline at end of file
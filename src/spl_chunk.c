@@ -1,6 +1,8 @@
 #include <stdlib.h>
+#include <string.h>
 #include "spl_chunk.h"
 #include "spl_memory.h"
+#include "spl_vm.h"
 
 void initChunk(Chunk* chunk) {
     chunk->count = 0;
@@ -8,52 +10,353 @@ void initChunk(Chunk* chunk) {
     chunk->code = NULL;
     initLineArray(&chunk->lines);
     initValueArray(&chunk->constants);
+    chunk->constantSlotCapacity = 0;
+    chunk->constantSlots = NULL;
 }
 
-void writeChunk(Chunk* chunk, uint8_t byte, int line) {
+void writeChunk(SplVM* vm, Chunk* chunk, uint8_t byte, int line) {
     // if chunk full free memory
     if (chunk->capacity < chunk->count + 1) {
         int oldCapacity = chunk->capacity;
         chunk->capacity = GROW_CAPACITY(oldCapacity);
-        chunk->code = GROW_ARRAY(uint8_t, chunk->code, oldCapacity, chunk->capacity);
+        chunk->code = GROW_ARRAY(vm, uint8_t, chunk->code, oldCapacity, chunk->capacity);
     }
 
     chunk->code[chunk->count] = byte;
-    writeLineArray(&chunk->lines, line);
+    writeLineArray(vm, &chunk->lines, line);
 
     chunk->count++;
 }
 
-void freeChunk(Chunk* chunk) {
-    FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
-    freeLineArray(&chunk->lines);
-    freeValueArray(&chunk->constants);
+void freeChunk(SplVM* vm, Chunk* chunk) {
+    FREE_ARRAY(vm, uint8_t, chunk->code, chunk->capacity);
+    freeLineArray(vm, &chunk->lines);
+    freeValueArray(vm, &chunk->constants);
+    FREE_ARRAY(vm, int, chunk->constantSlots, chunk->constantSlotCapacity);
     initChunk(chunk);
 }
 
-int addConstant(Chunk* chunk, Value value) {
-    writeValueArray(&chunk->constants, value);
+// The bits that make two constants the same constant. Numbers compare
+// by bits, so 0 and -0 stay apart.
+static uint64_t identityBits(Value value) {
+#ifdef NAN_BOXING
+    return value;
+#else
+    uint64_t bits = 0;
+    switch (value.type) {
+        case VAL_BOOL: bits = value.as.boolean; break;
+        case VAL_NUMBER: memcpy(&bits, &value.as.number, sizeof(double)); break;
+        case VAL_OBJ: bits = (uint64_t)(uintptr_t)value.as.obj; break;
+        default: break;
+    }
+    return bits ^ ((uint64_t)value.type << 59);
+#endif
+}
+
+static bool sameConstant(Value a, Value b) {
+#ifdef NAN_BOXING
+    return a == b;
+#else
+    return a.type == b.type && identityBits(a) == identityBits(b);
+#endif
+}
+
+// Fibonacci hashing: the top bits of the product depend on every bit of
+// the value. The low ones do not, and small integers differ only in
+// the top bits of their doubles.
+static uint32_t constantHash(Value value, int capacity) {
+    int shift = 64 - __builtin_ctz((unsigned)capacity);
+    return (uint32_t)((identityBits(value) * 0x9e3779b97f4a7c15ull) >> shift);
+}
+
+// Returns the slot of the index holding 'value', or the empty slot
+// where it belongs.
+static int findConstantSlot(int* slots, int capacity, ValueArray* constants,
+                            Value value) {
+    uint32_t mask = (uint32_t)capacity - 1;
+    for (uint32_t slot = constantHash(value, capacity); ; slot = (slot + 1) & mask) {
+        int index = slots[slot] - 1;
+        if (index < 0 || sameConstant(constants->values[index], value)) return (int)slot;
+    }
+}
+
+static void growConstantSlots(SplVM* vm, Chunk* chunk) {
+    int capacity = GROW_CAPACITY(chunk->constantSlotCapacity);
+    int* slots = ALLOCATE(vm, int, capacity);
+    for (int i = 0; i < capacity; i++) slots[i] = 0;
+    for (int index = 0; index < chunk->constants.count; index++) {
+        Value value = chunk->constants.values[index];
+        slots[findConstantSlot(slots, capacity, &chunk->constants, value)] = index + 1;
+    }
+    FREE_ARRAY(vm, int, chunk->constantSlots, chunk->constantSlotCapacity);
+    chunk->constantSlots = slots;
+    chunk->constantSlotCapacity = capacity;
+}
+
+// Returns the index of 'value' in the constant table, adding it if no
+// identical constant is there yet.
+int addConstant(SplVM* vm, Chunk* chunk, Value value) {
+    if (chunk->constantSlotCapacity > 0) {
+        int slot = findConstantSlot(chunk->constantSlots, chunk->constantSlotCapacity,
+                                    &chunk->constants, value);
+        if (chunk->constantSlots[slot] != 0) return chunk->constantSlots[slot] - 1;
+    }
+
+    // The collector scans constant pools incrementally.
+    WRITE_BARRIER(vm, value);
+    push(vm, value);
+    writeValueArray(vm, &chunk->constants, value);
+    // Keep the index at most half full.
+    if (chunk->constants.count * 2 > chunk->constantSlotCapacity) {
+        growConstantSlots(vm, chunk);
+    } else {
+        int slot = findConstantSlot(chunk->constantSlots, chunk->constantSlotCapacity,
+                                    &chunk->constants, value);
+        chunk->constantSlots[slot] = chunk->constants.count;
+    }
+    pop(vm);
     return chunk->constants.count - 1;
 }
 
+// Drops the code from byte 'count' on and the constants from index
+// 'constantCount' on, which nothing else may refer to.
+void truncateChunk(Chunk* chunk, int count, int constantCount) {
+    truncateLineArray(&chunk->lines, chunk->count - count);
+    chunk->count = count;
+    // The dropped constants are the newest, so emptying their index
+    // slots newest first leaves the index as it was before they came.
+    while (chunk->constants.count > constantCount) {
+        Value value = chunk->constants.values[chunk->constants.count - 1];
+        int slot = findConstantSlot(chunk->constantSlots, chunk->constantSlotCapacity,
+                                    &chunk->constants, value);
+        chunk->constantSlots[slot] = 0;
+        chunk->constants.count--;
+    }
+}
 
-bool writeConstant(Chunk* chunk, Value value, int line) {
-    uint32_t index = (uint32_t) addConstant(chunk, value);
+bool writeConstant(SplVM* vm, Chunk* chunk, Value value, int line) {
+    uint32_t index = (uint32_t) addConstant(vm, chunk, value);
     if (index > UINT32_MAX) {
         return false;
     }
     if (index > UINT8_MAX) {
         uint8_t largeConstant[CONSTANT_LONG_BYTE_SIZE];
         CONVERT_TO_BYTE_ARRAY(largeConstant, CONSTANT_LONG_BYTE_SIZE, index);
-        writeChunk(chunk, OP_CONSTANT_LONG, line);
+        writeChunk(vm, chunk, OP_CONSTANT_LONG, line);
 
         for (int i = 0; i < CONSTANT_LONG_BYTE_SIZE; i++) {
-            writeChunk(chunk, largeConstant[i], line);
+            writeChunk(vm, chunk, largeConstant[i], line);
         }
     } else {
-        writeChunk(chunk, OP_CONSTANT, line);
-        writeChunk(chunk, index, line);
+        writeChunk(vm, chunk, OP_CONSTANT, line);
+        writeChunk(vm, chunk, index, line);
     }
     return true;
 }
 
+int instructionLength(uint8_t instruction) {
+    switch (instruction) {
+        case OP_CONSTANT_LONG:
+        case OP_GET_GLOBAL_LONG:
+        case OP_GET_LOCAL_LONG:
+        case OP_DEFINE_GLOBAL_LONG:
+        case OP_SET_GLOBAL_LONG:
+        case OP_SET_LOCAL_LONG:
+            return 1 + CONSTANT_LONG_BYTE_SIZE;
+        case OP_CONSTANT:
+        case OP_GET_GLOBAL:
+        case OP_GET_LOCAL:
+        case OP_DEFINE_GLOBAL:
+        case OP_SET_GLOBAL:
+        case OP_SET_LOCAL:
+        case OP_SET_LOCAL_POP:
+        case OP_SET_GLOBAL_POP:
+            return 2;
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_LOOP:
+        case OP_ADD_LOCAL_CONSTANT:
+        case OP_ADD_LOCAL_CONSTANT_NUM:
+        case OP_JUMP_IF_GREATER:
+        case OP_JUMP_IF_NOT_GREATER:
+        case OP_JUMP_IF_LESS:
+        case OP_JUMP_IF_NOT_LESS:
+            return 3;
+        default:
+            return 1;
+    }
+}
+
+void initDecodedChunk(DecodedChunk* decoded) {
+    decoded->count = 0;
+    decoded->code = NULL;
+    decoded->offsets = NULL;
+    decoded->maxDepth = 0;
+}
+
+void freeDecodedChunk(SplVM* vm, DecodedChunk* decoded) {
+    FREE_ARRAY(vm, Instruction, decoded->code, decoded->count);
+    FREE_ARRAY(vm, int, decoded->offsets, decoded->count);
+    initDecodedChunk(decoded);
+}
+
+static uint8_t shortForm(uint8_t instruction) {
+    switch (instruction) {
+        case OP_CONSTANT_LONG: return OP_CONSTANT;
+        case OP_GET_GLOBAL_LONG: return OP_GET_GLOBAL;
+        case OP_GET_LOCAL_LONG: return OP_GET_LOCAL;
+        case OP_DEFINE_GLOBAL_LONG: return OP_DEFINE_GLOBAL;
+        case OP_SET_GLOBAL_LONG: return OP_SET_GLOBAL;
+        case OP_SET_LOCAL_LONG: return OP_SET_LOCAL;
+        default: return instruction;
+    }
+}
+
+static bool isJump(uint8_t instruction) {
+    switch (instruction) {
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_LOOP:
+        case OP_JUMP_IF_GREATER:
+        case OP_JUMP_IF_NOT_GREATER:
+        case OP_JUMP_IF_LESS:
+        case OP_JUMP_IF_NOT_LESS:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Net change in stack depth of a decoded instruction.
+static int stackEffect(uint8_t instruction) {
+    switch (instruction) {
+        case OP_CONSTANT:
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_GET_LOCAL:
+        case OP_GET_GLOBAL:
+        case OP_ADD_LOCAL_CONSTANT:
+        case OP_ADD_LOCAL_CONSTANT_NUM:
+            return 1;
+        case OP_POP:
+        case OP_DEFINE_GLOBAL:
+        case OP_EQUAL:
+        case OP_GREATER:
+        case OP_LESS:
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_PRINT:
+        case OP_NOT_GREATER:
+        case OP_NOT_LESS:
+        case OP_SET_LOCAL_POP:
+        case OP_SET_GLOBAL_POP:
+        case OP_ADD_NUM:
+        case OP_SUBTRACT_NUM:
+        case OP_MULTIPLY_NUM:
+        case OP_DIVIDE_NUM:
+        case OP_GREATER_NUM:
+        case OP_LESS_NUM:
+            return -1;
+        case OP_JUMP_IF_GREATER:
+        case OP_JUMP_IF_NOT_GREATER:
+        case OP_JUMP_IF_LESS:
+        case OP_JUMP_IF_NOT_LESS:
+            return -2;
+        default:
+            return 0;
+    }
+}
+
+// The compiler emits structured code, so a single pass that carries the
+// depth forward and picks it up again at jump targets sees every depth
+// the chunk can reach.
+static int computeMaxDepth(SplVM* vm, DecodedChunk* decoded) {
+    int* depthAt = ALLOCATE(vm, int, decoded->count + 1);
+    for (int i = 0; i <= decoded->count; i++) depthAt[i] = -1;
+
+    int depth = 0;
+    int maxDepth = 0;
+    bool reachable = true;
+    for (int i = 0; i < decoded->count; i++) {
+        if (depthAt[i] >= 0 && (!reachable || depthAt[i] > depth)) {
+            depth = depthAt[i];
+        }
+        reachable = true;
+
+        Instruction* instr = &decoded->code[i];
+        depth += stackEffect(instr->op);
+        // OP_ADD_LOCAL_CONSTANT falls back to pushing both operands.
+        int peak = instr->op == OP_ADD_LOCAL_CONSTANT ? depth + 1 : depth;
+        if (peak > maxDepth) maxDepth = peak;
+
+        switch (instr->op) {
+            case OP_RETURN:
+                reachable = false;
+                break;
+            case OP_JUMP:
+            case OP_LOOP:
+                reachable = false;
+                // Fall through.
+            case OP_JUMP_IF_FALSE:
+            case OP_JUMP_IF_GREATER:
+            case OP_JUMP_IF_NOT_GREATER:
+            case OP_JUMP_IF_LESS:
+            case OP_JUMP_IF_NOT_LESS:
+                if (depth > depthAt[instr->a]) depthAt[instr->a] = depth;
+                break;
+            default:
+                break;
+        }
+    }
+
+    FREE_ARRAY(vm, int, depthAt, decoded->count + 1);
+    return maxDepth;
+}
+
+void decodeChunk(SplVM* vm, Chunk* chunk, DecodedChunk* decoded) {
+    // Byte offset -> instruction index, so jumps can be resolved. The
+    // extra entry covers a jump to the very end of the chunk.
+    int* indices = ALLOCATE(vm, int, chunk->count + 1);
+    int count = 0;
+    for (int offset = 0; offset < chunk->count;
+         offset += instructionLength(chunk->code[offset])) {
+        indices[offset] = count++;
+    }
+    indices[chunk->count] = count;
+
+    initDecodedChunk(decoded);
+    decoded->count = count;
+    decoded->code = ALLOCATE(vm, Instruction, count);
+    decoded->offsets = ALLOCATE(vm, int, count);
+
+    for (int offset = 0, i = 0; offset < chunk->count;
+         offset += instructionLength(chunk->code[offset]), i++) {
+        uint8_t instruction = chunk->code[offset];
+        uint8_t* operands = &chunk->code[offset + 1];
+        Instruction* out = &decoded->code[i];
+        out->op = shortForm(instruction);
+        out->a = 0;
+        out->b = 0;
+        decoded->offsets[i] = offset;
+
+        int length = instructionLength(instruction);
+        if (isJump(instruction)) {
+            int jump = (operands[0] << 8) | operands[1];
+            int target = instruction == OP_LOOP ? offset + 3 - jump : offset + 3 + jump;
+            out->a = indices[target];
+        } else if (instruction == OP_ADD_LOCAL_CONSTANT) {
+            out->a = operands[0];
+            out->b = operands[1];
+        } else if (length == 1 + CONSTANT_LONG_BYTE_SIZE) {
+            out->a = CONVERT_BYTE_ARRAY_TO_INT(operands, CONSTANT_LONG_BYTE_SIZE);
+        } else if (length == 2) {
+            out->a = operands[0];
+        }
+    }
+
+    FREE_ARRAY(vm, int, indices, chunk->count + 1);
+    decoded->maxDepth = computeMaxDepth(vm, decoded);
+}
@@ -8,37 +8,63 @@
 
 #define CONSTANT_LONG_BYTE_SIZE 4
 
+// Every opcode is listed once here; the OpCode enum and the VM's
+// threaded dispatch table are both generated from this list so they
+// can never drift apart.
+#define SPL_OPCODES(X) \
+    X(OP_CONSTANT_LONG) \
+    X(OP_CONSTANT) \
+    X(OP_NIL) \
+    X(OP_TRUE) \
+    X(OP_FALSE) \
+    X(OP_POP) \
+    X(OP_GET_GLOBAL) \
+    X(OP_GET_GLOBAL_LONG) \
+    X(OP_GET_LOCAL) \
+    X(OP_GET_LOCAL_LONG) \
+    X(OP_DEFINE_GLOBAL) \
+    X(OP_DEFINE_GLOBAL_LONG) \
+    X(OP_SET_GLOBAL) \
+    X(OP_SET_GLOBAL_LONG) \
+    X(OP_SET_LOCAL) \
+    X(OP_SET_LOCAL_LONG) \
+    X(OP_EQUAL) \
+    X(OP_GREATER) \
+    X(OP_LESS) \
+    X(OP_NOT) \
+    X(OP_NEGATE) \
+    X(OP_ADD) \
+    X(OP_SUBTRACT) \
+    X(OP_MULTIPLY) \
+    X(OP_DIVIDE) \
+    X(OP_PRINT) \
+    X(OP_JUMP_IF_FALSE) \
+    X(OP_JUMP) \
+    X(OP_LOOP) \
+    X(OP_RETURN) \
+    /* Superinstructions, see spl_peephole.c */ \
+    X(OP_NOT_GREATER) \
+    X(OP_NOT_LESS) \
+    X(OP_ADD_LOCAL_CONSTANT) \
+    X(OP_SET_LOCAL_POP) \
+    X(OP_SET_GLOBAL_POP) \
+    X(OP_JUMP_IF_GREATER) \
+    X(OP_JUMP_IF_NOT_GREATER) \
+    X(OP_JUMP_IF_LESS) \
+    X(OP_JUMP_IF_NOT_LESS) \
+    /* Quickened forms, rewritten in place by run() */ \
+    X(OP_ADD_NUM) \
+    X(OP_SUBTRACT_NUM) \
+    X(OP_MULTIPLY_NUM) \
+    X(OP_DIVIDE_NUM) \
+    X(OP_GREATER_NUM) \
+    X(OP_LESS_NUM) \
+    X(OP_ADD_LOCAL_CONSTANT_NUM)
+
 typedef enum {
-    OP_CONSTANT_LONG,
-    OP_CONSTANT,
-	OP_NIL,
-	OP_TRUE,
-	OP_FALSE,
-    OP_POP,
-    OP_GET_GLOBAL,
-    OP_GET_GLOBAL_LONG,
-    OP_GET_LOCAL,
-    OP_GET_LOCAL_LONG,
-    OP_DEFINE_GLOBAL,
-    OP_DEFINE_GLOBAL_LONG,
-    OP_SET_GLOBAL,
-    OP_SET_GLOBAL_LONG,
-    OP_SET_LOCAL,
-    OP_SET_LOCAL_LONG,
-	OP_EQUAL,
-	OP_GREATER,
-	OP_LESS,
-	OP_NOT,
-    OP_NEGATE,
-    OP_ADD,
-    OP_SUBTRACT,
-    OP_MULTIPLY,
-    OP_DIVIDE,
-    OP_PRINT,
-    OP_JUMP_IF_FALSE,
-    OP_JUMP,
-    OP_LOOP,
-    OP_RETURN,
+#define SPL_OPCODE_ENUM(name) name,
+    SPL_OPCODES(SPL_OPCODE_ENUM)
+#undef SPL_OPCODE_ENUM
 } OpCode;
 
 typedef struct {
@@ -47,14 +73,45 @@ typedef struct {
     uint8_t* code;
     LineArray lines;
     ValueArray constants;
+    // Open-addressed index of the constants by identity (interned
+    // strings by pointer, numbers by bits), so a literal or name used
+    // many times is stored once. Holds a constant index plus one, or 0
+    // for an empty slot; its capacity is zero or a power of two.
+    int constantSlotCapacity;
+    int* constantSlots;
 } Chunk;
 
+// A chunk decoded once before it runs: operands are widened to 32 bits,
+// the *_LONG opcodes become their short forms and jump offsets are
+// resolved to instruction indices, so run() never reassembles operands
+// from bytes.
+typedef struct {
+    uint8_t op;
+    // Constant index, slot or jump target (an instruction index).
+    int32_t a;
+    // Constant index of OP_ADD_LOCAL_CONSTANT.
+    int32_t b;
+} Instruction;
+
+typedef struct {
+    int count;
+    Instruction* code;
+    // Byte offset in the chunk of each instruction, for line numbers.
+    int* offsets;
+    // Most stack slots the chunk can use at once, locals included.
+    int maxDepth;
+} DecodedChunk;
 
 void initChunk(Chunk* chunk);
-void freeChunk(Chunk* chunk);
-void writeChunk(Chunk* chunk, uint8_t byte, int line);
-bool writeConstant(Chunk* chunk, Value value, int line);
-int addConstant(Chunk* chunk, Value value);
+void freeChunk(SplVM* vm, Chunk* chunk);
+void writeChunk(SplVM* vm, Chunk* chunk, uint8_t byte, int line);
+void truncateChunk(Chunk* chunk, int count, int constantCount);
+bool writeConstant(SplVM* vm, Chunk* chunk, Value value, int line);
+int addConstant(SplVM* vm, Chunk* chunk, Value value);
+int instructionLength(uint8_t instruction);
+void initDecodedChunk(DecodedChunk* decoded);
+void freeDecodedChunk(SplVM* vm, DecodedChunk* decoded);
+void decodeChunk(SplVM* vm, Chunk* chunk, DecodedChunk* decoded);
 
 
 #endif
\ No newline at end of file
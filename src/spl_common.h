@@ -8,7 +8,50 @@
 
 // #define DEBUG_PRINT_CODE
 // #define DEBUG_TRACE_EXECUTION
+// Collect before every allocation that grows the heap.
+// #define DEBUG_STRESS_GC
+// #define DEBUG_LOG_GC
+
+// Threaded dispatch through a table of label addresses (GCC/Clang
+// "labels as values"). Build with -DSPL_NO_COMPUTED_GOTO to fall back
+// to the portable switch loop.
+#if defined(__GNUC__) && !defined(SPL_NO_COMPUTED_GOTO)
+#define SPL_COMPUTED_GOTO
+#endif
+
+// Pack every Value into a single 8-byte double, hiding non-number values
+// in the payload of a quiet NaN. Build with -DSPL_NO_NAN_BOXING to use
+// the 16-byte tagged union instead.
+#ifndef SPL_NO_NAN_BOXING
+#define NAN_BOXING
+#endif
+
+// Baseline JIT for hot loops (--jit). It emits x86-64 code for the
+// NaN-boxed representation, so it is only built there. Build with
+// -DSPL_NO_JIT to leave it out.
+#if defined(__x86_64__) && defined(__unix__) && defined(NAN_BOXING) && \
+    !defined(DEBUG_TRACE_EXECUTION) && !defined(SPL_NO_JIT)
+#define SPL_JIT
+#endif
+
+// Serve small allocations from per-VM size-class pools instead of
+// malloc. Build with -DSPL_NO_POOL to send everything to the system
+// allocator.
+#ifndef SPL_NO_POOL
+#define SPL_POOL
+#endif
+
+// Match hash table control bytes 16 at a time with SSE2 where the
+// target has it. Build with -DSPL_NO_SIMD to use the portable loop.
+#if defined(__SSE2__) && !defined(SPL_NO_SIMD)
+#define SPL_SSE2
+#endif
 
 #define UINT8_COUNT (UINT8_MAX + 1)
 
+// All interpreter state lives in an SplVM (see spl_vm.h) that is passed
+// to every function that allocates or runs code, so independent VMs can
+// run side by side on different threads.
+typedef struct SplVM SplVM;
+
 #endif
\ No newline at end of file
@@ -1,14 +1,17 @@
+#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "spl_common.h"
 #include "spl_compiler.h"
+#include "spl_ir.h"
 #include "spl_lexer.h"
+#include "spl_vm.h"
 #include "spl_utils.h"
 
 #ifdef DEBUG_PRINT_CODE
-#include "debug.h"
+#include "spl_debug.h"
 #endif
 
 #define ANSI_COLOR_RED     "\x1b[31m"
@@ -16,13 +19,6 @@
 #define MAG "\e[0;35m"
 #define CYN "\e[0;36m"
 
-typedef struct {
-    spl_token current;
-    spl_token previous;
-    bool hadError;
-    bool panicMode;
-} Parser;
-
 typedef enum {
     PREC_NONE,
     PREC_ASSIGNMENT, // =
@@ -37,7 +33,8 @@ typedef enum {
     PREC_PRIMARY
 } Precedence;
 
-typedef void (*ParseFn)(bool canAssign);
+// Returns whether the expression it compiled always yields a number.
+typedef bool (*ParseFn)(SplVM* vm, bool canAssign);
 
 
 typedef struct {
@@ -46,38 +43,20 @@ typedef struct {
     Precedence precedence;
 } ParseRule;
 
-typedef struct {
-    spl_token name;
-    int depth;
-    bool final;
-} Local;
-
-typedef struct {
-    Local locals[UINT8_COUNT];
-    int localCount;
-    int scopeDepth;
-} Compiler;
-
-
-Parser parser;
-
-Compiler* current = NULL;
 
-Chunk* compilingChunk;
-
-static Chunk* currentChunk() {
-    return compilingChunk;
+static Chunk* currentChunk(SplVM* vm) {
+    return vm->compilingChunk;
 }
 
 // TODO needs refactoring
-static void errorAt(spl_token* token, const char* message) {
+static void errorAt(SplVM* vm, spl_token* token, const char* message) {
 
-    if (parser.panicMode) return;
+    if (vm->parser.panicMode) return;
 
     int lineNr = token->line;
     int length = 0;
     
-    parser.panicMode = true;
+    vm->parser.panicMode = true;
     fprintf(stderr, "%s[line %d] Error", ANSI_COLOR_RED, lineNr);
     if (token->type == TK_EOF) {
         fprintf(stderr, " at end");
@@ -89,131 +68,136 @@ static void errorAt(spl_token* token, const char* message) {
     // print line before 
     
     fprintf(stderr,"^\n%s", ANSI_COLOR_RESET);
-    parser.hadError = true;
+    vm->parser.hadError = true;
 }
 
-static void error(const char* message) {
-    errorAt(&parser.previous, message);
+static void error(SplVM* vm, const char* message) {
+    errorAt(vm, &vm->parser.previous, message);
 }
 
-static void errorAtCurrent(const char* message) {
-    errorAt(&parser.current, message);
+static void errorAtCurrent(SplVM* vm, const char* message) {
+    errorAt(vm, &vm->parser.current, message);
 }
 
-static void advance() {
-    parser.previous = parser.current;
+static void advance(SplVM* vm) {
+    vm->parser.previous = vm->parser.current;
     for(;;) {
-        parser.current = next_token();
-        if (parser.current.type != TK_ERROR) break;
-        errorAtCurrent(parser.current.start);
+        vm->parser.current = next_token(&vm->lexer);
+        if (vm->parser.current.type != TK_ERROR) break;
+        errorAtCurrent(vm, vm->parser.current.start);
     }
 
 }
 
-static void consume(spl_token_type type, const char* message) {
-    if (parser.current.type == type) {
-        advance();
+static void consume(SplVM* vm, spl_token_type type, const char* message) {
+    if (vm->parser.current.type == type) {
+        advance(vm);
         return;
     }
-    errorAtCurrent(message);
+    errorAtCurrent(vm, message);
 }
 
-static bool check(spl_token_type type) {
-    return parser.current.type == type;
+static bool check(SplVM* vm, spl_token_type type) {
+    return vm->parser.current.type == type;
 }
 
-static bool match(spl_token_type type) {
-    if (!check(type)) return false;
-    advance();
+static bool match(SplVM* vm, spl_token_type type) {
+    if (!check(vm, type)) return false;
+    advance(vm);
     return true;
 }
 
-static void emitByte(uint8_t byte) {
-    writeChunk(currentChunk(), byte, parser.previous.line);
+static void emitByte(SplVM* vm, uint8_t byte) {
+    writeChunk(vm, currentChunk(vm), byte, vm->parser.previous.line);
 }
 
-static void emitBytes(uint8_t byte1, uint8_t byte2) {
-	emitByte(byte1);
-	emitByte(byte2);
+static void emitBytes(SplVM* vm, uint8_t byte1, uint8_t byte2) {
+	emitByte(vm, byte1);
+	emitByte(vm, byte2);
 }
 
-static void emitLoop(int loopStart) {
-    emitByte(OP_LOOP);
+static void emitLoop(SplVM* vm, int loopStart) {
+    emitByte(vm, OP_LOOP);
 
-    int offset = currentChunk()->count - loopStart + 2;
-    if (offset > UINT16_MAX) error("Loop body too large.");
+    int offset = currentChunk(vm)->count - loopStart + 2;
+    if (offset > UINT16_MAX) error(vm, "Loop body too large.");
 
-    emitByte((offset >> 8) & 0xff);
-    emitByte(offset & 0xff);
+    emitByte(vm, (offset >> 8) & 0xff);
+    emitByte(vm, offset & 0xff);
 }
 
-static int emitJump(uint8_t instruction) {
-    emitByte(instruction);
-    emitByte(0xff);
-    emitByte(0xff);
-    return currentChunk()->count - 2;
+static int emitJump(SplVM* vm, uint8_t instruction) {
+    emitByte(vm, instruction);
+    emitByte(vm, 0xff);
+    emitByte(vm, 0xff);
+    return currentChunk(vm)->count - 2;
 }
 
-static void emitReturn() {
-    emitByte(OP_RETURN);
+static void emitReturn(SplVM* vm) {
+    emitByte(vm, OP_RETURN);
 }
 
-static int emitConstant(Value value) {
-    int index = writeConstant(currentChunk(), value, parser.previous.line);
+static int emitConstant(SplVM* vm, Value value) {
+    int index = writeConstant(vm, currentChunk(vm), value, vm->parser.previous.line);
     if(index == -1){
-        error("Too many constants in one chunk");
+        error(vm, "Too many constants in one chunk");
     }
     return index;
 }
 
-static void patchJump(int offset) {
-    int jump = currentChunk()->count - offset - 2;
+static void patchJump(SplVM* vm, int offset) {
+    int jump = currentChunk(vm)->count - offset - 2;
     if (jump > UINT16_MAX) {
-        error("Too much code to jump over.");
+        error(vm, "Too much code to jump over.");
     }
-    currentChunk()->code[offset] = (jump >> 8) & 0xff;
-    currentChunk()->code[offset + 1] = jump & 0xff;
+    currentChunk(vm)->code[offset] = (jump >> 8) & 0xff;
+    currentChunk(vm)->code[offset + 1] = jump & 0xff;
 }
 
-static void initCompiler(Compiler* compiler) {
+static void initCompiler(SplVM* vm, Compiler* compiler) {
     compiler->localCount = 0;
     compiler->scopeDepth = 0;
-    current = compiler;
+    compiler->operandStart = 0;
+    compiler->operandConstants = 0;
+    compiler->operandIsNumber = false;
+    compiler->tree = NULL;
+    vm->compiler = compiler;
 }
 
-static void endCompiler() {
-    emitReturn();
+static void endCompiler(SplVM* vm) {
+    emitReturn(vm);
 #ifdef DEBUG_PRINT_CODE
-    if(!parser.hadError) {
-        disassembleChunk(currentChunk(), "code");
+    if(!vm->parser.hadError) {
+        disassembleChunk(vm, currentChunk(vm), "code");
     }
 #endif
 }
 
-static void beginScope() {
-    current->scopeDepth++;
+static void beginScope(SplVM* vm) {
+    vm->compiler->scopeDepth++;
 }
 
-static void endScope() {
-    current->scopeDepth--;
-    while(current->localCount > 0 &&
-            current->locals[current->localCount -1].depth >
-                current->scopeDepth) {
-        emitByte(OP_POP);
-        current->localCount--;
+static void endScope(SplVM* vm) {
+    vm->compiler->scopeDepth--;
+    while(vm->compiler->localCount > 0 &&
+            vm->compiler->locals[vm->compiler->localCount -1].depth >
+                vm->compiler->scopeDepth) {
+        // A tree's locals are popped when it is lowered.
+        if (vm->compiler->tree == NULL) emitByte(vm, OP_POP);
+        vm->compiler->localCount--;
     } 
 }
 
 
-static void expression();
-static void statement();
-static void declaration();
+static bool expression(SplVM* vm);
+static void statement(SplVM* vm);
+static void declaration(SplVM* vm);
 static ParseRule* getRule(spl_token_type type);
-static void parsePrecedence(Precedence precedence);
+static bool parsePrecedence(SplVM* vm, Precedence precedence);
 
-static uint32_t identifierConstant(spl_token* name) {
-    int constant = addConstant(currentChunk(), OBJ_VAL(copyString(name->start, name->length)));
-    return (u_int32_t) constant;
+static uint32_t identifierGlobal(SplVM* vm, spl_token* name) {
+    int slot = globalSlot(vm, copyString(vm, name->start, name->length));
+    return (u_int32_t) slot;
 }
 
 static bool identifierEqual(spl_token* a, spl_token* b) {
@@ -221,12 +205,12 @@ static bool identifierEqual(spl_token* a, spl_token* b) {
     return memcmp(a->start, b->start, a->length) == 0;
 }
 
-static int resolveLocal(Compiler* compiler, spl_token* name) {
+static int resolveLocal(SplVM* vm, Compiler* compiler, spl_token* name) {
     for (int i = compiler->localCount -1; i >= 0; i--) {
         Local* local = &compiler->locals[i];
         if (identifierEqual(name, &local->name)) {
             if (local->depth == -1) {
-                error("Can't read local variable in its own initializer.");
+                error(vm, "Can't read local variable in its own initializer.");
             }
             return i;
         }
@@ -234,99 +218,143 @@ static int resolveLocal(Compiler* compiler, spl_token* name) {
     return -1;
 }
 
-static void addLocal(spl_token name, bool isFinal) {
-    if (current->localCount == UINT8_COUNT) {
-        error("Too many local variables in function.");
+static void addLocal(SplVM* vm, spl_token name, bool isFinal) {
+    if (vm->compiler->localCount == UINT8_COUNT) {
+        error(vm, "Too many local variables in function.");
+        return;
     }
-    Local* local = &current->locals[current->localCount++];
+    Local* local = &vm->compiler->locals[vm->compiler->localCount++];
     local->name = name;
     local->depth = -1;
     local->final = isFinal;
-    local->depth = current->scopeDepth;
+    local->depth = vm->compiler->scopeDepth;
 }
 
-static void declareVariable(bool isFinal) {
+static void declareVariable(SplVM* vm, bool isFinal) {
 
-    if (current->scopeDepth == 0) return;
-    spl_token* name = &parser.previous;
-    for (int i = current->localCount -1; i >= 0; i--) {
-        Local* local = &current->locals[i];
-        if (local->depth != -1 && local->depth < current->scopeDepth) {
+    if (vm->compiler->scopeDepth == 0) return;
+    spl_token* name = &vm->parser.previous;
+    for (int i = vm->compiler->localCount -1; i >= 0; i--) {
+        Local* local = &vm->compiler->locals[i];
+        if (local->depth != -1 && local->depth < vm->compiler->scopeDepth) {
             break;
         }
         if (identifierEqual(name, &local->name)) {
-            error("Already variable with this name in this scope");
+            error(vm, "Already variable with this name in this scope");
         }
     }
-    addLocal(*name, isFinal);
+    addLocal(vm, *name, isFinal);
 }
 
-static uint32_t parseVariable(const char* errorMessage) {
+static uint32_t parseVariable(SplVM* vm, const char* errorMessage) {
     bool isFinal = false;
-    consume(TK_IDENTIFIER, errorMessage);
-    declareVariable(isFinal);
-    if (current->scopeDepth > 0) return 0;
-    return identifierConstant(&parser.previous);
+    consume(vm, TK_IDENTIFIER, errorMessage);
+    declareVariable(vm, isFinal);
+    if (vm->compiler->scopeDepth > 0) return 0;
+    return identifierGlobal(vm, &vm->parser.previous);
 }
 
-static void markInitialized() {
-    current->locals[current->localCount - 1].depth = current->scopeDepth;
+static void markInitialized(SplVM* vm) {
+    vm->compiler->locals[vm->compiler->localCount - 1].depth = vm->compiler->scopeDepth;
 }
 
-static void defineVariable(uint32_t global) {
-    if (current->scopeDepth > 0) {
-        markInitialized();
+static void defineVariable(SplVM* vm, uint32_t global) {
+    if (vm->compiler->scopeDepth > 0) {
+        markInitialized(vm);
         return;
     }
     if (global <= UINT8_MAX) {
-        emitBytes(OP_DEFINE_GLOBAL, (uint8_t) global);
+        emitBytes(vm, OP_DEFINE_GLOBAL, (uint8_t) global);
     } else if (global <= UINT32_MAX) {
         uint8_t largeConstant[CONSTANT_LONG_BYTE_SIZE];
         CONVERT_TO_BYTE_ARRAY(largeConstant, CONSTANT_LONG_BYTE_SIZE, global);
-        emitByte(OP_DEFINE_GLOBAL_LONG);
+        emitByte(vm, OP_DEFINE_GLOBAL_LONG);
         for (int i = 0; i < CONSTANT_LONG_BYTE_SIZE; i++) {
-            emitByte(largeConstant[i]);
+            emitByte(vm, largeConstant[i]);
         }
     } else {
-        error("Too many constants in one chunk");
+        error(vm, "Too many constants in one chunk");
     }
 }
 
-static void and_(bool canAssign) {
-    int endJump = emitJump(OP_JUMP_IF_FALSE);
-    emitByte(OP_POP);
-    parsePrecedence(PREC_AND);
-    patchJump(endJump);
+// Constant folding works on the code just emitted: an operand is a
+// constant if its code, from 'start' to 'end', is one instruction that
+// loads a constant.
+static bool constantOperand(SplVM* vm, int start, int end, Value* value) {
+    Chunk* chunk = currentChunk(vm);
+    if (start >= end || start + instructionLength(chunk->code[start]) != end) return false;
+    uint8_t* operands = &chunk->code[start + 1];
+    switch (chunk->code[start]) {
+        case OP_CONSTANT: *value = chunk->constants.values[operands[0]]; return true;
+        case OP_CONSTANT_LONG:
+            *value = chunk->constants.values[
+                    CONVERT_BYTE_ARRAY_TO_INT(operands, CONSTANT_LONG_BYTE_SIZE)];
+            return true;
+        case OP_TRUE: *value = BOOL_VAL(true); return true;
+        case OP_FALSE: *value = BOOL_VAL(false); return true;
+        case OP_NIL: *value = NIL_VAL; return true;
+        default: return false;
+    }
 }
 
-static void number(bool canAssign) {
-    double value = strtod(parser.previous.start, NULL);
-    emitConstant(NUMBER_VAL(value));
+// Replaces the code from 'start' on, and the constants it added, by a
+// load of 'value'. Returns whether that is a number.
+static bool emitFolded(SplVM* vm, int start, int constantCount, Value value) {
+    truncateChunk(currentChunk(vm), start, constantCount);
+    if (IS_BOOL(value)) {
+        emitByte(vm, AS_BOOL(value) ? OP_TRUE : OP_FALSE);
+    } else if (IS_NIL(value)) {
+        emitByte(vm, OP_NIL);
+    } else {
+        emitConstant(vm, value);
+    }
+    return IS_NUMBER(value);
 }
 
-static void or_(bool canAssign) {
-    int elseJump = emitJump(OP_JUMP_IF_FALSE);
-    int endJump = emitJump(OP_JUMP);
-    patchJump(elseJump);
-    emitByte(OP_POP);
+static bool isFalseyConstant(Value value) {
+    return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
+}
 
-    parsePrecedence(PREC_OR);
-    patchJump(endJump);
+static bool and_(SplVM* vm, bool canAssign) {
+    int endJump = emitJump(vm, OP_JUMP_IF_FALSE);
+    emitByte(vm, OP_POP);
+    parsePrecedence(vm, PREC_AND);
+    patchJump(vm, endJump);
+    return false;
 }
 
-static void string(bool canAssign) {
-	emitConstant(OBJ_VAL(copyString(parser.previous.start + 1,
-						parser.previous.length - 2)));
+static bool number(SplVM* vm, bool canAssign) {
+    double value = strtod(vm->parser.previous.start, NULL);
+    emitConstant(vm, NUMBER_VAL(value));
+    return true;
 }
 
-static void namedVariable(spl_token name, bool canAssign) {
+static bool or_(SplVM* vm, bool canAssign) {
+    int elseJump = emitJump(vm, OP_JUMP_IF_FALSE);
+    int endJump = emitJump(vm, OP_JUMP);
+    patchJump(vm, elseJump);
+    emitByte(vm, OP_POP);
+
+    parsePrecedence(vm, PREC_OR);
+    patchJump(vm, endJump);
+    return false;
+}
+
+static bool string(SplVM* vm, bool canAssign) {
+	emitConstant(vm, OBJ_VAL(copyString(vm, vm->parser.previous.start + 1,
+						vm->parser.previous.length - 2)));
+	return false;
+}
+
+static void namedVariable(SplVM* vm, spl_token name, bool canAssign) {
     uint8_t getOp, setOp;
-    int arg = resolveLocal(current, &name);
-    if (arg != -1) {
+    int arg = resolveLocal(vm, vm->compiler, &name);
+    bool isLocal = arg != -1;
+    if (isLocal) {
         getOp = arg <= UINT8_MAX ? OP_GET_LOCAL : OP_GET_LOCAL_LONG;
         setOp = arg <= UINT8_MAX ? OP_SET_LOCAL : OP_SET_LOCAL_LONG;
     } else {
-        arg = identifierConstant(&name);
+        arg = identifierGlobal(vm, &name);
         getOp = arg <= UINT8_MAX ? OP_GET_GLOBAL : OP_GET_GLOBAL_LONG;
         setOp = arg <= UINT8_MAX ? OP_SET_GLOBAL : OP_SET_GLOBAL_LONG;
     }
@@ -334,95 +362,177 @@ static void namedVariable(spl_token name, bool canAssign) {
     if (getOp == OP_GET_LOCAL_LONG || getOp == OP_GET_GLOBAL_LONG) {
         uint8_t largeConstant[CONSTANT_LONG_BYTE_SIZE];
         CONVERT_TO_BYTE_ARRAY(largeConstant, CONSTANT_LONG_BYTE_SIZE, arg);
-        if (match(TK_EQUAL) && canAssign) {
-            Local* local = &current->locals[arg];
-            if (local->final) {
-                error("Can't reassign final variable");
+        if (match(vm, TK_EQUAL) && canAssign) {
+            if (isLocal && vm->compiler->locals[arg].final) {
+                error(vm, "Can't reassign final variable");
             }
-            expression();
-            emitByte(setOp);
+            expression(vm);
+            emitByte(vm, setOp);
         } else {
-            emitByte(getOp);
+            emitByte(vm, getOp);
         }
         // Adds 4 bytes of memory to the chunk
         for (int i = 0; i < CONSTANT_LONG_BYTE_SIZE; i++) {
-                emitByte(largeConstant[i]);
+                emitByte(vm, largeConstant[i]);
         }
     } else {
-        if (match(TK_EQUAL) && canAssign) {
-            Local* local = &current->locals[arg];
-            if (local->final) {
-                error("Can't reassign final variable");
+        if (match(vm, TK_EQUAL) && canAssign) {
+            if (isLocal && vm->compiler->locals[arg].final) {
+                error(vm, "Can't reassign final variable");
             }
-            expression();
-            emitBytes(setOp, arg);
+            expression(vm);
+            emitBytes(vm, setOp, arg);
         } else {
-             emitBytes(getOp, (uint8_t) arg);
+             emitBytes(vm, getOp, (uint8_t) arg);
         }
     }
 }
 
-static void variable(bool canAssign) {
-    namedVariable(parser.previous, canAssign);
+static bool variable(SplVM* vm, bool canAssign) {
+    namedVariable(vm, vm->parser.previous, canAssign);
+    return false;
 }
 
-static void unary(bool canAssign) {
-    spl_token_type operatorType = parser.previous.type;
+static bool unary(SplVM* vm, bool canAssign) {
+    spl_token_type operatorType = vm->parser.previous.type;
+    int start = currentChunk(vm)->count;
+    int constantCount = currentChunk(vm)->constants.count;
     // compile the operand
-    parsePrecedence(PREC_UNARY);
+    parsePrecedence(vm, PREC_UNARY);
+
+    Value operand;
+    if (constantOperand(vm, start, currentChunk(vm)->count, &operand)) {
+        if (operatorType == TK_BANG) {
+            return emitFolded(vm, start, constantCount, BOOL_VAL(isFalseyConstant(operand)));
+        }
+        if (operatorType == TK_MINUS && IS_NUMBER(operand)) {
+            return emitFolded(vm, start, constantCount, NUMBER_VAL(-AS_NUMBER(operand)));
+        }
+    }
+
     // Emit the operator instruction
     switch (operatorType)
     {
-		case TK_BANG: emitByte(OP_NOT); break;
-		case TK_MINUS: emitByte(OP_NEGATE); break;
+		case TK_BANG: emitByte(vm, OP_NOT); return false;
+		case TK_MINUS: emitByte(vm, OP_NEGATE); return true;
         default:
-            return; // Unreachable
+            return false; // Unreachable
     }
 
 }
 
+// Evaluates 'a operator b' for constant operands the way the VM would.
+// Returns false for combinations that fail at runtime, which are left
+// to do so.
+static bool foldBinary(SplVM* vm, spl_token_type operatorType, Value a, Value b,
+                       Value* result) {
+    if (operatorType == TK_EQUAL_EQUAL) {
+        *result = BOOL_VAL(valuesEqual(a, b));
+        return true;
+    }
+    if (operatorType == TK_PLUS && IS_STRING(a) && IS_STRING(b)) {
+        ObjString* left = AS_STRING(a);
+        ObjString* right = AS_STRING(b);
+        int length = left->length + right->length;
+        char* chars = ALLOCATE(vm, char, length + 1);
+        memcpy(chars, left->chars, left->length);
+        memcpy(chars + left->length, right->chars, right->length);
+        chars[length] = '\0';
+        *result = OBJ_VAL(takeString(vm, chars, length));
+        return true;
+    }
+    if (!IS_NUMBER(a) || !IS_NUMBER(b)) return false;
+
+    double x = AS_NUMBER(a);
+    double y = AS_NUMBER(b);
+    switch (operatorType) {
+        case TK_PLUS: *result = NUMBER_VAL(x + y); return true;
+        case TK_MINUS: *result = NUMBER_VAL(x - y); return true;
+        case TK_STAR: *result = NUMBER_VAL(x * y); return true;
+        case TK_SLASH: *result = NUMBER_VAL(x / y); return true;
+        case TK_GREATER: *result = BOOL_VAL(x > y); return true;
+        case TK_LESS: *result = BOOL_VAL(x < y); return true;
+        // Compiled as the negated opposite, which matters for NaN.
+        case TK_GREATER_EQUAL: *result = BOOL_VAL(!(x < y)); return true;
+        case TK_LESS_EQUAL: *result = BOOL_VAL(!(x > y)); return true;
+        default: return false;
+    }
+}
 
+// Whether 'x operator b' is x for every number x: x * 1, x / 1, x - 0
+// and x + -0. (x + 0 is not: -0 + 0 is 0.)
+static bool isIdentity(spl_token_type operatorType, Value b) {
+    if (!IS_NUMBER(b)) return false;
+    double y = AS_NUMBER(b);
+    switch (operatorType) {
+        case TK_STAR:
+        case TK_SLASH: return y == 1;
+        case TK_MINUS: return y == 0 && !signbit(y);
+        case TK_PLUS: return y == 0 && signbit(y);
+        default: return false;
+    }
+}
 
-static void binary(bool canAssign) {
+
+
+static bool binary(SplVM* vm, bool canAssign) {
     // Remember the operator
-    spl_token_type operatorType = parser.previous.type;
+    spl_token_type operatorType = vm->parser.previous.type;
     // previous: +, current: 1
+    int start = vm->compiler->operandStart;
+    int constantCount = vm->compiler->operandConstants;
+    int rightStart = currentChunk(vm)->count;
+    int rightConstants = currentChunk(vm)->constants.count;
+    bool leftIsNumber = vm->compiler->operandIsNumber;
 
     // Compile the rig`
     ParseRule* rule = getRule(operatorType);
-    parsePrecedence((Precedence)(rule->precedence + 1));
+    bool rightIsNumber = parsePrecedence(vm, (Precedence)(rule->precedence + 1));
+
+    int end = currentChunk(vm)->count;
+    Value a, b, result;
+    bool rightIsConstant = constantOperand(vm, rightStart, end, &b);
+    if (rightIsConstant && constantOperand(vm, start, rightStart, &a) &&
+            foldBinary(vm, operatorType, a, b, &result)) {
+        return emitFolded(vm, start, constantCount, result);
+    }
+    if (rightIsConstant && leftIsNumber && isIdentity(operatorType, b)) {
+        truncateChunk(currentChunk(vm), rightStart, rightConstants);
+        return true;
+    }
 
     // Emit the operator instruction
     switch (operatorType)
     {
-		case TK_EQUAL_EQUAL: emitByte(OP_EQUAL); break;
-		case TK_GREATER: emitByte(OP_GREATER); break;
-		case TK_GREATER_EQUAL: emitBytes(OP_LESS, OP_NOT); break;
-		case TK_LESS: emitByte(OP_LESS); break;
-		case TK_LESS_EQUAL: emitBytes(OP_GREATER, OP_NOT); break;
-        case TK_PLUS: emitByte(OP_ADD); break;
-        case TK_MINUS: emitByte(OP_SUBTRACT); break;
-        case TK_STAR: emitByte(OP_MULTIPLY); break;
-        case TK_SLASH: emitByte(OP_DIVIDE); break;
+		case TK_EQUAL_EQUAL: emitByte(vm, OP_EQUAL); return false;
+		case TK_GREATER: emitByte(vm, OP_GREATER); return false;
+		case TK_GREATER_EQUAL: emitBytes(vm, OP_LESS, OP_NOT); return false;
+		case TK_LESS: emitByte(vm, OP_LESS); return false;
+		case TK_LESS_EQUAL: emitBytes(vm, OP_GREATER, OP_NOT); return false;
+        case TK_PLUS: emitByte(vm, OP_ADD); return leftIsNumber && rightIsNumber;
+        case TK_MINUS: emitByte(vm, OP_SUBTRACT); return true;
+        case TK_STAR: emitByte(vm, OP_MULTIPLY); return true;
+        case TK_SLASH: emitByte(vm, OP_DIVIDE); return true;
         default:
-            return; // Unreachable
+            return false; // Unreachable
     }
 }
 
-static void literal(bool canAssign) {
-	switch(parser.previous.type) {
-		case TK_FALSE: emitByte(OP_FALSE); break;
-		case TK_NULL: emitByte(OP_NIL); break;
-		case TK_TRUE: emitByte(OP_TRUE); break;
+static bool literal(SplVM* vm, bool canAssign) {
+	switch(vm->parser.previous.type) {
+		case TK_FALSE: emitByte(vm, OP_FALSE); break;
+		case TK_NULL: emitByte(vm, OP_NIL); break;
+		case TK_TRUE: emitByte(vm, OP_TRUE); break;
 		default:
 			break; // Unreachable
 	}
-
+	return false;
 }
 
-static void grouping(bool canAssign) {
-    expression();
-    consume(TK_RIGHT_PAREN, "Expect ')' after expression");
+static bool grouping(SplVM* vm, bool canAssign) {
+    bool isNumber = expression(vm);
+    consume(vm, TK_RIGHT_PAREN, "Expect ')' after expression");
+    return isNumber;
 }
 
 ParseRule rules[] = {
@@ -462,24 +572,30 @@ ParseRule rules[] = {
 
 
 
-static void parsePrecedence(Precedence precedence) {
-    advance(); 
-    ParseFn prefixRule = getRule(parser.previous.type)->prefix;
+static bool parsePrecedence(SplVM* vm, Precedence precedence) {
+    advance(vm); 
+    ParseFn prefixRule = getRule(vm->parser.previous.type)->prefix;
     if (prefixRule == NULL) {
-        error("Expect expression.");
-        return;
+        error(vm, "Expect expression.");
+        return false;
     }
 
     bool canAssign = precedence <= PREC_ASSIGNMENT;
-    prefixRule(canAssign);
-    while(precedence <= getRule(parser.current.type)->precedence) {
-        advance(); 
-        ParseFn infixRule = getRule(parser.previous.type)->infix;
-        infixRule(canAssign);
+    int start = currentChunk(vm)->count;
+    int constantCount = currentChunk(vm)->constants.count;
+    bool isNumber = prefixRule(vm, canAssign);
+    while(precedence <= getRule(vm->parser.current.type)->precedence) {
+        advance(vm); 
+        ParseFn infixRule = getRule(vm->parser.previous.type)->infix;
+        vm->compiler->operandStart = start;
+        vm->compiler->operandConstants = constantCount;
+        vm->compiler->operandIsNumber = isNumber;
+        isNumber = infixRule(vm, canAssign);
     }
-    if (canAssign && match(TK_EQUAL)) {
-        error("Invalid assignment target.");
+    if (canAssign && match(vm, TK_EQUAL)) {
+        error(vm, "Invalid assignment target.");
     }
+    return isNumber;
 }
 
 static ParseRule* getRule(spl_token_type type) {
@@ -488,78 +604,78 @@ static ParseRule* getRule(spl_token_type type) {
 
 
 
-static void expression() {
-    parsePrecedence(PREC_ASSIGNMENT);
+static bool expression(SplVM* vm) {
+    return parsePrecedence(vm, PREC_ASSIGNMENT);
 }
 
-static void block() {
-    while(!check(TK_RIGHT_BRACE) && !check(TK_EOF)) {
-        declaration();
+static void block(SplVM* vm) {
+    while(!check(vm, TK_RIGHT_BRACE) && !check(vm, TK_EOF)) {
+        declaration(vm);
     }
-    consume(TK_RIGHT_BRACE, "Expect '}' after block.");
+    consume(vm, TK_RIGHT_BRACE, "Expect '}' after block.");
 }
 
-static void varDeclaration() {
-    uint32_t global = parseVariable("Expect variable name.");
+static void varDeclaration(SplVM* vm) {
+    uint32_t global = parseVariable(vm, "Expect variable name.");
 
-    if (match(TK_EQUAL)) {
-        expression();
+    if (match(vm, TK_EQUAL)) {
+        expression(vm);
     } else {
-        emitByte(OP_NIL);
+        emitByte(vm, OP_NIL);
     }
-    consume(TK_SEMICOLON, "Expect ';' after variable declaration.");
-    defineVariable(global);
+    consume(vm, TK_SEMICOLON, "Expect ';' after variable declaration.");
+    defineVariable(vm, global);
 }
 
-static void expressionStatement() {
-    expression();
-    consume(TK_SEMICOLON, "Expect ';' after expression.");
-    emitByte(OP_POP);
+static void expressionStatement(SplVM* vm) {
+    expression(vm);
+    consume(vm, TK_SEMICOLON, "Expect ';' after expression.");
+    emitByte(vm, OP_POP);
 }
 
-static void printStatement() {
-    expression();
-    consume(TK_SEMICOLON, "Expect ';' after value.");
-    emitByte(OP_PRINT);
+static void printStatement(SplVM* vm) {
+    expression(vm);
+    consume(vm, TK_SEMICOLON, "Expect ';' after value.");
+    emitByte(vm, OP_PRINT);
 }
 
-static void whileStatement() {
-    int loopStart = currentChunk()->count;
-    consume(TK_LEFT_PAREN, "Expect '(' after 'while'.");
-    expression();
-    consume(TK_RIGHT_PAREN, "Expect ')' after condition.");
+static void whileStatement(SplVM* vm) {
+    int loopStart = currentChunk(vm)->count;
+    consume(vm, TK_LEFT_PAREN, "Expect '(' after 'while'.");
+    expression(vm);
+    consume(vm, TK_RIGHT_PAREN, "Expect ')' after condition.");
 
-    int exitJump = emitJump(OP_JUMP_IF_FALSE);
+    int exitJump = emitJump(vm, OP_JUMP_IF_FALSE);
 
-    emitByte(OP_POP);
-    statement();
+    emitByte(vm, OP_POP);
+    statement(vm);
 
-    emitLoop(loopStart);
+    emitLoop(vm, loopStart);
 
-    patchJump(exitJump);
-    emitByte(OP_POP);
+    patchJump(vm, exitJump);
+    emitByte(vm, OP_POP);
 }
 
-static void ifStatement() {
-    consume(TK_LEFT_PAREN, "Expect '(' after 'if'.");
-    expression();
-    consume(TK_RIGHT_PAREN, "Expect ')' after condition.");
-    int thenJump = emitJump(OP_JUMP_IF_FALSE);
-    emitByte(OP_POP);
-    statement();
-    int elseJump = emitJump(OP_JUMP);
-    patchJump(thenJump);
-    emitByte(OP_POP);
-    if (match(TK_ELSE)) statement();
-    patchJump(elseJump);
+static void ifStatement(SplVM* vm) {
+    consume(vm, TK_LEFT_PAREN, "Expect '(' after 'if'.");
+    expression(vm);
+    consume(vm, TK_RIGHT_PAREN, "Expect ')' after condition.");
+    int thenJump = emitJump(vm, OP_JUMP_IF_FALSE);
+    emitByte(vm, OP_POP);
+    statement(vm);
+    int elseJump = emitJump(vm, OP_JUMP);
+    patchJump(vm, thenJump);
+    emitByte(vm, OP_POP);
+    if (match(vm, TK_ELSE)) statement(vm);
+    patchJump(vm, elseJump);
 }
 
-static void synchronize() {
-    parser.panicMode = false;
-    while(parser.current.type != TK_EOF) {
-        if (parser.previous.type == TK_SEMICOLON) return;
+static void synchronize(SplVM* vm) {
+    vm->parser.panicMode = false;
+    while(vm->parser.current.type != TK_EOF) {
+        if (vm->parser.previous.type == TK_SEMICOLON) return;
 
-        switch (parser.current.type) {
+        switch (vm->parser.current.type) {
 
             case TK_VAR:
             case TK_IF:
@@ -570,48 +686,361 @@ static void synchronize() {
                 // do nothing
                 ;
         }
-        advance();
+        advance(vm);
       
     }
 }
 
-static void declaration() {
-    if (match(TK_VAR)) {
-        varDeclaration();
+static void declaration(SplVM* vm) {
+    if (match(vm, TK_VAR)) {
+        varDeclaration(vm);
     } else {
-        statement();
-    }
-    if (parser.panicMode) synchronize();
-}
-
-static void statement() {
-    if (match(TK_PRINT)) {
-        printStatement();
-    } else if (match(TK_IF)) {
-        ifStatement();
-    } else if (match(TK_WHILE)) {
-        whileStatement();
-    } else if (match(TK_LEFT_BRACE)) {
-        beginScope();
-        block();
-        endScope();
+        statement(vm);
+    }
+    if (vm->parser.panicMode) synchronize(vm);
+}
+
+static void statement(SplVM* vm) {
+    if (match(vm, TK_PRINT)) {
+        printStatement(vm);
+    } else if (match(vm, TK_IF)) {
+        ifStatement(vm);
+    } else if (match(vm, TK_WHILE)) {
+        whileStatement(vm);
+    } else if (match(vm, TK_LEFT_BRACE)) {
+        beginScope(vm);
+        block(vm);
+        endScope(vm);
     } else {
-        expressionStatement();
+        expressionStatement(vm);
     }
 }
 
-bool compile(const char* source, Chunk* chunk) {
-    spl_lex_init(source);
-    Compiler compiler;
-    initCompiler(&compiler);
-    compilingChunk = chunk;
+// The tree builder used with -O. It follows the same grammar and
+// resolves names the same way as the functions above, but returns nodes
+// instead of writing code, folding constants as it goes.
+
+typedef Node* (*TreeFn)(SplVM* vm, Node* left, bool canAssign);
+
+typedef struct {
+    TreeFn prefix;
+    TreeFn infix;
+} TreeRule;
+
+static Node* treeExpression(SplVM* vm);
+static Node* treeStatement(SplVM* vm);
+static Node* treeDeclaration(SplVM* vm);
+static Node* treePrecedence(SplVM* vm, Precedence precedence);
+
+static Node* treeNode(SplVM* vm, NodeType type) {
+    return newNode(vm, vm->compiler->tree, type, vm->parser.previous.line);
+}
+
+static Node* constantNode(SplVM* vm, Value value) {
+    // The constant table keeps the value reachable until the tree is
+    // lowered.
+    addConstant(vm, currentChunk(vm), value);
+    Node* node = treeNode(vm, NODE_CONSTANT);
+    node->value = value;
+    return node;
+}
+
+static Node* operatorNode(SplVM* vm, NodeType type, uint8_t op, Node* left, Node* right) {
+    Node* node = treeNode(vm, type);
+    node->op = op;
+    node->left = left;
+    node->right = right;
+    return node;
+}
+
+static bool isConstantNode(Node* node) {
+    return node != NULL && node->type == NODE_CONSTANT;
+}
+
+// Whether the node always yields a number, like the parse functions
+// report.
+static bool isNumberNode(Node* node) {
+    if (node == NULL) return false;
+    switch (node->type) {
+        case NODE_CONSTANT: return IS_NUMBER(node->value);
+        case NODE_UNARY: return node->op == OP_NEGATE;
+        case NODE_BINARY:
+            if (node->op == OP_ADD) return isNumberNode(node->left) && isNumberNode(node->right);
+            return node->op == OP_SUBTRACT || node->op == OP_MULTIPLY || node->op == OP_DIVIDE;
+        default: return false;
+    }
+}
+
+static Node* treeNumber(SplVM* vm, Node* left, bool canAssign) {
+    return constantNode(vm, NUMBER_VAL(strtod(vm->parser.previous.start, NULL)));
+}
+
+static Node* treeString(SplVM* vm, Node* left, bool canAssign) {
+    return constantNode(vm, OBJ_VAL(copyString(vm, vm->parser.previous.start + 1,
+                                               vm->parser.previous.length - 2)));
+}
+
+static Node* treeLiteral(SplVM* vm, Node* left, bool canAssign) {
+    switch (vm->parser.previous.type) {
+        case TK_FALSE: return constantNode(vm, BOOL_VAL(false));
+        case TK_TRUE: return constantNode(vm, BOOL_VAL(true));
+        default: return constantNode(vm, NIL_VAL);
+    }
+}
+
+static Node* treeGrouping(SplVM* vm, Node* left, bool canAssign) {
+    Node* node = treeExpression(vm);
+    consume(vm, TK_RIGHT_PAREN, "Expect ')' after expression");
+    return node;
+}
+
+static Node* treeVariable(SplVM* vm, Node* left, bool canAssign) {
+    spl_token name = vm->parser.previous;
+    int arg = resolveLocal(vm, vm->compiler, &name);
+    bool isLocal = arg != -1;
+    int variable = isLocal ? vm->compiler->locals[arg].id : (int)identifierGlobal(vm, &name);
+
+    if (match(vm, TK_EQUAL) && canAssign) {
+        if (isLocal && vm->compiler->locals[arg].final) {
+            error(vm, "Can't reassign final variable");
+        }
+        Node* value = treeExpression(vm);
+        Node* node = treeNode(vm, isLocal ? NODE_SET_LOCAL : NODE_SET_GLOBAL);
+        node->variable = variable;
+        node->left = value;
+        return node;
+    }
+    Node* node = treeNode(vm, isLocal ? NODE_GET_LOCAL : NODE_GET_GLOBAL);
+    node->variable = variable;
+    return node;
+}
+
+static Node* treeUnary(SplVM* vm, Node* left, bool canAssign) {
+    spl_token_type operatorType = vm->parser.previous.type;
+    Node* operand = treePrecedence(vm, PREC_UNARY);
+
+    if (isConstantNode(operand)) {
+        if (operatorType == TK_BANG) {
+            return constantNode(vm, BOOL_VAL(isFalseyConstant(operand->value)));
+        }
+        if (operatorType == TK_MINUS && IS_NUMBER(operand->value)) {
+            return constantNode(vm, NUMBER_VAL(-AS_NUMBER(operand->value)));
+        }
+    }
+    return operatorNode(vm, NODE_UNARY, operatorType == TK_BANG ? OP_NOT : OP_NEGATE,
+                        operand, NULL);
+}
 
-    parser.hadError = false;
-    parser.panicMode = false;
-    advance();
-    while(!match(TK_EOF)) {
-        declaration();
+static Node* treeBinary(SplVM* vm, Node* left, bool canAssign) {
+    spl_token_type operatorType = vm->parser.previous.type;
+    ParseRule* rule = getRule(operatorType);
+    Node* right = treePrecedence(vm, (Precedence)(rule->precedence + 1));
+
+    Value result;
+    if (isConstantNode(left) && isConstantNode(right) &&
+            foldBinary(vm, operatorType, left->value, right->value, &result)) {
+        return constantNode(vm, result);
+    }
+    if (isConstantNode(right) && isNumberNode(left) && isIdentity(operatorType, right->value)) {
+        return left;
+    }
+
+    switch (operatorType) {
+        case TK_EQUAL_EQUAL: return operatorNode(vm, NODE_BINARY, OP_EQUAL, left, right);
+        case TK_GREATER: return operatorNode(vm, NODE_BINARY, OP_GREATER, left, right);
+        case TK_GREATER_EQUAL:
+            return operatorNode(vm, NODE_UNARY, OP_NOT,
+                                operatorNode(vm, NODE_BINARY, OP_LESS, left, right), NULL);
+        case TK_LESS: return operatorNode(vm, NODE_BINARY, OP_LESS, left, right);
+        case TK_LESS_EQUAL:
+            return operatorNode(vm, NODE_UNARY, OP_NOT,
+                                operatorNode(vm, NODE_BINARY, OP_GREATER, left, right), NULL);
+        case TK_PLUS: return operatorNode(vm, NODE_BINARY, OP_ADD, left, right);
+        case TK_MINUS: return operatorNode(vm, NODE_BINARY, OP_SUBTRACT, left, right);
+        case TK_STAR: return operatorNode(vm, NODE_BINARY, OP_MULTIPLY, left, right);
+        case TK_SLASH: return operatorNode(vm, NODE_BINARY, OP_DIVIDE, left, right);
+        default: return NULL; // Unreachable
+    }
+}
+
+static Node* treeAnd(SplVM* vm, Node* left, bool canAssign) {
+    Node* right = treePrecedence(vm, PREC_AND);
+    return operatorNode(vm, NODE_AND, 0, left, right);
+}
+
+static Node* treeOr(SplVM* vm, Node* left, bool canAssign) {
+    Node* right = treePrecedence(vm, PREC_OR);
+    return operatorNode(vm, NODE_OR, 0, left, right);
+}
+
+// Precedences come from rules[].
+static TreeRule treeRules[TK_EOF + 1] = {
+    [TK_LEFT_PAREN] = {treeGrouping, NULL},
+    [TK_MINUS] = {treeUnary, treeBinary},
+    [TK_PLUS] = {NULL, treeBinary},
+    [TK_SLASH] = {NULL, treeBinary},
+    [TK_STAR] = {NULL, treeBinary},
+    [TK_BANG] = {treeUnary, NULL},
+    [TK_EQUAL_EQUAL] = {NULL, treeBinary},
+    [TK_GREATER] = {NULL, treeBinary},
+    [TK_GREATER_EQUAL] = {NULL, treeBinary},
+    [TK_LESS] = {NULL, treeBinary},
+    [TK_LESS_EQUAL] = {NULL, treeBinary},
+    [TK_IDENTIFIER] = {treeVariable, NULL},
+    [TK_STRING_VAL] = {treeString, NULL},
+    [TK_NUMBER_VAL] = {treeNumber, NULL},
+    [TK_AND] = {NULL, treeAnd},
+    [TK_FALSE] = {treeLiteral, NULL},
+    [TK_NULL] = {treeLiteral, NULL},
+    [TK_OR] = {NULL, treeOr},
+    [TK_TRUE] = {treeLiteral, NULL},
+};
+
+static Node* treePrecedence(SplVM* vm, Precedence precedence) {
+    advance(vm);
+    TreeFn prefixRule = treeRules[vm->parser.previous.type].prefix;
+    if (prefixRule == NULL) {
+        error(vm, "Expect expression.");
+        return NULL;
+    }
+
+    bool canAssign = precedence <= PREC_ASSIGNMENT;
+    Node* node = prefixRule(vm, NULL, canAssign);
+    while (precedence <= getRule(vm->parser.current.type)->precedence) {
+        advance(vm);
+        node = treeRules[vm->parser.previous.type].infix(vm, node, canAssign);
+    }
+    if (canAssign && match(vm, TK_EQUAL)) {
+        error(vm, "Invalid assignment target.");
+    }
+    return node;
+}
+
+static Node* treeExpression(SplVM* vm) {
+    return treePrecedence(vm, PREC_ASSIGNMENT);
+}
+
+static Node* treeVarDeclaration(SplVM* vm) {
+    uint32_t global = parseVariable(vm, "Expect variable name.");
+    int variable = global;
+    if (vm->compiler->scopeDepth > 0) {
+        variable = vm->compiler->tree->localCount++;
+        vm->compiler->locals[vm->compiler->localCount - 1].id = variable;
+    }
+
+    Node* value = match(vm, TK_EQUAL) ? treeExpression(vm) : constantNode(vm, NIL_VAL);
+    consume(vm, TK_SEMICOLON, "Expect ';' after variable declaration.");
+    if (vm->compiler->scopeDepth > 0) markInitialized(vm);
+
+    Node* node = treeNode(vm, vm->compiler->scopeDepth > 0 ? NODE_DEFINE_LOCAL
+                                                           : NODE_DEFINE_GLOBAL);
+    node->variable = variable;
+    node->left = value;
+    return node;
+}
+
+// The bodies of ifs and whiles are always blocks, so the passes have a
+// statement list to declare temps in.
+static Node* treeBody(SplVM* vm) {
+    Node* body = treeStatement(vm);
+    if (body != NULL && body->type == NODE_BLOCK) return body;
+    Node* block = treeNode(vm, NODE_BLOCK);
+    if (body != NULL) appendNode(vm, block, body);
+    return block;
+}
+
+static Node* treeStatement(SplVM* vm) {
+    Node* node;
+    if (match(vm, TK_PRINT)) {
+        node = treeNode(vm, NODE_PRINT);
+        node->left = treeExpression(vm);
+        consume(vm, TK_SEMICOLON, "Expect ';' after value.");
+    } else if (match(vm, TK_IF)) {
+        node = treeNode(vm, NODE_IF);
+        consume(vm, TK_LEFT_PAREN, "Expect '(' after 'if'.");
+        node->left = treeExpression(vm);
+        consume(vm, TK_RIGHT_PAREN, "Expect ')' after condition.");
+        node->right = treeBody(vm);
+        if (match(vm, TK_ELSE)) node->elseBranch = treeBody(vm);
+    } else if (match(vm, TK_WHILE)) {
+        node = treeNode(vm, NODE_WHILE);
+        consume(vm, TK_LEFT_PAREN, "Expect '(' after 'while'.");
+        node->left = treeExpression(vm);
+        consume(vm, TK_RIGHT_PAREN, "Expect ')' after condition.");
+        node->right = treeBody(vm);
+    } else if (match(vm, TK_LEFT_BRACE)) {
+        node = treeNode(vm, NODE_BLOCK);
+        beginScope(vm);
+        while (!check(vm, TK_RIGHT_BRACE) && !check(vm, TK_EOF)) {
+            Node* statement = treeDeclaration(vm);
+            if (statement != NULL) appendNode(vm, node, statement);
+        }
+        consume(vm, TK_RIGHT_BRACE, "Expect '}' after block.");
+        // The block's locals are popped at its end.
+        node->line = vm->parser.previous.line;
+        endScope(vm);
+    } else {
+        node = treeNode(vm, NODE_EXPRESSION);
+        node->left = treeExpression(vm);
+        consume(vm, TK_SEMICOLON, "Expect ';' after expression.");
+    }
+    return node;
+}
+
+static Node* treeDeclaration(SplVM* vm) {
+    Node* node = match(vm, TK_VAR) ? treeVarDeclaration(vm) : treeStatement(vm);
+    if (vm->parser.panicMode) synchronize(vm);
+    return node;
+}
+
+// Builds the tree of the whole program with 'scratch' as the chunk
+// whose constants keep its values alive, optimizes it and lowers it into
+// 'chunk'.
+static void compileTree(SplVM* vm, Chunk* chunk) {
+    Tree tree;
+    initTree(&tree);
+    vm->compiler->tree = &tree;
+    Chunk scratch;
+    initChunk(&scratch);
+    vm->compilingChunk = &scratch;
+
+    tree.root = newNode(vm, &tree, NODE_BLOCK, 1);
+    while (!match(vm, TK_EOF)) {
+        Node* statement = treeDeclaration(vm);
+        if (statement != NULL) appendNode(vm, tree.root, statement);
+    }
+    tree.root->line = vm->parser.previous.line;
+    if (!vm->parser.hadError) {
+        optimizeTree(vm, &tree);
+        // Everything the tree refers to is in scratch, which is still
+        // the chunk the collector sees.
+        if (!lowerTree(vm, &tree, chunk)) vm->parser.hadError = true;
+    }
+
+    vm->compilingChunk = chunk;
+    freeChunk(vm, &scratch);
+    freeTree(vm, &tree);
+    vm->compiler->tree = NULL;
+}
+
+bool compile(SplVM* vm, const char* source, Chunk* chunk) {
+    spl_lex_init(&vm->lexer, source);
+    Compiler compiler;
+    initCompiler(vm, &compiler);
+    vm->compilingChunk = chunk;
+
+    vm->parser.hadError = false;
+    vm->parser.panicMode = false;
+    advance(vm);
+    if (vm->optimize) {
+        compileTree(vm, chunk);
+    } else {
+        while(!match(vm, TK_EOF)) {
+            declaration(vm);
+        }
     }
-    endCompiler();
-    return !parser.hadError;
+    endCompiler(vm);
+    vm->compiler = NULL;
+    vm->compilingChunk = NULL;
+    return !vm->parser.hadError;
 }
\ No newline at end of file
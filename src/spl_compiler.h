@@ -1,11 +1,41 @@
 #ifndef SPL_COMPILER_H
 #define SPL_COMPILER_H
 
+#include "spl_chunk.h"
+#include "spl_ir.h"
+#include "spl_lexer.h"
 #include "spl_object.h"
-#include "spl_vm.h"
 
+typedef struct {
+    spl_token current;
+    spl_token previous;
+    bool hadError;
+    bool panicMode;
+} Parser;
 
-bool compile(const char* source, Chunk* chunk);
+typedef struct {
+    spl_token name;
+    int depth;
+    bool final;
+    // Id of the local in the tree, when building one.
+    int id;
+} Local;
 
+typedef struct {
+    Local locals[UINT8_COUNT];
+    int localCount;
+    int scopeDepth;
+    // Where the left operand of the infix rule being compiled starts, as
+    // a code offset and a constant count, and whether it always yields a
+    // number. binary() reads them before it compiles its right operand.
+    int operandStart;
+    int operandConstants;
+    bool operandIsNumber;
+    // The tree being built instead of bytecode, or NULL.
+    Tree* tree;
+} Compiler;
 
-#endif
\ No newline at end of file
+bool compile(SplVM* vm, const char* source, Chunk* chunk);
+
+
+#endif
@@ -1,11 +1,12 @@
 #include <stdio.h>
 #include "spl_value.h"
 #include "spl_debug.h"
+#include "spl_vm.h"
 
-void disassembleChunk(Chunk* chunk, const char* name) {
+void disassembleChunk(SplVM* vm, Chunk* chunk, const char* name) {
     printf("== start %s ==\n", name);
     for (int offset = 0; offset < chunk->count;) {
-        offset = disassembleInstruction(chunk, offset);
+        offset = disassembleInstruction(vm, chunk, offset);
     }
 	printf("== end %s  ==\n", name);
 
@@ -30,12 +31,37 @@ static int jumpInstruction(const char * name, int sign, Chunk* chunk, int offset
     return offset + 3;
 }
 
+static int localConstantInstruction(const char* name, Chunk* chunk, int offset) {
+    uint8_t slot = chunk->code[offset + 1];
+    uint8_t constant = chunk->code[offset + 2];
+    printf("%-16s %4d %4d '", name, slot, constant);
+    printValue(chunk->constants.values[constant]);
+    printf("'\n");
+    return offset + 3;
+}
+
+static void printGlobal(SplVM* vm, int slot) {
+    printf("'");
+    printValue(vm->globalNames.values[slot]);
+    printf("'");
+}
+
+static int globalInstruction(SplVM* vm, const char* name, int type, Chunk* chunk, int offset) {
+    int slot = 0;
+    if (instructionLength(type) == 1 + CONSTANT_LONG_BYTE_SIZE) {
+        slot = CONVERT_BYTE_ARRAY_TO_INT(&chunk->code[offset + 1], CONSTANT_LONG_BYTE_SIZE);
+    } else {
+        slot = chunk->code[offset + 1];
+    }
+    printf("%-16s %4d ", name, slot);
+    printGlobal(vm, slot);
+    printf("\n");
+    return offset + instructionLength(type);
+}
+
 static int constantInstruction(const char* name, int type, Chunk* chunk, int offset) {
     int constant = 0;
-    if (type == OP_CONSTANT_LONG || 
-        type == OP_DEFINE_GLOBAL_LONG || 
-        type == OP_GET_GLOBAL_LONG || 
-        type == OP_SET_GLOBAL_LONG) {
+    if (type == OP_CONSTANT_LONG) {
         for(int i = 1; i <= 4; i++) {
             constant |= chunk->code[offset+i] << ((4 - i) * 8);
         }
@@ -45,10 +71,10 @@ static int constantInstruction(const char* name, int type, Chunk* chunk, int off
     printf("%s %4d '", name, constant);
     printValue(chunk->constants.values[constant]);
     printf("'\n");
-    return type == OP_CONSTANT_LONG ? offset + 5 : offset + 2;
+    return offset + instructionLength(type);
 }
 
-int disassembleInstruction(Chunk* chunk, int offset) {
+int disassembleInstruction(SplVM* vm, Chunk* chunk, int offset) {
     printf("%04d ", offset);
     if (offset > 0 && getLine(&chunk->lines, offset) == getLine(&chunk->lines, offset-1)) {
         printf("   | ");
@@ -63,17 +89,17 @@ int disassembleInstruction(Chunk* chunk, int offset) {
         case OP_CONSTANT:
             return constantInstruction("OP_CONSTANT", OP_CONSTANT, chunk, offset);
         case OP_DEFINE_GLOBAL:
-            return constantInstruction("OP_DEFINE_GLOBAL", OP_DEFINE_GLOBAL, chunk, offset);
+            return globalInstruction(vm, "OP_DEFINE_GLOBAL", OP_DEFINE_GLOBAL, chunk, offset);
         case OP_DEFINE_GLOBAL_LONG:
-            return constantInstruction("OP_DEFINE_GLOBAL_LONG", OP_DEFINE_GLOBAL_LONG, chunk, offset);
+            return globalInstruction(vm, "OP_DEFINE_GLOBAL_LONG", OP_DEFINE_GLOBAL_LONG, chunk, offset);
         case OP_GET_GLOBAL:
-            return constantInstruction("OP_GET_GLOBAL", OP_GET_GLOBAL, chunk, offset);
+            return globalInstruction(vm, "OP_GET_GLOBAL", OP_GET_GLOBAL, chunk, offset);
         case OP_GET_GLOBAL_LONG:
-            return constantInstruction("OP_GET_GLOBAL_LONG", OP_GET_GLOBAL_LONG, chunk, offset);
+            return globalInstruction(vm, "OP_GET_GLOBAL_LONG", OP_GET_GLOBAL_LONG, chunk, offset);
         case OP_SET_GLOBAL:
-            return constantInstruction("OP_SET_GLOBAL", OP_SET_GLOBAL, chunk, offset);
+            return globalInstruction(vm, "OP_SET_GLOBAL", OP_SET_GLOBAL, chunk, offset);
         case OP_SET_GLOBAL_LONG:
-            return constantInstruction("OP_SET_GLOBAL_LONG", OP_SET_GLOBAL_LONG, chunk, offset);
+            return globalInstruction(vm, "OP_SET_GLOBAL_LONG", OP_SET_GLOBAL_LONG, chunk, offset);
 		case OP_NIL:
 			return simpleInstruction("OP_NIL", offset);
 		case OP_TRUE:
@@ -114,8 +140,170 @@ int disassembleInstruction(Chunk* chunk, int offset) {
             return jumpInstruction("OP_LOOP", -1, chunk, offset);
         case OP_RETURN:
             return simpleInstruction("OP_RETURN", offset);
+        case OP_NOT_GREATER:
+            return simpleInstruction("OP_NOT_GREATER", offset);
+        case OP_NOT_LESS:
+            return simpleInstruction("OP_NOT_LESS", offset);
+        case OP_ADD_LOCAL_CONSTANT:
+            return localConstantInstruction("OP_ADD_LOCAL_CONSTANT", chunk, offset);
+        case OP_SET_LOCAL_POP:
+            return byteInstruction("OP_SET_LOCAL_POP", chunk, offset);
+        case OP_SET_GLOBAL_POP:
+            return globalInstruction(vm, "OP_SET_GLOBAL_POP", OP_SET_GLOBAL_POP, chunk, offset);
+        case OP_JUMP_IF_GREATER:
+            return jumpInstruction("OP_JUMP_IF_GREATER", 1, chunk, offset);
+        case OP_JUMP_IF_NOT_GREATER:
+            return jumpInstruction("OP_JUMP_IF_NOT_GREATER", 1, chunk, offset);
+        case OP_JUMP_IF_LESS:
+            return jumpInstruction("OP_JUMP_IF_LESS", 1, chunk, offset);
+        case OP_JUMP_IF_NOT_LESS:
+            return jumpInstruction("OP_JUMP_IF_NOT_LESS", 1, chunk, offset);
+        case OP_ADD_NUM:
+            return simpleInstruction("OP_ADD_NUM", offset);
+        case OP_SUBTRACT_NUM:
+            return simpleInstruction("OP_SUBTRACT_NUM", offset);
+        case OP_MULTIPLY_NUM:
+            return simpleInstruction("OP_MULTIPLY_NUM", offset);
+        case OP_DIVIDE_NUM:
+            return simpleInstruction("OP_DIVIDE_NUM", offset);
+        case OP_GREATER_NUM:
+            return simpleInstruction("OP_GREATER_NUM", offset);
+        case OP_LESS_NUM:
+            return simpleInstruction("OP_LESS_NUM", offset);
+        case OP_ADD_LOCAL_CONSTANT_NUM:
+            return localConstantInstruction("OP_ADD_LOCAL_CONSTANT_NUM", chunk, offset);
         default:
             printf("Unknown opcode %d\n", instruction);
             return offset + 1;
     }
 }
+
+
+void disassembleRegisterChunk(SplVM* vm, RegChunk* chunk, const char* name) {
+    printf("== start %s ==\n", name);
+    for (int index = 0; index < chunk->count;) {
+        index = disassembleRegisterInstruction(vm, chunk, index);
+    }
+	printf("== end %s  ==\n", name);
+}
+
+static void printOperand(RegChunk* chunk, int operand) {
+    if (operand < chunk->registerCount) {
+        printf("r%d", operand);
+        return;
+    }
+    printf("'");
+    printValue(chunk->constants.values[operand - chunk->registerCount]);
+    printf("'");
+}
+
+static int moveInstruction(const char* name, RegChunk* chunk, int index) {
+    RegInstr* instr = &chunk->code[index];
+    printf("%-24s r%d <- ", name, instr->a);
+    printOperand(chunk, instr->b);
+    printf("\n");
+    return index + 1;
+}
+
+static int binaryInstruction(const char* name, RegChunk* chunk, int index) {
+    RegInstr* instr = &chunk->code[index];
+    printf("%-24s r%d <- ", name, instr->a);
+    printOperand(chunk, instr->b);
+    printf(", ");
+    printOperand(chunk, instr->c);
+    printf("\n");
+    return index + 1;
+}
+
+static int getGlobalInstruction(SplVM* vm, const char* name, RegChunk* chunk, int index) {
+    RegInstr* instr = &chunk->code[index];
+    printf("%-24s r%d <- ", name, instr->a);
+    printGlobal(vm, instr->b);
+    printf("\n");
+    return index + 1;
+}
+
+static int storeInstruction(SplVM* vm, const char* name, RegChunk* chunk, int index) {
+    RegInstr* instr = &chunk->code[index];
+    printf("%-24s ", name);
+    printGlobal(vm, instr->b);
+    printf(" <- ");
+    printOperand(chunk, instr->c);
+    printf("\n");
+    return index + 1;
+}
+
+static int branchInstruction(const char* name, RegChunk* chunk, int index) {
+    RegInstr* instr = &chunk->code[index];
+    printf("%-24s ", name);
+    printOperand(chunk, instr->b);
+    printf(", ");
+    printOperand(chunk, instr->c);
+    printf(" -> %04d\n", instr->a);
+    return index + 1;
+}
+
+int disassembleRegisterInstruction(SplVM* vm, RegChunk* chunk, int index) {
+    RegInstr* instr = &chunk->code[index];
+    printf("%04d ", index);
+    switch (instr->op)
+    {
+        case ROP_MOVE:
+            return moveInstruction("ROP_MOVE", chunk, index);
+        case ROP_GET_GLOBAL:
+            return getGlobalInstruction(vm, "ROP_GET_GLOBAL", chunk, index);
+        case ROP_DEFINE_GLOBAL:
+            return storeInstruction(vm, "ROP_DEFINE_GLOBAL", chunk, index);
+        case ROP_SET_GLOBAL:
+            return storeInstruction(vm, "ROP_SET_GLOBAL", chunk, index);
+        case ROP_EQUAL:
+            return binaryInstruction("ROP_EQUAL", chunk, index);
+        case ROP_GREATER:
+            return binaryInstruction("ROP_GREATER", chunk, index);
+        case ROP_LESS:
+            return binaryInstruction("ROP_LESS", chunk, index);
+        case ROP_NOT:
+            return moveInstruction("ROP_NOT", chunk, index);
+        case ROP_NEGATE:
+            return moveInstruction("ROP_NEGATE", chunk, index);
+        case ROP_ADD:
+            return binaryInstruction("ROP_ADD", chunk, index);
+        case ROP_SUBTRACT:
+            return binaryInstruction("ROP_SUBTRACT", chunk, index);
+        case ROP_MULTIPLY:
+            return binaryInstruction("ROP_MULTIPLY", chunk, index);
+        case ROP_DIVIDE:
+            return binaryInstruction("ROP_DIVIDE", chunk, index);
+        case ROP_PRINT:
+            printf("%-24s ", "ROP_PRINT");
+            printOperand(chunk, instr->b);
+            printf("\n");
+            return index + 1;
+        case ROP_JUMP:
+            printf("%-24s -> %04d\n", "ROP_JUMP", instr->a);
+            return index + 1;
+        case ROP_JUMP_IF_FALSE:
+            printf("%-24s ", "ROP_JUMP_IF_FALSE");
+            printOperand(chunk, instr->b);
+            printf(" -> %04d\n", instr->a);
+            return index + 1;
+        case ROP_JUMP_IF_EQUAL:
+            return branchInstruction("ROP_JUMP_IF_EQUAL", chunk, index);
+        case ROP_JUMP_IF_NOT_EQUAL:
+            return branchInstruction("ROP_JUMP_IF_NOT_EQUAL", chunk, index);
+        case ROP_JUMP_IF_GREATER:
+            return branchInstruction("ROP_JUMP_IF_GREATER", chunk, index);
+        case ROP_JUMP_IF_NOT_GREATER:
+            return branchInstruction("ROP_JUMP_IF_NOT_GREATER", chunk, index);
+        case ROP_JUMP_IF_LESS:
+            return branchInstruction("ROP_JUMP_IF_LESS", chunk, index);
+        case ROP_JUMP_IF_NOT_LESS:
+            return branchInstruction("ROP_JUMP_IF_NOT_LESS", chunk, index);
+        case ROP_RETURN:
+            printf("%-24s\n", "ROP_RETURN");
+            return index + 1;
+        default:
+            printf("Unknown opcode %d\n", instr->op);
+            return index + 1;
+    }
+}
\ No newline at end of file
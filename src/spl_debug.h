@@ -2,8 +2,11 @@
 #define SPL_DEBUG_H
 
 #include "spl_chunk.h"
+#include "spl_register.h"
 
-void disassembleChunk(Chunk* chunk, const char* name);
-int disassembleInstruction(Chunk* chunk, int offset);
+void disassembleChunk(SplVM* vm, Chunk* chunk, const char* name);
+int disassembleInstruction(SplVM* vm, Chunk* chunk, int offset);
+void disassembleRegisterChunk(SplVM* vm, RegChunk* chunk, const char* name);
+int disassembleRegisterInstruction(SplVM* vm, RegChunk* chunk, int index);
 
 #endif
\ No newline at end of file
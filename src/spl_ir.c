@@ -0,0 +1,1012 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "spl_ir.h"
+#include "spl_memory.h"
+#include "spl_vm.h"
+
+#define ANSI_COLOR_RED     "\x1b[31m"
+#define ANSI_COLOR_RESET   "\x1b[0m"
+
+// Common subexpressions are looked for among this many of the most
+// recent expressions, which keeps the pass linear.
+#define CSE_WINDOW 32
+
+void initTree(Tree* tree) {
+    tree->root = NULL;
+    tree->nodes = NULL;
+    tree->localCount = 0;
+    tree->tempCount = 0;
+    tree->tempCapacity = 0;
+    tree->temps = NULL;
+}
+
+void freeTree(SplVM* vm, Tree* tree) {
+    Node* node = tree->nodes;
+    while (node != NULL) {
+        Node* next = node->next;
+        FREE_ARRAY(vm, Node*, node->children, node->capacity);
+        FREE(vm, Node, node);
+        node = next;
+    }
+    FREE_ARRAY(vm, Temp, tree->temps, tree->tempCapacity);
+    initTree(tree);
+}
+
+Node* newNode(SplVM* vm, Tree* tree, NodeType type, int line) {
+    Node* node = ALLOCATE(vm, Node, 1);
+    node->type = type;
+    node->line = line;
+    node->op = 0;
+    node->variable = 0;
+    node->value = NIL_VAL;
+    node->left = NULL;
+    node->right = NULL;
+    node->elseBranch = NULL;
+    node->children = NULL;
+    node->count = 0;
+    node->capacity = 0;
+    node->next = tree->nodes;
+    tree->nodes = node;
+    return node;
+}
+
+void appendNode(SplVM* vm, Node* list, Node* node) {
+    if (list->capacity < list->count + 1) {
+        int oldCapacity = list->capacity;
+        list->capacity = GROW_CAPACITY(oldCapacity);
+        list->children = GROW_ARRAY(vm, Node*, list->children, oldCapacity, list->capacity);
+    }
+    list->children[list->count++] = node;
+}
+
+typedef struct {
+    SplVM* vm;
+    Tree* tree;
+    int globalCount;
+    // Scratch marks per local id and global slot.
+    int* localMarks;
+    int* globalMarks;
+    int stamp;
+    // Globals sure to be defined by the time the statement being
+    // optimized runs.
+    bool* definedGlobals;
+} Optimizer;
+
+static int newTemp(Optimizer* o, bool enabled, int cost) {
+    Tree* tree = o->tree;
+    if (tree->tempCapacity < tree->tempCount + 1) {
+        int oldCapacity = tree->tempCapacity;
+        tree->tempCapacity = GROW_CAPACITY(oldCapacity);
+        tree->temps = GROW_ARRAY(o->vm, Temp, tree->temps, oldCapacity, tree->tempCapacity);
+    }
+    Temp* temp = &tree->temps[tree->tempCount];
+    temp->enabled = enabled;
+    temp->assigned = false;
+    temp->uses = 0;
+    temp->cost = cost;
+    temp->slot = -1;
+    return tree->tempCount++;
+}
+
+// Turns 'node' into a temp node of 'type' whose left is a copy of what
+// 'node' was, so whatever points at 'node' now sees the temp.
+static void wrapInTemp(Optimizer* o, Node* node, NodeType type, int temp) {
+    Node* copy = newNode(o->vm, o->tree, node->type, node->line);
+    Node* next = copy->next;
+    *copy = *node;
+    copy->next = next;
+    node->type = type;
+    node->variable = temp;
+    node->left = copy;
+    node->right = NULL;
+}
+
+// Overwrites 'node' with 'with', keeping it in the tree's node list.
+static void replaceNode(Node* node, Node* with) {
+    Node* next = node->next;
+    Node** children = node->children;
+    int capacity = node->capacity;
+    *node = *with;
+    node->next = next;
+    // Swap the lists so each is still freed once.
+    with->children = children;
+    with->count = 0;
+    with->capacity = capacity;
+}
+
+static void makeEmpty(Node* node) {
+    node->type = NODE_BLOCK;
+    node->left = NULL;
+    node->right = NULL;
+    node->elseBranch = NULL;
+    node->count = 0;
+}
+
+static bool isFalsey(Value value) {
+    return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
+}
+
+static bool hasOperation(Node* node) {
+    return node->type == NODE_UNARY || node->type == NODE_BINARY ||
+           node->type == NODE_AND || node->type == NODE_OR;
+}
+
+// Whether evaluating the expression stores nothing.
+static bool isPure(Node* node) {
+    switch (node->type) {
+        case NODE_SET_LOCAL:
+        case NODE_SET_GLOBAL:
+        case NODE_SET_TEMP: return false;
+        case NODE_UNARY: return isPure(node->left);
+        case NODE_BINARY:
+        case NODE_AND:
+        case NODE_OR: return isPure(node->left) && isPure(node->right);
+        default: return true;
+    }
+}
+
+// Whether the node's own step can fail at runtime or be seen from
+// outside: arithmetic and comparisons on the wrong types, reading a
+// global that may not be defined yet, assigning a global.
+static bool mayFail(Optimizer* o, Node* node) {
+    switch (node->type) {
+        case NODE_UNARY: return node->op != OP_NOT;
+        case NODE_BINARY: return node->op != OP_EQUAL;
+        case NODE_GET_GLOBAL: return !o->definedGlobals[node->variable];
+        case NODE_SET_GLOBAL: return true;
+        default: return false;
+    }
+}
+
+// Whether evaluating the expression can neither fail nor change
+// anything, so it can be dropped.
+static bool isHarmless(Optimizer* o, Node* node) {
+    if (mayFail(o, node)) return false;
+    switch (node->type) {
+        case NODE_CONSTANT:
+        case NODE_GET_LOCAL:
+        case NODE_GET_GLOBAL: return true;
+        case NODE_GET_TEMP: return isHarmless(o, node->left);
+        case NODE_UNARY: return isHarmless(o, node->left);
+        case NODE_BINARY:
+        case NODE_AND:
+        case NODE_OR: return isHarmless(o, node->left) && isHarmless(o, node->right);
+        default: return false;
+    }
+}
+
+// Constants are the same if they are the same bits: 0 and -0 are equal
+// but not interchangeable.
+static bool sameConstant(Value a, Value b) {
+    if (IS_NUMBER(a) && IS_NUMBER(b)) {
+        double x = AS_NUMBER(a);
+        double y = AS_NUMBER(b);
+        return memcmp(&x, &y, sizeof(double)) == 0;
+    }
+    return valuesEqual(a, b);
+}
+
+static Node* unwrapTemp(Node* node) {
+    while (node->type == NODE_GET_TEMP || node->type == NODE_SET_TEMP) node = node->left;
+    return node;
+}
+
+// Whether two pure expressions compute the same value from the same
+// variables.
+static bool equalNodes(Node* a, Node* b) {
+    a = unwrapTemp(a);
+    b = unwrapTemp(b);
+    if (a->type != b->type) return false;
+    switch (a->type) {
+        case NODE_CONSTANT: return sameConstant(a->value, b->value);
+        case NODE_GET_LOCAL:
+        case NODE_GET_GLOBAL: return a->variable == b->variable;
+        case NODE_UNARY: return a->op == b->op && equalNodes(a->left, b->left);
+        case NODE_BINARY:
+            if (a->op != b->op) return false;
+            // Fall through.
+        case NODE_AND:
+        case NODE_OR: return equalNodes(a->left, b->left) && equalNodes(a->right, b->right);
+        default: return false;
+    }
+}
+
+// Instructions it takes to compute the expression.
+static int nodeCost(Optimizer* o, Node* node) {
+    switch (node->type) {
+        case NODE_GET_TEMP:
+            return o->tree->temps[node->variable].enabled ? 1 : nodeCost(o, node->left);
+        case NODE_SET_TEMP: return nodeCost(o, node->left) + 1;
+        case NODE_SET_LOCAL:
+        case NODE_SET_GLOBAL:
+        case NODE_UNARY: return nodeCost(o, node->left) + 1;
+        case NODE_BINARY: return nodeCost(o, node->left) + nodeCost(o, node->right) + 1;
+        case NODE_AND: return nodeCost(o, node->left) + nodeCost(o, node->right) + 2;
+        case NODE_OR: return nodeCost(o, node->left) + nodeCost(o, node->right) + 3;
+        default: return 1;
+    }
+}
+
+// Sets the mark of every variable stored to in the subtree to 'mark'.
+static void markWrites(Optimizer* o, Node* node, int mark) {
+    if (node == NULL) return;
+    switch (node->type) {
+        case NODE_SET_LOCAL:
+        case NODE_DEFINE_LOCAL: o->localMarks[node->variable] = mark; break;
+        case NODE_SET_GLOBAL:
+        case NODE_DEFINE_GLOBAL: o->globalMarks[node->variable] = mark; break;
+        default: break;
+    }
+    markWrites(o, node->left, mark);
+    markWrites(o, node->right, mark);
+    markWrites(o, node->elseBranch, mark);
+    for (int i = 0; i < node->count; i++) markWrites(o, node->children[i], mark);
+}
+
+// Dead stores. Liveness of locals is computed backwards over the tree;
+// an assignment to a local that is not live after it is replaced by
+// its value, and expression statements left with nothing to do are
+// dropped, as are branches behind a constant condition. Inside a loop
+// every local the loop reads counts as live throughout it, which is
+// safe without iterating to a fixed point.
+
+typedef struct {
+    Optimizer* o;
+    int words;
+} Liveness;
+
+static uint64_t* newLiveSet(Liveness* l, uint64_t* from) {
+    uint64_t* set = ALLOCATE(l->o->vm, uint64_t, l->words);
+    for (int i = 0; i < l->words; i++) set[i] = from != NULL ? from[i] : 0;
+    return set;
+}
+
+static void freeLiveSet(Liveness* l, uint64_t* set) {
+    FREE_ARRAY(l->o->vm, uint64_t, set, l->words);
+}
+
+static void addLiveSet(Liveness* l, uint64_t* set, uint64_t* from) {
+    for (int i = 0; i < l->words; i++) set[i] |= from[i];
+}
+
+#define IS_LIVE(set, local) (((set)[(local) / 64] >> ((local) % 64)) & 1)
+#define SET_LIVE(set, local) ((set)[(local) / 64] |= (uint64_t)1 << ((local) % 64))
+#define SET_DEAD(set, local) ((set)[(local) / 64] &= ~((uint64_t)1 << ((local) % 64)))
+
+static void addReads(Node* node, uint64_t* live) {
+    if (node == NULL) return;
+    if (node->type == NODE_GET_LOCAL) SET_LIVE(live, node->variable);
+    addReads(node->left, live);
+    addReads(node->right, live);
+    addReads(node->elseBranch, live);
+    for (int i = 0; i < node->count; i++) addReads(node->children[i], live);
+}
+
+// Turns 'live', the locals live after the expression, into those live
+// before it.
+static void liveExpression(Liveness* l, Node* node, uint64_t* live) {
+    switch (node->type) {
+        case NODE_GET_LOCAL: SET_LIVE(live, node->variable); break;
+        case NODE_SET_LOCAL:
+            if (!IS_LIVE(live, node->variable)) {
+                replaceNode(node, node->left);
+                liveExpression(l, node, live);
+                break;
+            }
+            SET_DEAD(live, node->variable);
+            liveExpression(l, node->left, live);
+            break;
+        case NODE_SET_GLOBAL:
+        case NODE_UNARY: liveExpression(l, node->left, live); break;
+        case NODE_BINARY:
+            liveExpression(l, node->right, live);
+            liveExpression(l, node->left, live);
+            break;
+        case NODE_AND:
+        case NODE_OR: {
+            // The right operand may be skipped.
+            uint64_t* skipped = newLiveSet(l, live);
+            liveExpression(l, node->right, live);
+            addLiveSet(l, live, skipped);
+            freeLiveSet(l, skipped);
+            liveExpression(l, node->left, live);
+            break;
+        }
+        default: break;
+    }
+}
+
+static void liveStatement(Liveness* l, Node* node, uint64_t* live) {
+    switch (node->type) {
+        case NODE_EXPRESSION:
+            liveExpression(l, node->left, live);
+            if (isHarmless(l->o, node->left)) makeEmpty(node);
+            break;
+        case NODE_PRINT:
+        case NODE_DEFINE_GLOBAL: liveExpression(l, node->left, live); break;
+        case NODE_DEFINE_LOCAL:
+            SET_DEAD(live, node->variable);
+            liveExpression(l, node->left, live);
+            break;
+        case NODE_BLOCK:
+            for (int i = node->count - 1; i >= 0; i--) liveStatement(l, node->children[i], live);
+            break;
+        case NODE_IF: {
+            if (node->left->type == NODE_CONSTANT) {
+                Node* taken = isFalsey(node->left->value) ? node->elseBranch : node->right;
+                if (taken == NULL) {
+                    makeEmpty(node);
+                } else {
+                    replaceNode(node, taken);
+                }
+                liveStatement(l, node, live);
+                break;
+            }
+            uint64_t* otherwise = newLiveSet(l, live);
+            if (node->elseBranch != NULL) liveStatement(l, node->elseBranch, otherwise);
+            liveStatement(l, node->right, live);
+            addLiveSet(l, live, otherwise);
+            freeLiveSet(l, otherwise);
+            liveExpression(l, node->left, live);
+            break;
+        }
+        case NODE_WHILE: {
+            if (node->left->type == NODE_CONSTANT && isFalsey(node->left->value)) {
+                makeEmpty(node);
+                break;
+            }
+            addReads(node, live);
+            uint64_t* body = newLiveSet(l, live);
+            liveStatement(l, node->right, body);
+            freeLiveSet(l, body);
+            uint64_t* condition = newLiveSet(l, live);
+            liveExpression(l, node->left, condition);
+            freeLiveSet(l, condition);
+            break;
+        }
+        default: break;
+    }
+}
+
+static void eliminateDeadStores(Optimizer* o) {
+    Liveness l;
+    l.o = o;
+    l.words = o->tree->localCount / 64 + 1;
+    uint64_t* live = newLiveSet(&l, NULL);
+    liveStatement(&l, o->tree->root, live);
+    freeLiveSet(&l, live);
+}
+
+// Loop-invariant code motion. An expression in a while loop whose
+// variables the loop never stores to is computed once into a temp
+// before the first iteration. The loop then runs its condition once up
+// front and at the bottom of every iteration, so nothing is computed
+// for a loop that does not run. Only expressions every iteration
+// reaches before anything that could fail or print are hoisted, so an
+// error still comes from the same expression; the condition always
+// runs first, so anything outside an 'and' or 'or' in it qualifies.
+
+typedef struct {
+    Optimizer* o;
+    Node* loop;
+    bool inCondition;
+    // Cleared once the first iteration may have done something that
+    // must happen before a hoisted expression could fail.
+    bool canHoist;
+} Hoister;
+
+static bool isInvariant(Hoister* h, Node* node) {
+    switch (node->type) {
+        case NODE_CONSTANT: return true;
+        case NODE_GET_LOCAL: return h->o->localMarks[node->variable] != h->o->stamp;
+        case NODE_GET_GLOBAL: return h->o->globalMarks[node->variable] != h->o->stamp;
+        case NODE_UNARY: return isInvariant(h, node->left);
+        case NODE_BINARY:
+        case NODE_AND:
+        case NODE_OR: return isInvariant(h, node->left) && isInvariant(h, node->right);
+        default: return false;
+    }
+}
+
+// Replaces 'node' by a temp computed before the loop: the one hoisted
+// for an equal expression if there is one, which is always safe, or
+// else a new one if nothing that has to come first has run yet.
+static bool hoist(Hoister* h, Node* node) {
+    Node* loop = h->loop;
+    for (int i = 0; i < loop->count; i++) {
+        if (equalNodes(loop->children[i], node)) {
+            wrapInTemp(h->o, node, NODE_GET_TEMP, loop->children[i]->variable);
+            return true;
+        }
+    }
+    if (!h->canHoist) return false;
+    int temp = newTemp(h->o, true, nodeCost(h->o, node));
+    wrapInTemp(h->o, node, NODE_GET_TEMP, temp);
+    Node* init = newNode(h->o->vm, h->o->tree, NODE_SET_TEMP, node->line);
+    init->variable = temp;
+    init->left = node->left;
+    appendNode(h->o->vm, loop, init);
+    return true;
+}
+
+static void hoistExpression(Hoister* h, Node* node) {
+    if (hasOperation(node) && isInvariant(h, node) && hoist(h, node)) return;
+    switch (node->type) {
+        case NODE_SET_LOCAL:
+        case NODE_SET_GLOBAL:
+        case NODE_UNARY: hoistExpression(h, node->left); break;
+        case NODE_BINARY:
+            hoistExpression(h, node->left);
+            hoistExpression(h, node->right);
+            break;
+        case NODE_AND:
+        case NODE_OR: {
+            hoistExpression(h, node->left);
+            // The right operand may not run.
+            bool canHoist = h->canHoist && (h->inCondition || isHarmless(h->o, node->right));
+            h->canHoist = false;
+            hoistExpression(h, node->right);
+            h->canHoist = canHoist;
+            break;
+        }
+        default: break;
+    }
+    if (mayFail(h->o, node) && !h->inCondition) h->canHoist = false;
+}
+
+static void hoistBody(Hoister* h, Node* node) {
+    switch (node->type) {
+        case NODE_EXPRESSION:
+        case NODE_DEFINE_LOCAL: hoistExpression(h, node->left); break;
+        case NODE_PRINT:
+            hoistExpression(h, node->left);
+            h->canHoist = false;
+            break;
+        case NODE_BLOCK:
+            for (int i = 0; i < node->count; i++) hoistBody(h, node->children[i]);
+            break;
+        case NODE_IF:
+            hoistExpression(h, node->left);
+            h->canHoist = false;
+            hoistBody(h, node->right);
+            if (node->elseBranch != NULL) hoistBody(h, node->elseBranch);
+            break;
+        case NODE_WHILE:
+            // May not run, but what it shares with this loop's hoisted
+            // expressions, including its own, can use their temps.
+            h->canHoist = false;
+            for (int i = 0; i < node->count; i++) hoistExpression(h, node->children[i]->left);
+            hoistExpression(h, node->left);
+            hoistBody(h, node->right);
+            break;
+        default: break;
+    }
+}
+
+static void hoistInvariants(Optimizer* o, Node* node) {
+    switch (node->type) {
+        case NODE_BLOCK:
+            for (int i = 0; i < node->count; i++) hoistInvariants(o, node->children[i]);
+            break;
+        case NODE_IF:
+            hoistInvariants(o, node->right);
+            if (node->elseBranch != NULL) hoistInvariants(o, node->elseBranch);
+            break;
+        case NODE_WHILE: {
+            // Inner loops first; what they hoist stays inside this one.
+            hoistInvariants(o, node->right);
+            o->stamp++;
+            markWrites(o, node->left, o->stamp);
+            markWrites(o, node->right, o->stamp);
+            Hoister h = {o, node, true, true};
+            hoistExpression(&h, node->left);
+            h.inCondition = false;
+            hoistBody(&h, node->right);
+            break;
+        }
+        default: break;
+    }
+}
+
+// Common subexpressions. Walking the tree in evaluation order, a pure
+// expression equal to one computed earlier is replaced by a temp, if no
+// variable it reads has been stored to since and the earlier one is
+// sure to have run. The earlier occurrence stores the temp, which is
+// declared before the statement holding it. Whether a temp is worth
+// its slot is decided at the end, from how often it is reused.
+
+typedef struct {
+    int statement;
+    int temp;
+} PendingTemp;
+
+typedef struct {
+    int count;
+    int capacity;
+    PendingTemp* temps;
+} PendingTemps;
+
+typedef struct {
+    // The first occurrence.
+    Node* node;
+    // -1 until a later occurrence reuses it.
+    int temp;
+    // The clock when it was computed.
+    int clock;
+    // Where to declare the temp: a statement of the innermost list the
+    // first occurrence is in.
+    PendingTemps* pending;
+    int statement;
+} Available;
+
+typedef struct {
+    Optimizer* o;
+    int count;
+    int capacity;
+    Available* available;
+    // Ticks on every store. The marks hold the clock of the last store
+    // to each variable.
+    int clock;
+    PendingTemps* pending;
+    int statement;
+} Cse;
+
+static bool unchangedSince(Cse* c, Node* node, int clock) {
+    switch (node->type) {
+        case NODE_GET_LOCAL: return c->o->localMarks[node->variable] <= clock;
+        case NODE_GET_GLOBAL: return c->o->globalMarks[node->variable] <= clock;
+        case NODE_GET_TEMP:
+        case NODE_SET_TEMP:
+        case NODE_UNARY: return unchangedSince(c, node->left, clock);
+        case NODE_BINARY:
+        case NODE_AND:
+        case NODE_OR:
+            return unchangedSince(c, node->left, clock) && unchangedSince(c, node->right, clock);
+        default: return true;
+    }
+}
+
+static void addPending(Cse* c, PendingTemps* pending, int statement, int temp) {
+    if (pending->capacity < pending->count + 1) {
+        int oldCapacity = pending->capacity;
+        pending->capacity = GROW_CAPACITY(oldCapacity);
+        pending->temps = GROW_ARRAY(c->o->vm, PendingTemp, pending->temps, oldCapacity,
+                                    pending->capacity);
+    }
+    pending->temps[pending->count].statement = statement;
+    pending->temps[pending->count].temp = temp;
+    pending->count++;
+}
+
+static bool reuseAvailable(Cse* c, Node* node) {
+    int oldest = c->count > CSE_WINDOW ? c->count - CSE_WINDOW : 0;
+    for (int i = c->count - 1; i >= oldest; i--) {
+        Available* entry = &c->available[i];
+        if (!equalNodes(entry->node, node) || !unchangedSince(c, entry->node, entry->clock)) {
+            continue;
+        }
+        if (entry->temp == -1) {
+            entry->temp = newTemp(c->o, false, nodeCost(c->o, entry->node));
+            wrapInTemp(c->o, entry->node, NODE_SET_TEMP, entry->temp);
+            addPending(c, entry->pending, entry->statement, entry->temp);
+        }
+        c->o->tree->temps[entry->temp].uses++;
+        wrapInTemp(c->o, node, NODE_GET_TEMP, entry->temp);
+        return true;
+    }
+    return false;
+}
+
+static void addAvailable(Cse* c, Node* node) {
+    if (c->capacity < c->count + 1) {
+        int oldCapacity = c->capacity;
+        c->capacity = GROW_CAPACITY(oldCapacity);
+        c->available = GROW_ARRAY(c->o->vm, Available, c->available, oldCapacity, c->capacity);
+    }
+    Available* entry = &c->available[c->count++];
+    entry->node = node;
+    entry->temp = -1;
+    entry->clock = c->clock;
+    entry->pending = c->pending;
+    entry->statement = c->statement;
+}
+
+static void cseExpression(Cse* c, Node* node) {
+    bool candidate = hasOperation(node) && isPure(node);
+    if (candidate && reuseAvailable(c, node)) return;
+    switch (node->type) {
+        case NODE_UNARY: cseExpression(c, node->left); break;
+        case NODE_BINARY:
+            cseExpression(c, node->left);
+            cseExpression(c, node->right);
+            break;
+        case NODE_AND:
+        case NODE_OR: {
+            cseExpression(c, node->left);
+            // What the right operand computes may not have run.
+            int mark = c->count;
+            cseExpression(c, node->right);
+            c->count = mark;
+            break;
+        }
+        case NODE_SET_LOCAL:
+            cseExpression(c, node->left);
+            c->o->localMarks[node->variable] = ++c->clock;
+            break;
+        case NODE_SET_GLOBAL:
+            cseExpression(c, node->left);
+            c->o->globalMarks[node->variable] = ++c->clock;
+            break;
+        default: break;
+    }
+    if (candidate) addAvailable(c, node);
+}
+
+static int comparePending(const void* a, const void* b) {
+    return ((const PendingTemp*)a)->statement - ((const PendingTemp*)b)->statement;
+}
+
+// Inserts a NODE_DECLARE_TEMP before the statement of each pending temp.
+static void declareTemps(Optimizer* o, Node* list, PendingTemps* pending) {
+    qsort(pending->temps, pending->count, sizeof(PendingTemp), comparePending);
+    int capacity = list->count + pending->count;
+    Node** children = ALLOCATE(o->vm, Node*, capacity);
+    int count = 0;
+    int next = 0;
+    for (int i = 0; i < list->count; i++) {
+        while (next < pending->count && pending->temps[next].statement == i) {
+            Node* declare = newNode(o->vm, o->tree, NODE_DECLARE_TEMP, list->children[i]->line);
+            declare->variable = pending->temps[next++].temp;
+            children[count++] = declare;
+        }
+        children[count++] = list->children[i];
+    }
+    FREE_ARRAY(o->vm, Node*, list->children, list->capacity);
+    list->children = children;
+    list->count = count;
+    list->capacity = capacity;
+}
+
+static void cseStatement(Cse* c, Node* node);
+
+static void cseList(Cse* c, Node* list) {
+    PendingTemps pending = {0, 0, NULL};
+    PendingTemps* outerPending = c->pending;
+    int outerStatement = c->statement;
+    int mark = c->count;
+    c->pending = &pending;
+    for (int i = 0; i < list->count; i++) {
+        c->statement = i;
+        cseStatement(c, list->children[i]);
+    }
+    c->count = mark;
+    c->pending = outerPending;
+    c->statement = outerStatement;
+    if (pending.count > 0) declareTemps(c->o, list, &pending);
+    FREE_ARRAY(c->o->vm, PendingTemp, pending.temps, pending.capacity);
+}
+
+static void cseStatement(Cse* c, Node* node) {
+    switch (node->type) {
+        case NODE_EXPRESSION:
+        case NODE_PRINT: cseExpression(c, node->left); break;
+        case NODE_DEFINE_GLOBAL:
+            cseExpression(c, node->left);
+            c->o->globalMarks[node->variable] = ++c->clock;
+            break;
+        case NODE_DEFINE_LOCAL:
+            cseExpression(c, node->left);
+            c->o->localMarks[node->variable] = ++c->clock;
+            break;
+        case NODE_BLOCK: cseList(c, node); break;
+        case NODE_IF:
+            cseExpression(c, node->left);
+            cseList(c, node->right);
+            if (node->elseBranch != NULL) cseList(c, node->elseBranch);
+            break;
+        case NODE_WHILE: {
+            // A later iteration sees the stores of an earlier one.
+            markWrites(c->o, node, ++c->clock);
+            int mark = c->count;
+            cseExpression(c, node->left);
+            cseList(c, node->right);
+            c->count = mark;
+            break;
+        }
+        default: break;
+    }
+}
+
+static void eliminateCommonSubexpressions(Optimizer* o) {
+    Cse c = {o, 0, 0, NULL, 0, NULL, 0};
+    for (int i = 0; i < o->tree->localCount; i++) o->localMarks[i] = 0;
+    for (int i = 0; i < o->globalCount; i++) o->globalMarks[i] = 0;
+    cseList(&c, o->tree->root);
+    FREE_ARRAY(o->vm, Available, c.available, c.capacity);
+
+    // A temp costs a NIL, a store and a POP each time its list runs.
+    for (int i = 0; i < o->tree->tempCount; i++) {
+        Temp* temp = &o->tree->temps[i];
+        if (!temp->enabled) temp->enabled = temp->uses * (temp->cost - 1) > 3;
+    }
+}
+
+void optimizeTree(SplVM* vm, Tree* tree) {
+    Optimizer o;
+    o.vm = vm;
+    o.tree = tree;
+    o.globalCount = vm->globalValues.count;
+    o.localMarks = ALLOCATE(vm, int, tree->localCount);
+    o.globalMarks = ALLOCATE(vm, int, o.globalCount);
+    for (int i = 0; i < tree->localCount; i++) o.localMarks[i] = 0;
+    for (int i = 0; i < o.globalCount; i++) o.globalMarks[i] = 0;
+    o.stamp = 0;
+
+    // Globals defined by earlier scripts stay defined.
+    o.definedGlobals = ALLOCATE(vm, bool, o.globalCount);
+    for (int i = 0; i < o.globalCount; i++) {
+        o.definedGlobals[i] = !IS_UNDEFINED(vm->globalValues.values[i]);
+    }
+
+    eliminateDeadStores(&o);
+    // Only top-level statements define globals. Once one has run, the
+    // global is defined for every statement after it.
+    Node* root = tree->root;
+    for (int i = 0; i < root->count; i++) {
+        hoistInvariants(&o, root->children[i]);
+        if (root->children[i]->type == NODE_DEFINE_GLOBAL) {
+            o.definedGlobals[root->children[i]->variable] = true;
+        }
+    }
+    eliminateCommonSubexpressions(&o);
+
+    FREE_ARRAY(vm, int, o.localMarks, tree->localCount);
+    FREE_ARRAY(vm, int, o.globalMarks, o.globalCount);
+    FREE_ARRAY(vm, bool, o.definedGlobals, o.globalCount);
+}
+
+// Lowering writes the same instruction sequences as the single-pass
+// compiler, assigning stack slots to locals and temps as it goes.
+
+typedef struct {
+    SplVM* vm;
+    Tree* tree;
+    Chunk* chunk;
+    // Stack slot of each local id.
+    int* slots;
+    // Slots taken by the locals and temps in scope.
+    int depth;
+    bool hadError;
+} Lowerer;
+
+static void lowerError(Lowerer* l, int line, const char* message) {
+    if (l->hadError) return;
+    fprintf(stderr, "%s[line %d] Error: %s\n%s", ANSI_COLOR_RED, line, message,
+            ANSI_COLOR_RESET);
+    l->hadError = true;
+}
+
+static void emitByte(Lowerer* l, uint8_t byte, int line) {
+    writeChunk(l->vm, l->chunk, byte, line);
+}
+
+// 'op' with a one-byte operand, or 'longOp' with a four-byte one.
+static void emitOperand(Lowerer* l, uint8_t op, uint8_t longOp, int operand, int line) {
+    if (operand <= UINT8_MAX) {
+        emitByte(l, op, line);
+        emitByte(l, (uint8_t)operand, line);
+        return;
+    }
+    uint8_t largeConstant[CONSTANT_LONG_BYTE_SIZE];
+    CONVERT_TO_BYTE_ARRAY(largeConstant, CONSTANT_LONG_BYTE_SIZE, operand);
+    emitByte(l, longOp, line);
+    for (int i = 0; i < CONSTANT_LONG_BYTE_SIZE; i++) emitByte(l, largeConstant[i], line);
+}
+
+static int emitJump(Lowerer* l, uint8_t instruction, int line) {
+    emitByte(l, instruction, line);
+    emitByte(l, 0xff, line);
+    emitByte(l, 0xff, line);
+    return l->chunk->count - 2;
+}
+
+static void patchJump(Lowerer* l, int offset, int line) {
+    int jump = l->chunk->count - offset - 2;
+    if (jump > UINT16_MAX) lowerError(l, line, "Too much code to jump over.");
+    l->chunk->code[offset] = (jump >> 8) & 0xff;
+    l->chunk->code[offset + 1] = jump & 0xff;
+}
+
+static void emitLoop(Lowerer* l, int loopStart, int line) {
+    emitByte(l, OP_LOOP, line);
+    int offset = l->chunk->count - loopStart + 2;
+    if (offset > UINT16_MAX) lowerError(l, line, "Loop body too large.");
+    emitByte(l, (offset >> 8) & 0xff, line);
+    emitByte(l, offset & 0xff, line);
+}
+
+static void lowerExpression(Lowerer* l, Node* node) {
+    int line = node->line;
+    switch (node->type) {
+        case NODE_CONSTANT:
+            if (IS_BOOL(node->value)) {
+                emitByte(l, AS_BOOL(node->value) ? OP_TRUE : OP_FALSE, line);
+            } else if (IS_NIL(node->value)) {
+                emitByte(l, OP_NIL, line);
+            } else if (!writeConstant(l->vm, l->chunk, node->value, line)) {
+                lowerError(l, line, "Too many constants in one chunk");
+            }
+            break;
+        case NODE_GET_LOCAL:
+            emitOperand(l, OP_GET_LOCAL, OP_GET_LOCAL_LONG, l->slots[node->variable], line);
+            break;
+        case NODE_SET_LOCAL:
+            lowerExpression(l, node->left);
+            emitOperand(l, OP_SET_LOCAL, OP_SET_LOCAL_LONG, l->slots[node->variable], line);
+            break;
+        case NODE_GET_GLOBAL:
+            emitOperand(l, OP_GET_GLOBAL, OP_GET_GLOBAL_LONG, node->variable, line);
+            break;
+        case NODE_SET_GLOBAL:
+            lowerExpression(l, node->left);
+            emitOperand(l, OP_SET_GLOBAL, OP_SET_GLOBAL_LONG, node->variable, line);
+            break;
+        case NODE_UNARY:
+            lowerExpression(l, node->left);
+            emitByte(l, node->op, line);
+            break;
+        case NODE_BINARY:
+            lowerExpression(l, node->left);
+            lowerExpression(l, node->right);
+            emitByte(l, node->op, line);
+            break;
+        case NODE_AND: {
+            lowerExpression(l, node->left);
+            int endJump = emitJump(l, OP_JUMP_IF_FALSE, line);
+            emitByte(l, OP_POP, line);
+            lowerExpression(l, node->right);
+            patchJump(l, endJump, line);
+            break;
+        }
+        case NODE_OR: {
+            lowerExpression(l, node->left);
+            int elseJump = emitJump(l, OP_JUMP_IF_FALSE, line);
+            int endJump = emitJump(l, OP_JUMP, line);
+            patchJump(l, elseJump, line);
+            emitByte(l, OP_POP, line);
+            lowerExpression(l, node->right);
+            patchJump(l, endJump, line);
+            break;
+        }
+        case NODE_GET_TEMP: {
+            Temp* temp = &l->tree->temps[node->variable];
+            if (temp->enabled && temp->assigned) {
+                emitOperand(l, OP_GET_LOCAL, OP_GET_LOCAL_LONG, temp->slot, line);
+            } else {
+                lowerExpression(l, node->left);
+            }
+            break;
+        }
+        case NODE_SET_TEMP: {
+            Temp* temp = &l->tree->temps[node->variable];
+            lowerExpression(l, node->left);
+            if (temp->enabled) {
+                emitOperand(l, OP_SET_LOCAL, OP_SET_LOCAL_LONG, temp->slot, line);
+                temp->assigned = true;
+            }
+            break;
+        }
+        default: break;
+    }
+}
+
+static void lowerStatement(Lowerer* l, Node* node);
+
+static void lowerBlock(Lowerer* l, Node* block) {
+    int depth = l->depth;
+    for (int i = 0; i < block->count; i++) lowerStatement(l, block->children[i]);
+    for (; l->depth > depth; l->depth--) emitByte(l, OP_POP, block->line);
+}
+
+static void lowerWhile(Lowerer* l, Node* loop) {
+    int line = loop->line;
+    if (loop->count == 0) {
+        int loopStart = l->chunk->count;
+        lowerExpression(l, loop->left);
+        int exitJump = emitJump(l, OP_JUMP_IF_FALSE, line);
+        emitByte(l, OP_POP, line);
+        lowerStatement(l, loop->right);
+        emitLoop(l, loopStart, line);
+        patchJump(l, exitJump, line);
+        emitByte(l, OP_POP, line);
+        return;
+    }
+
+    // NIL for each temp; condition; JUMP_IF_FALSE exit; POP; the hoisted
+    // expressions; body: the body; condition; JUMP_IF_FALSE exit; POP;
+    // LOOP body; exit: POP; a POP for each temp. The first test of the
+    // condition computes its hoisted parts itself.
+    int depth = l->depth;
+    for (int i = 0; i < loop->count; i++) {
+        emitByte(l, OP_NIL, line);
+        l->tree->temps[loop->children[i]->variable].slot = l->depth++;
+    }
+    lowerExpression(l, loop->left);
+    int skipJump = emitJump(l, OP_JUMP_IF_FALSE, line);
+    emitByte(l, OP_POP, line);
+    for (int i = 0; i < loop->count; i++) {
+        lowerExpression(l, loop->children[i]);
+        emitByte(l, OP_POP, line);
+    }
+    int bodyStart = l->chunk->count;
+    lowerStatement(l, loop->right);
+    lowerExpression(l, loop->left);
+    int exitJump = emitJump(l, OP_JUMP_IF_FALSE, line);
+    emitByte(l, OP_POP, line);
+    emitLoop(l, bodyStart, line);
+    patchJump(l, skipJump, line);
+    patchJump(l, exitJump, line);
+    emitByte(l, OP_POP, line);
+    for (; l->depth > depth; l->depth--) emitByte(l, OP_POP, line);
+}
+
+static void lowerStatement(Lowerer* l, Node* node) {
+    int line = node->line;
+    switch (node->type) {
+        case NODE_EXPRESSION:
+            lowerExpression(l, node->left);
+            emitByte(l, OP_POP, line);
+            break;
+        case NODE_PRINT:
+            lowerExpression(l, node->left);
+            emitByte(l, OP_PRINT, line);
+            break;
+        case NODE_DEFINE_GLOBAL:
+            lowerExpression(l, node->left);
+            emitOperand(l, OP_DEFINE_GLOBAL, OP_DEFINE_GLOBAL_LONG, node->variable, line);
+            break;
+        case NODE_DEFINE_LOCAL:
+            l->slots[node->variable] = l->depth;
+            lowerExpression(l, node->left);
+            l->depth++;
+            break;
+        case NODE_DECLARE_TEMP: {
+            Temp* temp = &l->tree->temps[node->variable];
+            if (temp->enabled) {
+                emitByte(l, OP_NIL, line);
+                temp->slot = l->depth++;
+            }
+            break;
+        }
+        case NODE_BLOCK: lowerBlock(l, node); break;
+        case NODE_IF: {
+            lowerExpression(l, node->left);
+            int thenJump = emitJump(l, OP_JUMP_IF_FALSE, line);
+            emitByte(l, OP_POP, line);
+            lowerStatement(l, node->right);
+            int elseJump = emitJump(l, OP_JUMP, line);
+            patchJump(l, thenJump, line);
+            emitByte(l, OP_POP, line);
+            if (node->elseBranch != NULL) lowerStatement(l, node->elseBranch);
+            patchJump(l, elseJump, line);
+            break;
+        }
+        case NODE_WHILE: lowerWhile(l, node); break;
+        default: break;
+    }
+}
+
+bool lowerTree(SplVM* vm, Tree* tree, Chunk* chunk) {
+    Lowerer l;
+    l.vm = vm;
+    l.tree = tree;
+    l.chunk = chunk;
+    l.slots = ALLOCATE(vm, int, tree->localCount);
+    l.depth = 0;
+    l.hadError = false;
+    lowerBlock(&l, tree->root);
+    FREE_ARRAY(vm, int, l.slots, tree->localCount);
+    return !l.hadError;
+}
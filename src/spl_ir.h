@@ -0,0 +1,94 @@
+#ifndef SPL_IR_H
+#define SPL_IR_H
+
+#include "spl_chunk.h"
+#include "spl_value.h"
+
+// With -O the compiler builds a tree of the program instead of writing
+// bytecode as it parses. optimizeTree() rewrites the tree and
+// lowerTree() turns it into the same bytecode the single-pass compiler
+// would have written for it.
+typedef enum {
+    // Expressions
+    NODE_CONSTANT,
+    NODE_GET_LOCAL,
+    NODE_SET_LOCAL,
+    NODE_GET_GLOBAL,
+    NODE_SET_GLOBAL,
+    NODE_UNARY,
+    NODE_BINARY,
+    NODE_AND,
+    NODE_OR,
+    // A value computed once and kept in a temporary local.
+    NODE_GET_TEMP,
+    NODE_SET_TEMP,
+    // Statements
+    NODE_EXPRESSION,
+    NODE_PRINT,
+    NODE_DEFINE_GLOBAL,
+    NODE_DEFINE_LOCAL,
+    NODE_DECLARE_TEMP,
+    NODE_BLOCK,
+    NODE_IF,
+    NODE_WHILE
+} NodeType;
+
+typedef struct Node Node;
+
+struct Node {
+    NodeType type;
+    int line;
+    // Instruction of a unary or binary node. '>=' and '<=' are a NOT
+    // over LESS and GREATER, as in the bytecode.
+    uint8_t op;
+    // Local id, global slot or temp index. Local ids are unique in the
+    // tree; stack slots are only assigned when it is lowered.
+    int variable;
+    Value value;
+    // Operand of a unary node, left operand of a binary one, the value
+    // stored or printed, the condition of an if or while, and what a
+    // temp stands for.
+    Node* left;
+    // Right operand; the then branch of an if; the body of a while.
+    Node* right;
+    // Else branch of an if, or NULL.
+    Node* elseBranch;
+    // Statements of a block. For a while, the NODE_SET_TEMPs hoisted out
+    // of it, run once before the first iteration.
+    Node** children;
+    int count;
+    int capacity;
+    // Every node of a tree, for freeTree().
+    Node* next;
+};
+
+typedef struct {
+    // Set when the temp is worth a local; otherwise its uses compute
+    // the value again.
+    bool enabled;
+    // Whether the code lowered so far has stored the temp.
+    bool assigned;
+    int uses;
+    // Instructions the value takes to compute.
+    int cost;
+    int slot;
+} Temp;
+
+typedef struct {
+    // The top-level statements, a NODE_BLOCK.
+    Node* root;
+    Node* nodes;
+    int localCount;
+    int tempCount;
+    int tempCapacity;
+    Temp* temps;
+} Tree;
+
+void initTree(Tree* tree);
+void freeTree(SplVM* vm, Tree* tree);
+Node* newNode(SplVM* vm, Tree* tree, NodeType type, int line);
+void appendNode(SplVM* vm, Node* list, Node* node);
+void optimizeTree(SplVM* vm, Tree* tree);
+bool lowerTree(SplVM* vm, Tree* tree, Chunk* chunk);
+
+#endif
@@ -0,0 +1,639 @@
+#include "spl_jit.h"
+
+#ifdef SPL_JIT
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "spl_memory.h"
+#include "spl_vm.h"
+
+// A baseline template JIT for hot loops on x86-64. Every decoded
+// instruction of the loop region is replaced by a fixed machine-code
+// template; jumps inside the region become native jumps, so the loop
+// runs without any dispatch.
+//
+// Register use inside the compiled code:
+//
+//   rbx  slots base (vm->stack), r12  stack top (vm->stackTop)
+//   rax, rcx, rdx, r8, r9, xmm0, xmm1  scratch
+//
+// The code is specialised to one SplVM: its addresses are baked in as
+// immediates and every C helper gets it in rdi. vm->stackTop is only
+// written back around calls into C helpers and on
+// exit. Whenever a template cannot handle its operands (a type guard
+// fails, an undefined global, ...) it leaves the stack untouched and
+// exits with its own index, so run() executes the instruction itself
+// and produces exactly the interpreter's result or error.
+
+#define JIT_HOT_LOOP 64
+
+#define RAX 0
+#define RCX 1
+#define RDX 2
+#define RBX 3
+#define RSI 6
+#define RDI 7
+#define R8 8
+#define R9 9
+#define R12 12
+#define R13 13
+
+#define CC_E 0x4
+#define CC_NE 0x5
+#define CC_BE 0x6
+#define CC_A 0x7
+#define JMP -1
+
+typedef struct {
+    int at;
+    int target;
+    // Leave the compiled code even if the target lies inside the region.
+    bool exit;
+} Fixup;
+
+typedef struct {
+    SplVM* vm;
+    Chunk* chunk;
+    Instruction* code;
+    int start;
+    int end;
+    uint8_t* bytes;
+    int count;
+    int capacity;
+    // Native offset of every instruction in the region.
+    int* labels;
+    Fixup* fixups;
+    int fixupCount;
+    int fixupCapacity;
+} Assembler;
+
+static void emitByte(Assembler* as, uint8_t byte) {
+    if (as->capacity < as->count + 1) {
+        int oldCapacity = as->capacity;
+        as->capacity = GROW_CAPACITY(oldCapacity);
+        as->bytes = GROW_ARRAY(as->vm, uint8_t, as->bytes, oldCapacity, as->capacity);
+    }
+    as->bytes[as->count++] = byte;
+}
+
+static void emitBytes(Assembler* as, int count, const uint8_t* bytes) {
+    for (int i = 0; i < count; i++) emitByte(as, bytes[i]);
+}
+
+static void emitInt32(Assembler* as, int32_t value) {
+    uint32_t bits = (uint32_t)value;
+    for (int i = 0; i < 4; i++) emitByte(as, (uint8_t)(bits >> (i * 8)));
+}
+
+static void emitInt64(Assembler* as, uint64_t value) {
+    for (int i = 0; i < 8; i++) emitByte(as, (uint8_t)(value >> (i * 8)));
+}
+
+// mov reg, imm64
+static void emitMovImm(Assembler* as, int reg, uint64_t value) {
+    emitByte(as, 0x48 | (reg >> 3));
+    emitByte(as, 0xB8 + (reg & 7));
+    emitInt64(as, value);
+}
+
+// <op> rm, reg on 64-bit registers.
+static void emitRR(Assembler* as, uint8_t op, int rm, int reg) {
+    emitByte(as, 0x48 | ((reg >> 3) << 2) | (rm >> 3));
+    emitByte(as, op);
+    emitByte(as, 0xC0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+// <op> reg, [base + disp32] (or the reverse, depending on op).
+static void emitMem(Assembler* as, uint8_t op, int reg, int base, int32_t disp) {
+    emitByte(as, 0x48 | ((reg >> 3) << 2) | (base >> 3));
+    emitByte(as, op);
+    emitByte(as, 0x80 | ((reg & 7) << 3) | (base & 7));
+    if ((base & 7) == 4) emitByte(as, 0x24);
+    emitInt32(as, disp);
+}
+
+#define emitLoad(as, reg, base, disp) emitMem(as, 0x8B, reg, base, disp)
+#define emitStore(as, base, disp, reg) emitMem(as, 0x89, reg, base, disp)
+#define emitMov(as, dst, src) emitRR(as, 0x89, dst, src)
+#define emitCmp(as, a, b) emitRR(as, 0x39, a, b)
+
+// add/sub reg, imm8
+static void emitAddImm(Assembler* as, int reg, int8_t value) {
+    emitByte(as, 0x48 | (reg >> 3));
+    emitByte(as, 0x83);
+    if (value < 0) {
+        emitByte(as, 0xE8 | (reg & 7));
+        emitByte(as, (uint8_t)-value);
+    } else {
+        emitByte(as, 0xC0 | (reg & 7));
+        emitByte(as, (uint8_t)value);
+    }
+}
+
+static void emitPush(Assembler* as, int reg) {
+    if (reg >= 8) emitByte(as, 0x41);
+    emitByte(as, 0x50 + (reg & 7));
+}
+
+static void emitPop(Assembler* as, int reg) {
+    if (reg >= 8) emitByte(as, 0x41);
+    emitByte(as, 0x58 + (reg & 7));
+}
+
+// movq xmm, reg
+static void emitToXmm(Assembler* as, int xmm, int reg) {
+    uint8_t bytes[] = {0x66, 0x48 | (reg >> 3), 0x0F, 0x6E, 0xC0 | (xmm << 3) | (reg & 7)};
+    emitBytes(as, 5, bytes);
+}
+
+// movq reg, xmm
+static void emitFromXmm(Assembler* as, int reg, int xmm) {
+    uint8_t bytes[] = {0x66, 0x48 | (reg >> 3), 0x0F, 0x7E, 0xC0 | (xmm << 3) | (reg & 7)};
+    emitBytes(as, 5, bytes);
+}
+
+// Emits a jmp (cc == JMP) or jcc with a zero rel32 and returns the
+// position of the rel32 for patching.
+static int emitJump(Assembler* as, int cc) {
+    if (cc == JMP) {
+        emitByte(as, 0xE9);
+    } else {
+        emitByte(as, 0x0F);
+        emitByte(as, 0x80 + cc);
+    }
+    emitInt32(as, 0);
+    return as->count - 4;
+}
+
+static void patchJump(Assembler* as, int at, int target) {
+    int32_t rel = target - (at + 4);
+    memcpy(&as->bytes[at], &rel, sizeof(rel));
+}
+
+static void addFixup(Assembler* as, int at, int target, bool exit) {
+    if (as->fixupCapacity < as->fixupCount + 1) {
+        int oldCapacity = as->fixupCapacity;
+        as->fixupCapacity = GROW_CAPACITY(oldCapacity);
+        as->fixups = GROW_ARRAY(as->vm, Fixup, as->fixups, oldCapacity, as->fixupCapacity);
+    }
+    as->fixups[as->fixupCount].at = at;
+    as->fixups[as->fixupCount].target = target;
+    as->fixups[as->fixupCount].exit = exit;
+    as->fixupCount++;
+}
+
+static void branchTo(Assembler* as, int cc, int target) {
+    addFixup(as, emitJump(as, cc), target, false);
+}
+
+static void exitTo(Assembler* as, int cc, int offset) {
+    addFixup(as, emitJump(as, cc), offset, true);
+}
+
+static void pushRax(Assembler* as) {
+    emitStore(as, R12, 0, RAX);
+    emitAddImm(as, R12, 8);
+}
+
+// Exits unless reg holds a number. Expects QNAN in r9.
+static void guardNumber(Assembler* as, int reg, int offset) {
+    emitMov(as, R8, reg);
+    emitRR(as, 0x21, R8, R9);
+    emitCmp(as, R8, R9);
+    exitTo(as, CC_E, offset);
+}
+
+// Loads the two top values into xmm0 (a) and xmm1 (b), exiting unless
+// both are numbers.
+static void loadNumbers(Assembler* as, int offset) {
+    emitLoad(as, RAX, R12, -16);
+    emitLoad(as, RDX, R12, -8);
+    emitMovImm(as, R9, QNAN);
+    guardNumber(as, RAX, offset);
+    guardNumber(as, RDX, offset);
+    emitToXmm(as, 0, RAX);
+    emitToXmm(as, 1, RDX);
+}
+
+// xmm0 = xmm0 <op> xmm1
+static void emitSse(Assembler* as, uint8_t sseOp) {
+    uint8_t bytes[] = {0xF2, 0x0F, sseOp, 0xC1};
+    emitBytes(as, 4, bytes);
+}
+
+// Replaces the two top values with the number in xmm0.
+static void emitArithmetic(Assembler* as, uint8_t sseOp) {
+    emitSse(as, sseOp);
+    emitFromXmm(as, RAX, 0);
+    emitStore(as, R12, -16, RAX);
+    emitAddImm(as, R12, -8);
+}
+
+// ucomisd so that "above" means a > b (swapped for <).
+static void emitCompare(Assembler* as, bool less) {
+    uint8_t bytes[] = {0x66, 0x0F, 0x2E, less ? 0xC8 : 0xC1};
+    emitBytes(as, 4, bytes);
+}
+
+static void emitCompareValue(Assembler* as, bool less, int cc) {
+    emitCompare(as, less);
+    uint8_t bytes[] = {0x0F, 0x90 + cc, 0xC0, 0x0F, 0xB6, 0xC0};
+    emitBytes(as, 6, bytes);
+    emitMovImm(as, RCX, FALSE_VAL);
+    emitRR(as, 0x01, RAX, RCX);
+    emitStore(as, R12, -16, RAX);
+    emitAddImm(as, R12, -8);
+}
+
+static void emitCall(Assembler* as, void* function) {
+    emitMovImm(as, RAX, (uint64_t)(uintptr_t)&as->vm->stackTop);
+    emitStore(as, RAX, 0, R12);
+    emitMovImm(as, RDI, (uint64_t)(uintptr_t)as->vm);
+    emitMovImm(as, RAX, (uint64_t)(uintptr_t)function);
+    emitByte(as, 0xFF);
+    emitByte(as, 0xD0);
+    emitMovImm(as, RCX, (uint64_t)(uintptr_t)&as->vm->stackTop);
+    emitLoad(as, R12, RCX, 0);
+}
+
+// Calls a helper returning bool and exits if it returned false.
+static void emitCallChecked(Assembler* as, void* function, int offset) {
+    emitCall(as, function);
+    emitByte(as, 0x84);
+    emitByte(as, 0xC0);
+    exitTo(as, CC_E, offset);
+}
+
+static void loadGlobals(Assembler* as, int reg) {
+    emitMovImm(as, reg, (uint64_t)(uintptr_t)&as->vm->globalValues.values);
+    emitLoad(as, reg, reg, 0);
+}
+
+static void jitGlobalBarrier(SplVM* vm, int slot) {
+    GLOBAL_BARRIER(vm, slot, vm->stackTop[-1]);
+}
+
+// Global stores go through GLOBAL_BARRIER while the collector is
+// marking or the value is young; the checks are inline, the barrier
+// itself a call.
+static void emitGlobalBarrier(Assembler* as, int slot) {
+    emitMovImm(as, RAX, (uint64_t)(uintptr_t)&as->vm->gcPhase);
+    uint8_t bytes[] = {0x83, 0x38, GC_MARK};  // cmp dword [rax], GC_MARK
+    emitBytes(as, 3, bytes);
+    int marking = emitJump(as, CC_E);
+    // Young iff value - OBJ_VAL(nursery) < NURSERY_SIZE, unsigned.
+    emitMovImm(as, RAX, (uint64_t)(uintptr_t)&as->vm->nursery);
+    emitLoad(as, RAX, RAX, 0);
+    emitMovImm(as, RCX, SIGN_BIT | QNAN);
+    emitRR(as, 0x01, RAX, RCX);
+    emitLoad(as, RCX, R12, -8);
+    emitRR(as, 0x29, RCX, RAX);
+    emitMovImm(as, RDX, NURSERY_SIZE - 1);
+    emitCmp(as, RCX, RDX);
+    int skip = emitJump(as, CC_A);
+    patchJump(as, marking, as->count);
+    emitMovImm(as, RSI, (uint64_t)slot);
+    emitCall(as, (void*)jitGlobalBarrier);
+    patchJump(as, skip, as->count);
+}
+
+static void jitEqual(SplVM* vm) {
+    flattenValue(vm, &vm->stackTop[-1]);
+    flattenValue(vm, &vm->stackTop[-2]);
+    Value b = pop(vm);
+    Value a = pop(vm);
+    push(vm, BOOL_VAL(valuesEqual(a, b)));
+}
+
+static void jitNot(SplVM* vm) {
+    Value value = pop(vm);
+    push(vm, BOOL_VAL(IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value))));
+}
+
+static bool jitNegate(SplVM* vm) {
+    if (!IS_NUMBER(vm->stackTop[-1])) return false;
+    push(vm, NUMBER_VAL(-AS_NUMBER(pop(vm))));
+    return true;
+}
+
+static void jitPrint(SplVM* vm) {
+    flattenValue(vm, &vm->stackTop[-1]);
+    printValue(pop(vm));
+    printf("\n");
+}
+
+// Emits the template for instruction 'offset'. Returns false for
+// instructions the JIT does not handle.
+static bool emitInstruction(Assembler* as, int offset) {
+    Chunk* chunk = as->chunk;
+    Instruction* instr = &as->code[offset];
+    uint8_t instruction = instr->op;
+    switch (instruction) {
+        case OP_CONSTANT:
+            emitMovImm(as, RAX, chunk->constants.values[instr->a]);
+            pushRax(as);
+            return true;
+        case OP_NIL:
+            emitMovImm(as, RAX, NIL_VAL);
+            pushRax(as);
+            return true;
+        case OP_TRUE:
+            emitMovImm(as, RAX, TRUE_VAL);
+            pushRax(as);
+            return true;
+        case OP_FALSE:
+            emitMovImm(as, RAX, FALSE_VAL);
+            pushRax(as);
+            return true;
+        case OP_POP:
+            emitAddImm(as, R12, -8);
+            return true;
+        case OP_GET_LOCAL:
+            emitLoad(as, RAX, RBX, instr->a * 8);
+            pushRax(as);
+            return true;
+        case OP_SET_LOCAL:
+        case OP_SET_LOCAL_POP:
+            emitLoad(as, RAX, R12, -8);
+            emitStore(as, RBX, instr->a * 8, RAX);
+            if (instruction == OP_SET_LOCAL_POP) emitAddImm(as, R12, -8);
+            return true;
+        case OP_GET_GLOBAL:
+            loadGlobals(as, RAX);
+            emitLoad(as, RAX, RAX, instr->a * 8);
+            emitMovImm(as, RCX, UNDEFINED_VAL);
+            emitCmp(as, RAX, RCX);
+            exitTo(as, CC_E, offset);
+            pushRax(as);
+            return true;
+        case OP_DEFINE_GLOBAL:
+            emitGlobalBarrier(as, instr->a);
+            loadGlobals(as, RAX);
+            emitLoad(as, RCX, R12, -8);
+            emitStore(as, RAX, instr->a * 8, RCX);
+            emitAddImm(as, R12, -8);
+            return true;
+        case OP_SET_GLOBAL:
+        case OP_SET_GLOBAL_POP: {
+            int disp = instr->a * 8;
+            emitGlobalBarrier(as, instr->a);
+            loadGlobals(as, RAX);
+            emitLoad(as, RCX, RAX, disp);
+            emitMovImm(as, RDX, UNDEFINED_VAL);
+            emitCmp(as, RCX, RDX);
+            exitTo(as, CC_E, offset);
+            emitLoad(as, RCX, R12, -8);
+            emitStore(as, RAX, disp, RCX);
+            if (instruction == OP_SET_GLOBAL_POP) emitAddImm(as, R12, -8);
+            return true;
+        }
+        case OP_EQUAL:
+            emitCall(as, (void*)jitEqual);
+            return true;
+        case OP_NOT:
+            emitCall(as, (void*)jitNot);
+            return true;
+        case OP_NEGATE:
+            emitCallChecked(as, (void*)jitNegate, offset);
+            return true;
+        case OP_PRINT:
+            emitCall(as, (void*)jitPrint);
+            return true;
+        case OP_ADD:
+        case OP_ADD_NUM: {
+            // Numbers inline, everything else (strings) through addValues().
+            emitLoad(as, RAX, R12, -16);
+            emitLoad(as, RDX, R12, -8);
+            emitMovImm(as, R9, QNAN);
+            emitMov(as, R8, RAX);
+            emitRR(as, 0x21, R8, R9);
+            emitCmp(as, R8, R9);
+            int slowA = emitJump(as, CC_E);
+            emitMov(as, R8, RDX);
+            emitRR(as, 0x21, R8, R9);
+            emitCmp(as, R8, R9);
+            int slowB = emitJump(as, CC_E);
+            emitToXmm(as, 0, RAX);
+            emitToXmm(as, 1, RDX);
+            emitArithmetic(as, 0x58);
+            int done = emitJump(as, JMP);
+            patchJump(as, slowA, as->count);
+            patchJump(as, slowB, as->count);
+            emitCallChecked(as, (void*)addValues, offset);
+            patchJump(as, done, as->count);
+            return true;
+        }
+        case OP_SUBTRACT:
+        case OP_SUBTRACT_NUM:
+            loadNumbers(as, offset);
+            emitArithmetic(as, 0x5C);
+            return true;
+        case OP_MULTIPLY:
+        case OP_MULTIPLY_NUM:
+            loadNumbers(as, offset);
+            emitArithmetic(as, 0x59);
+            return true;
+        case OP_DIVIDE:
+        case OP_DIVIDE_NUM:
+            loadNumbers(as, offset);
+            emitArithmetic(as, 0x5E);
+            return true;
+        case OP_GREATER:
+        case OP_GREATER_NUM:
+            loadNumbers(as, offset);
+            emitCompareValue(as, false, CC_A);
+            return true;
+        case OP_LESS:
+        case OP_LESS_NUM:
+            loadNumbers(as, offset);
+            emitCompareValue(as, true, CC_A);
+            return true;
+        case OP_NOT_GREATER:
+            loadNumbers(as, offset);
+            emitCompareValue(as, false, CC_BE);
+            return true;
+        case OP_NOT_LESS:
+            loadNumbers(as, offset);
+            emitCompareValue(as, true, CC_BE);
+            return true;
+        case OP_ADD_LOCAL_CONSTANT:
+        case OP_ADD_LOCAL_CONSTANT_NUM: {
+            Value constant = chunk->constants.values[instr->b];
+            if (!IS_NUMBER(constant)) return false;
+            emitLoad(as, RAX, RBX, instr->a * 8);
+            emitMovImm(as, R9, QNAN);
+            guardNumber(as, RAX, offset);
+            emitToXmm(as, 0, RAX);
+            emitMovImm(as, RDX, constant);
+            emitToXmm(as, 1, RDX);
+            emitSse(as, 0x58);
+            emitFromXmm(as, RAX, 0);
+            pushRax(as);
+            return true;
+        }
+        case OP_JUMP:
+        case OP_LOOP:
+            branchTo(as, JMP, instr->a);
+            return true;
+        case OP_JUMP_IF_FALSE:
+            emitLoad(as, RAX, R12, -8);
+            emitMovImm(as, RCX, FALSE_VAL);
+            emitCmp(as, RAX, RCX);
+            branchTo(as, CC_E, instr->a);
+            emitMovImm(as, RCX, NIL_VAL);
+            emitCmp(as, RAX, RCX);
+            branchTo(as, CC_E, instr->a);
+            return true;
+        case OP_JUMP_IF_GREATER:
+        case OP_JUMP_IF_NOT_GREATER:
+        case OP_JUMP_IF_LESS:
+        case OP_JUMP_IF_NOT_LESS: {
+            bool less = instruction == OP_JUMP_IF_LESS ||
+                instruction == OP_JUMP_IF_NOT_LESS;
+            bool negated = instruction == OP_JUMP_IF_NOT_GREATER ||
+                instruction == OP_JUMP_IF_NOT_LESS;
+            loadNumbers(as, offset);
+            // Pop before comparing; add would clobber the flags.
+            emitAddImm(as, R12, -16);
+            emitCompare(as, less);
+            branchTo(as, negated ? CC_BE : CC_A, instr->a);
+            return true;
+        }
+        default:
+            return false;
+    }
+}
+
+// Writes the finished code into a fresh executable mapping.
+static JitLoopFn install(Jit* jit, Assembler* as) {
+    size_t size = (size_t)as->count;
+    void* memory = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) return NULL;
+    memcpy(memory, as->bytes, size);
+    if (mprotect(memory, size, PROT_READ | PROT_EXEC) != 0) {
+        munmap(memory, size);
+        return NULL;
+    }
+
+    if (jit->pageCapacity < jit->pageCount + 1) {
+        int oldCapacity = jit->pageCapacity;
+        jit->pageCapacity = GROW_CAPACITY(oldCapacity);
+        jit->pages = GROW_ARRAY(jit->vm, JitPage, jit->pages, oldCapacity, jit->pageCapacity);
+    }
+    jit->pages[jit->pageCount].memory = memory;
+    jit->pages[jit->pageCount].size = size;
+    jit->pageCount++;
+    return (JitLoopFn)memory;
+}
+
+static JitLoopFn compileLoop(Jit* jit, int start, int end) {
+    Assembler as;
+    as.vm = jit->vm;
+    as.chunk = jit->chunk;
+    as.code = jit->decoded->code;
+    as.start = start;
+    as.end = end;
+    as.bytes = NULL;
+    as.count = 0;
+    as.capacity = 0;
+    as.labels = ALLOCATE(as.vm, int, end - start);
+    as.fixups = NULL;
+    as.fixupCount = 0;
+    as.fixupCapacity = 0;
+
+    emitPush(&as, RBX);
+    emitPush(&as, R12);
+    emitPush(&as, R13);
+    emitMov(&as, RBX, RDI);
+    emitMovImm(&as, RAX, (uint64_t)(uintptr_t)&as.vm->stackTop);
+    emitLoad(&as, R12, RAX, 0);
+
+    JitLoopFn function = NULL;
+    bool supported = true;
+    for (int offset = start; offset < end && supported; offset++) {
+        as.labels[offset - start] = as.count;
+        supported = emitInstruction(&as, offset);
+    }
+
+    if (supported) {
+        // Shared epilogue; the exit stubs load the resume offset into eax.
+        int epilogue = as.count;
+        emitMovImm(&as, RCX, (uint64_t)(uintptr_t)&as.vm->stackTop);
+        emitStore(&as, RCX, 0, R12);
+        emitPop(&as, R13);
+        emitPop(&as, R12);
+        emitPop(&as, RBX);
+        emitByte(&as, 0xC3);
+
+        for (int i = 0; i < as.fixupCount; i++) {
+            Fixup* fixup = &as.fixups[i];
+            if (!fixup->exit && fixup->target >= start && fixup->target < end) {
+                patchJump(&as, fixup->at, as.labels[fixup->target - start]);
+                continue;
+            }
+            patchJump(&as, fixup->at, as.count);
+            emitByte(&as, 0xB8);
+            emitInt32(&as, fixup->target);
+            patchJump(&as, emitJump(&as, JMP), epilogue);
+        }
+        function = install(jit, &as);
+    }
+
+    FREE_ARRAY(as.vm, uint8_t, as.bytes, as.capacity);
+    FREE_ARRAY(as.vm, int, as.labels, end - start);
+    FREE_ARRAY(as.vm, Fixup, as.fixups, as.fixupCapacity);
+    return function;
+}
+
+void initJit(SplVM* vm, Jit* jit, Chunk* chunk, DecodedChunk* decoded) {
+    jit->vm = vm;
+    jit->chunk = chunk;
+    jit->decoded = decoded;
+    jit->instructionCount = decoded != NULL ? decoded->count : 0;
+    jit->backEdges = NULL;
+    jit->loops = NULL;
+    jit->pageCount = 0;
+    jit->pageCapacity = 0;
+    jit->pages = NULL;
+}
+
+void freeJit(Jit* jit) {
+    for (int i = 0; i < jit->pageCount; i++) {
+        munmap(jit->pages[i].memory, jit->pages[i].size);
+    }
+    FREE_ARRAY(jit->vm, JitPage, jit->pages, jit->pageCapacity);
+    if (jit->backEdges != NULL) {
+        FREE_ARRAY(jit->vm, int, jit->backEdges, jit->instructionCount);
+        FREE_ARRAY(jit->vm, JitLoopFn, jit->loops, jit->instructionCount);
+    }
+    // The chunk may be gone already, e.g. after running out of memory.
+    initJit(jit->vm, jit, NULL, NULL);
+}
+
+int jitLoop(Jit* jit, int start, int end) {
+    if (jit->backEdges == NULL) {
+        jit->backEdges = ALLOCATE(jit->vm, int, jit->instructionCount);
+        jit->loops = ALLOCATE(jit->vm, JitLoopFn, jit->instructionCount);
+        for (int i = 0; i < jit->instructionCount; i++) {
+            jit->backEdges[i] = 0;
+            jit->loops[i] = NULL;
+        }
+    }
+
+    if (jit->loops[start] == NULL) {
+        if (jit->backEdges[start] < 0 || ++jit->backEdges[start] < JIT_HOT_LOOP) {
+            return -1;
+        }
+        jit->loops[start] = compileLoop(jit, start, end);
+        if (jit->loops[start] == NULL) {
+            jit->backEdges[start] = -1;
+            return -1;
+        }
+    }
+    return jit->loops[start](jit->vm->stack);
+}
+
+#endif
@@ -0,0 +1,45 @@
+#ifndef SPL_JIT_H
+#define SPL_JIT_H
+
+#include "spl_common.h"
+#include "spl_chunk.h"
+#include "spl_value.h"
+
+#ifdef SPL_JIT
+
+// Native code for one loop region. It is entered at the loop start with
+// the slots base as its argument and returns the instruction index where
+// run() has to continue.
+typedef int (*JitLoopFn)(Value* slots);
+
+typedef struct {
+    void* memory;
+    size_t size;
+} JitPage;
+
+typedef struct {
+    SplVM* vm;
+    Chunk* chunk;
+    DecodedChunk* decoded;
+    int instructionCount;
+    // Indexed by the instruction index of a loop start. backEdges counts
+    // taken OP_LOOPs until the loop is hot; it is -1 once compiling
+    // failed.
+    int* backEdges;
+    JitLoopFn* loops;
+    int pageCount;
+    int pageCapacity;
+    JitPage* pages;
+} Jit;
+
+void initJit(SplVM* vm, Jit* jit, Chunk* chunk, DecodedChunk* decoded);
+void freeJit(Jit* jit);
+// Called for the OP_LOOP just before instruction 'end' that jumps back
+// to instruction 'start'. Returns the instruction to resume interpreting
+// at after running the compiled loop, or -1 if the loop is not (yet)
+// compiled.
+int jitLoop(Jit* jit, int start, int end);
+
+#endif
+
+#endif
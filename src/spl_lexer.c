@@ -1,91 +1,81 @@
 #include "spl_lexer.h"
 
-typedef struct
-{
-    const char *file_start;
-    const char *start;
-    const char *current;
-    int line;
-} spl_lexer;
-
-spl_lexer lexer;
-
 //--------------------------------------
 // Private Functions
 
-static bool is_end()
+static bool is_end(spl_lexer *lexer)
 {
-    return *lexer.current == '\0';
+    return *lexer->current == '\0';
 }
 
-static void next()
+static void next(spl_lexer *lexer)
 {
-    lexer.current++;
+    lexer->current++;
 }
 
-static char advance()
+static char advance(spl_lexer *lexer)
 {
-    lexer.current++;
-    return *(lexer.current - 1);
+    lexer->current++;
+    return *(lexer->current - 1);
 }
 
-static char current()
+static char current(spl_lexer *lexer)
 {
-    return *lexer.current;
+    return *lexer->current;
 }
 
-static char peek()
+static char peek(spl_lexer *lexer)
 {
-    if (*lexer.current != '\0')
+    if (*lexer->current != '\0')
     {
-        return *(lexer.current + 1);
+        return *(lexer->current + 1);
     }
     return '\0';
 }
 
-static bool match(char expected)
+static bool match(spl_lexer *lexer, char expected)
 {
-    if (is_end())
+    if (is_end(lexer))
         return false;
-    if (*lexer.current != expected)
+    if (*lexer->current != expected)
         return false;
-    lexer.current++;
+    lexer->current++;
     return true;
 }
 
-static void skip_whitespaces_and_comments()
+static void skip_whitespaces_and_comments(spl_lexer *lexer)
 {
     for (;;)
     {
-        switch (current())
+        switch (current(lexer))
         {
         case ' ':
         case '\r':
         case '\t':
-            next();
+            next(lexer);
             break;
         case '\n':
-            lexer.line++;
-            next();
+            lexer->line++;
+            next(lexer);
             break;
         case '/':
-            if (peek() == '/')
+            if (peek(lexer) == '/')
             {
-                while (peek() != '\n' && !is_end())
-                    next();
-                next();
+                while (peek(lexer) != '\n' && !is_end(lexer))
+                    next(lexer);
+                next(lexer);
                 break;
             }
-            else if (peek() == '*')
+            else if (peek(lexer) == '*')
             {
-                while (!(current() == '*' && peek() == '/') && !is_end())
+                while (!(current(lexer) == '*' && peek(lexer) == '/') && !is_end(lexer))
                 {
-                    if (current() == '\n')
-                        lexer.line++;
-                    next();
+                    if (current(lexer) == '\n')
+                        lexer->line++;
+                    next(lexer);
                 }
-                next(); // current = '/'
-                next(); // current = Next Char
+                next(lexer); // current = '/'
+                next(lexer); // current = Next Char
                 break;
             }
             else
@@ -110,19 +100,19 @@ static bool is_digit(char c)
     return c >= '0' && c <= '9';
 }
 
-static spl_token create_token(spl_token_type type)
+static spl_token create_token(spl_lexer *lexer, spl_token_type type)
 {
     spl_token token;
     token.type = type;
-    token.start = lexer.start;
-    token.length = (int)(lexer.current - lexer.start);
-    token.line = lexer.line;
+    token.start = lexer->start;
+    token.length = (int)(lexer->current - lexer->start);
+    token.line = lexer->line;
     return token;
 }
 
-static spl_token_type check_keyword(int start, int length, const char *rest, spl_token_type type)
+static spl_token_type check_keyword(spl_lexer *lexer, int start, int length, const char *rest, spl_token_type type)
 {
-    if (lexer.current - lexer.start == start + length && memcmp(lexer.start + start, rest, length) == 0)
+    if (lexer->current - lexer->start == start + length && memcmp(lexer->start + start, rest, length) == 0)
     {
         return type;
     }
@@ -131,196 +121,196 @@ static spl_token_type check_keyword(int start, int length, const char *rest, spl
 }
 
 
-static spl_token_type identifierType()
+static spl_token_type identifierType(spl_lexer *lexer)
 {
-    switch (lexer.start[0])
+    switch (lexer->start[0])
     {
     case 'e':
-        return check_keyword(1, 3, "lse", TK_ELSE);
+        return check_keyword(lexer, 1, 3, "lse", TK_ELSE);
     case 'i':
-        return check_keyword(1, 1, "f", TK_IF);
+        return check_keyword(lexer, 1, 1, "f", TK_IF);
     case 'n':
-        return check_keyword(1, 3, "ull", TK_NULL);
+        return check_keyword(lexer, 1, 3, "ull", TK_NULL);
     case 't':
-        return check_keyword(1, 3, "rue", TK_TRUE);
+        return check_keyword(lexer, 1, 3, "rue", TK_TRUE);
     case 'f':
-        return check_keyword(2, 4, "alse", TK_FALSE);
+        return check_keyword(lexer, 2, 4, "alse", TK_FALSE);
     case 'p':
-        return check_keyword(1, 4, "rint", TK_PRINT);
+        return check_keyword(lexer, 1, 4, "rint", TK_PRINT);
     case 'v':
-        return check_keyword(1, 2, "ar", TK_VAR);
+        return check_keyword(lexer, 1, 2, "ar", TK_VAR);
     case 'w':
-        return check_keyword(1, 4, "hile", TK_WHILE);
+        return check_keyword(lexer, 1, 4, "hile", TK_WHILE);
     }
 
     return TK_IDENTIFIER;
 }
 
-static spl_token identifier()
+static spl_token identifier(spl_lexer *lexer)
 {
-    while (is_alpha(current()) || is_digit(current()))
-        advance();
+    while (is_alpha(current(lexer)) || is_digit(current(lexer)))
+        advance(lexer);
 
-    return create_token(identifierType());
+    return create_token(lexer, identifierType(lexer));
 }
 
-static spl_token floatDot()
+static spl_token floatDot(spl_lexer *lexer)
 {
-    while (is_digit(peek()) && !is_end())
+    while (is_digit(peek(lexer)) && !is_end(lexer))
     {
-        advance();
+        advance(lexer);
     }
-    if (peek() == 'f')
+    if (peek(lexer) == 'f')
     {
-        advance();
+        advance(lexer);
     }
-    advance();
-    return create_token(TK_NUMBER_VAL);
+    advance(lexer);
+    return create_token(lexer, TK_NUMBER_VAL);
 }
 
 // [0-9][.[0-9]+]?f?
-static spl_token number()
+static spl_token number(spl_lexer *lexer)
 {
-    while (is_digit(current()) && !is_end())
+    while (is_digit(current(lexer)) && !is_end(lexer))
     {
-        advance();
+        advance(lexer);
     }
-    if (current() == '.')
+    if (current(lexer) == '.')
     {
-        advance();
-        while (is_digit(current()) && !is_end())
+        advance(lexer);
+        while (is_digit(current(lexer)) && !is_end(lexer))
         {
-            advance();
+            advance(lexer);
         }
-        if (current() == 'f')
+        if (current(lexer) == 'f')
         {
-            advance();
+            advance(lexer);
         }
-        return create_token(TK_NUMBER_VAL);
+        return create_token(lexer, TK_NUMBER_VAL);
     }
-    if (current() == 'f')
+    if (current(lexer) == 'f')
     {
-        advance();
-        return create_token(TK_NUMBER_VAL);
+        advance(lexer);
+        return create_token(lexer, TK_NUMBER_VAL);
     }
-    return create_token(TK_NUMBER_VAL);
+    return create_token(lexer, TK_NUMBER_VAL);
 }
 
-static spl_token string()
+static spl_token string(spl_lexer *lexer)
 {
-    while (peek() != '"' && !is_end())
+    while (peek(lexer) != '"' && !is_end(lexer))
     {
-        if (peek() == '\n')
-            lexer.line++;
-        advance();
+        if (peek(lexer) == '\n')
+            lexer->line++;
+        advance(lexer);
     }
     // if (is_end()) // TODO return errorToken;
     //     printf("unterminated String\n");
-    advance(); // current = "
-    advance(); // current = new Char
-    return create_token(TK_STRING_VAL);
+    advance(lexer); // current = "
+    advance(lexer); // current = new Char
+    return create_token(lexer, TK_STRING_VAL);
 }
 
 //--------------------------------------
 // Public Functions
-void spl_lex_init(const char *source)
+void spl_lex_init(spl_lexer *lexer, const char *source)
 {
-    lexer.file_start = source;
-    lexer.start = source;
-    lexer.current = source;
-    lexer.line = 1;
+    lexer->file_start = source;
+    lexer->start = source;
+    lexer->current = source;
+    lexer->line = 1;
 }
 
-void spl_lex_free()
+void spl_lex_free(spl_lexer *lexer)
 {
-    lexer.file_start = NULL;
-    lexer.start = NULL;
-    lexer.current = NULL;
-    lexer.line = 1;
+    lexer->file_start = NULL;
+    lexer->start = NULL;
+    lexer->current = NULL;
+    lexer->line = 1;
 }
 
-spl_token next_token()
+spl_token next_token(spl_lexer *lexer)
 {
-    skip_whitespaces_and_comments();
-    lexer.start = lexer.current;
-    if (is_end())
-        return create_token(TK_EOF);
-    char c = advance();
+    skip_whitespaces_and_comments(lexer);
+    lexer->start = lexer->current;
+    if (is_end(lexer))
+        return create_token(lexer, TK_EOF);
+    char c = advance(lexer);
     if (is_alpha(c))
-        return identifier();
+        return identifier(lexer);
     if (is_digit(c))
-        return number();
+        return number(lexer);
     switch (c)
     {
     // single character tokens
     case '(':
-        return create_token(TK_LEFT_PAREN);
+        return create_token(lexer, TK_LEFT_PAREN);
     case ')':
-        return create_token(TK_RIGHT_PAREN);
+        return create_token(lexer, TK_RIGHT_PAREN);
     case '{':
-        return create_token(TK_LEFT_BRACE);
+        return create_token(lexer, TK_LEFT_BRACE);
     case '}':
-        return create_token(TK_RIGHT_BRACE);
+        return create_token(lexer, TK_RIGHT_BRACE);
     case '[':
-        return create_token(TK_LEFT_BRACKET);
+        return create_token(lexer, TK_LEFT_BRACKET);
     case ']':
-        return create_token(TK_RIGHT_BRACKET);
+        return create_token(lexer, TK_RIGHT_BRACKET);
     case '.':
-        return is_digit(current()) ? floatDot() : create_token(TK_DOT);
+        return is_digit(current(lexer)) ? floatDot(lexer) : create_token(lexer, TK_DOT);
     case ';':
-        return create_token(TK_SEMICOLON);
+        return create_token(lexer, TK_SEMICOLON);
     case '!':
-        return create_token(TK_BANG);
+        return create_token(lexer, TK_BANG);
     // single or double character tokens
     case '-':
-        return create_token(TK_MINUS);
+        return create_token(lexer, TK_MINUS);
     
     case '+':
-        return create_token(TK_PLUS);
+        return create_token(lexer, TK_PLUS);
     
     case '/':
-        return create_token(TK_SLASH);
+        return create_token(lexer, TK_SLASH);
     case '*':
-        return create_token(TK_STAR);
+        return create_token(lexer, TK_STAR);
     case '&':
-        return create_token(TK_AND);
+        return create_token(lexer, TK_AND);
     case '|':
-        return create_token(TK_OR);
+        return create_token(lexer, TK_OR);
     case '=':
     {
-        switch (current())
+        switch (current(lexer))
         {
         case '=':
-            next();
-            return create_token(TK_EQUAL_EQUAL);
+            next(lexer);
+            return create_token(lexer, TK_EQUAL_EQUAL);
         default:
-            return create_token(TK_EQUAL);
+            return create_token(lexer, TK_EQUAL);
         }
     }
     case '>':
     {
-        switch (current())
+        switch (current(lexer))
         {
         case '=':
-            next();
-            return create_token(TK_GREATER_EQUAL);
+            next(lexer);
+            return create_token(lexer, TK_GREATER_EQUAL);
         default:
-            return create_token(TK_GREATER);
+            return create_token(lexer, TK_GREATER);
         }
     }
     case '<':
     {
-        switch (current())
+        switch (current(lexer))
         {
         case '=':
-            next();
-            return create_token(TK_LESS_EQUAL);
+            next(lexer);
+            return create_token(lexer, TK_LESS_EQUAL);
         default:
-            return create_token(TK_LESS);
+            return create_token(lexer, TK_LESS);
         }
     }
     case '"':
-        return string();
+        return string(lexer);
     }
-    return create_token(TK_ERROR);
+    return create_token(lexer, TK_ERROR);
 }
\ No newline at end of file
@@ -55,8 +55,16 @@ typedef struct {
 } spl_token;
 
 
-void spl_lex_init(const char* source);
-void spl_lex_free();
-spl_token next_token(void);
+typedef struct
+{
+    const char *file_start;
+    const char *start;
+    const char *current;
+    int line;
+} spl_lexer;
+
+void spl_lex_init(spl_lexer *lexer, const char *source);
+void spl_lex_free(spl_lexer *lexer);
+spl_token next_token(spl_lexer *lexer);
 
 #endif
@@ -8,13 +8,13 @@ void initLineArray(LineArray* array) {
     array->count = 0;
 }
 
-void writeLineArray(LineArray* array, int value) {
+void writeLineArray(SplVM* vm, LineArray* array, int value) {
     // storage length = 2
     // [count, line, count, line, count, line,....]
     if(array->capacity < array->count + STORAGE_LENGTH) {
         int oldCapacity = array->capacity;
         array->capacity = oldCapacity + STORAGE_LENGTH;
-        array->values = GROW_ARRAY(int, array->values,
+        array->values = GROW_ARRAY(vm, int, array->values,
                              oldCapacity, array->capacity);
     }
     if (array->count >= STORAGE_LENGTH && 
@@ -28,11 +28,24 @@ void writeLineArray(LineArray* array, int value) {
    
 }
 
-void freeLineArray(LineArray* array) {
-    FREE_ARRAY(int, array->values, array->capacity);
+void freeLineArray(SplVM* vm, LineArray* array) {
+    FREE_ARRAY(vm, int, array->values, array->capacity);
     initLineArray(array);
 }
 
+// Forgets the lines of the last 'count' bytes.
+void truncateLineArray(LineArray* array, int count) {
+    while (count > 0 && array->count > 0) {
+        int* run = &array->values[array->count - STORAGE_LENGTH];
+        if (run[0] > count) {
+            run[0] -= count;
+            return;
+        }
+        count -= run[0];
+        array->count -= STORAGE_LENGTH;
+    }
+}
+
 int getLine(LineArray * array, int index) {
     int c = 0;
     for (int i = 0; i < array->count; i++) {
@@ -45,4 +58,21 @@ int getLine(LineArray * array, int index) {
         }
     }
     return -1;
-}
\ No newline at end of file
+}
+
+void initLineCursor(LineCursor* cursor, LineArray* array) {
+    cursor->array = array;
+    cursor->run = 0;
+    cursor->end = array->count > 0 ? array->values[0] : 0;
+}
+
+// Like getLine(), for an 'index' no smaller than the last one asked for.
+int cursorLine(LineCursor* cursor, int index) {
+    LineArray* array = cursor->array;
+    while (index >= cursor->end && cursor->run + STORAGE_LENGTH < array->count) {
+        cursor->run += STORAGE_LENGTH;
+        cursor->end += array->values[cursor->run];
+    }
+    if (index >= cursor->end) return -1;
+    return array->values[cursor->run + 1];
+}
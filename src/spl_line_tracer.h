@@ -11,9 +11,21 @@ typedef struct {
     int* values;
 } LineArray;
 
+// Looks up the lines of offsets in increasing order, walking the runs
+// once instead of scanning them from the start for every offset.
+typedef struct {
+    LineArray* array;
+    // Index of the current run in values, and the first offset past it.
+    int run;
+    int end;
+} LineCursor;
+
 void initLineArray(LineArray* array);
-void writeLineArray(LineArray* array, int value);
-void freeLineArray(LineArray* array);
+void writeLineArray(SplVM* vm, LineArray* array, int value);
+void freeLineArray(SplVM* vm, LineArray* array);
+void truncateLineArray(LineArray* array, int count);
 int getLine(LineArray* array, int index);
+void initLineCursor(LineCursor* cursor, LineArray* array);
+int cursorLine(LineCursor* cursor, int index);
 
 #endif
\ No newline at end of file
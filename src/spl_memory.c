@@ -1,36 +1,817 @@
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
 #include "spl_memory.h"
 #include "spl_vm.h"
 
-void* reallocate(void * pointer, size_t oldSize, size_t newSize) {
+
+#define GC_HEAP_GROW_FACTOR 2
+// Work units between two looks at the clock during a step.
+#define GC_CLOCK_STRIDE 64
+
+static uint64_t nowNanos() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+}
+
+static void recordPause(SplVM* vm, uint64_t nanos) {
+    GcPauseHistogram* histogram = &vm->gcPauses;
+    int bucket = 0;
+    uint64_t micros = nanos / 1000;
+    while (micros > 0 && bucket < GC_PAUSE_BUCKETS - 1) {
+        micros >>= 1;
+        bucket++;
+    }
+    histogram->buckets[bucket]++;
+    histogram->count++;
+    histogram->totalNanos += nanos;
+    if (nanos > histogram->maxNanos) histogram->maxNanos = nanos;
+}
+
+double gcPausePercentile(const GcPauseHistogram* histogram, double percentile) {
+    if (histogram->count == 0) return 0;
+    double wanted = histogram->count * percentile / 100.0;
+    uint64_t seen = 0;
+    for (int i = 0; i < GC_PAUSE_BUCKETS; i++) {
+        seen += histogram->buckets[i];
+        if (seen >= wanted) return (double)((uint64_t)1 << i);
+    }
+    return (double)((uint64_t)1 << (GC_PAUSE_BUCKETS - 1));
+}
+
+#ifdef SPL_POOL
+
+#define POOL_CLASS(size) (((size) + POOL_GRANULE - 1) / POOL_GRANULE - 1)
+// Keeps the blocks after the slab header aligned like malloc's.
+#define POOL_SLAB_HEADER POOL_GRANULE
+
+void initPool(Pool* pool) {
+    for (int i = 0; i < POOL_CLASSES; i++) {
+        pool->freeLists[i] = NULL;
+    }
+    pool->slabs = NULL;
+}
+
+void freePool(Pool* pool) {
+    PoolSlab* slab = pool->slabs;
+    while (slab != NULL) {
+        PoolSlab* next = slab->next;
+        free(slab);
+        slab = next;
+    }
+    initPool(pool);
+}
+
+#endif
+
+#define ARENA_ALIGNMENT 16
+#define ARENA_ROUND(size) \
+        (((size) + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1))
+
+void initArena(SplVM* vm, size_t limit) {
+    vm->arena = (uint8_t*)malloc(limit);
+    if (vm->arena == NULL) exit(1);
+    vm->arenaLimit = limit;
+    vm->arenaTop = 0;
+    vm->arenaFree = NULL;
+}
+
+static void outOfMemory(SplVM* vm) {
+    vm->outOfMemory = true;
+    fprintf(stderr, "Out of memory: the script exceeded its limit of %zu bytes.\n",
+            vm->arenaLimit);
+    if (vm->errorJump == NULL) exit(1);
+    longjmp(*vm->errorJump, 1);
+}
+
+static void* arenaAllocate(SplVM* vm, size_t size) {
+    size = ARENA_ROUND(size);
+    for (ArenaBlock** link = &vm->arenaFree; *link != NULL; link = &(*link)->next) {
+        ArenaBlock* block = *link;
+        if (block->size < size) continue;
+        if (block->size - size >= sizeof(ArenaBlock)) {
+            // Leave the tail on the list.
+            ArenaBlock* rest = (ArenaBlock*)((uint8_t*)block + size);
+            rest->next = block->next;
+            rest->size = block->size - size;
+            *link = rest;
+        } else {
+            *link = block->next;
+        }
+        return block;
+    }
+
+    if (size > vm->arenaLimit - vm->arenaTop) return NULL;
+    void* result = vm->arena + vm->arenaTop;
+    vm->arenaTop += size;
+    return result;
+}
+
+static bool isLastInArena(SplVM* vm, void* pointer, size_t size) {
+    return (uint8_t*)pointer + ARENA_ROUND(size) == vm->arena + vm->arenaTop;
+}
+
+#define ARENA_BLOCK_END(block) ((uint8_t*)(block) + (block)->size)
+
+// The free list is kept in address order so that neighbours merge;
+// otherwise a string that keeps growing would never fit into the space
+// its predecessors left behind.
+static void arenaFree(SplVM* vm, void* pointer, size_t size) {
+    ArenaBlock* block = (ArenaBlock*)pointer;
+    block->size = ARENA_ROUND(size);
+    ArenaBlock** link = &vm->arenaFree;
+    ArenaBlock** previousLink = NULL;
+    while (*link != NULL && *link < block) {
+        previousLink = link;
+        link = &(*link)->next;
+    }
+
+    ArenaBlock* next = *link;
+    if (next != NULL && ARENA_BLOCK_END(block) == (uint8_t*)next) {
+        block->size += next->size;
+        next = next->next;
+    }
+    block->next = next;
+    *link = block;
+    if (previousLink != NULL && ARENA_BLOCK_END(*previousLink) == (uint8_t*)block) {
+        ArenaBlock* previous = *previousLink;
+        previous->size += block->size;
+        previous->next = block->next;
+        block = previous;
+        link = previousLink;
+    }
+
+    // Free space at the end goes back to the bump pointer.
+    if (ARENA_BLOCK_END(block) == vm->arena + vm->arenaTop) {
+        vm->arenaTop = (uint8_t*)block - vm->arena;
+        *link = NULL;
+    }
+}
+
+#ifdef SPL_POOL
+
+// In arena mode the slabs of all size classes together take at most a
+// quarter of the arena, so a small one is not used up by the pools.
+static size_t poolSlabSize(SplVM* vm) {
+    if (vm->arena == NULL) return POOL_SLAB_SIZE;
+    size_t size = ARENA_ROUND(vm->arenaLimit / (4 * POOL_CLASSES));
+    if (size > POOL_SLAB_SIZE) return POOL_SLAB_SIZE;
+    if (size < POOL_SLAB_HEADER + POOL_MAX_BLOCK) return POOL_SLAB_HEADER + POOL_MAX_BLOCK;
+    return size;
+}
+
+static bool refillPool(SplVM* vm, int sizeClass) {
+    Pool* pool = &vm->pool;
+    size_t slabSize = poolSlabSize(vm);
+    PoolSlab* slab;
+    if (vm->arena != NULL) {
+        // Goes away with the arena; not tracked for freePool().
+        slab = (PoolSlab*)arenaAllocate(vm, slabSize);
+        if (slab == NULL) return false;
+    } else {
+        slab = (PoolSlab*)malloc(slabSize);
+        if (slab == NULL) exit(1);
+        slab->next = pool->slabs;
+        pool->slabs = slab;
+    }
+
+    size_t blockSize = (size_t)(sizeClass + 1) * POOL_GRANULE;
+    uint8_t* block = (uint8_t*)slab + POOL_SLAB_HEADER;
+    uint8_t* end = (uint8_t*)slab + slabSize;
+    // Thread the blocks in address order so consecutive allocations
+    // are adjacent.
+    PoolBlock** link = &pool->freeLists[sizeClass];
+    for (; block + blockSize <= end; block += blockSize) {
+        *link = (PoolBlock*)block;
+        link = &((PoolBlock*)block)->next;
+    }
+    *link = NULL;
+    return true;
+}
+
+#endif
+
+// The allocation primitives below reallocate(). They never collect, and
+// return NULL only when the arena is exhausted. Small blocks come from
+// the pools, large ones from the arena in arena mode and from malloc
+// otherwise.
+static void* allocateBlock(SplVM* vm, size_t size) {
+#ifdef SPL_POOL
+    if (size <= POOL_MAX_BLOCK) {
+        int sizeClass = POOL_CLASS(size);
+        if (vm->pool.freeLists[sizeClass] == NULL && !refillPool(vm, sizeClass)) {
+            return NULL;
+        }
+        PoolBlock* block = vm->pool.freeLists[sizeClass];
+        vm->pool.freeLists[sizeClass] = block->next;
+        return block;
+    }
+#endif
+    if (vm->arena != NULL) return arenaAllocate(vm, size);
+    void* result = malloc(size);
+    if (result == NULL) exit(1);
+    return result;
+}
+
+static void freeBlock(SplVM* vm, void* pointer, size_t size) {
+    if (pointer == NULL) return;
+#ifdef SPL_POOL
+    if (size <= POOL_MAX_BLOCK) {
+        PoolBlock* block = (PoolBlock*)pointer;
+        int sizeClass = POOL_CLASS(size);
+        block->next = vm->pool.freeLists[sizeClass];
+        vm->pool.freeLists[sizeClass] = block;
+        return;
+    }
+#endif
+    if (vm->arena != NULL) {
+        arenaFree(vm, pointer, size);
+        return;
+    }
+    free(pointer);
+}
+
+static void* resizeBlock(SplVM* vm, void* pointer, size_t oldSize, size_t newSize) {
+    if (pointer == NULL) return allocateBlock(vm, newSize);
+#ifdef SPL_POOL
+    if (oldSize <= POOL_MAX_BLOCK && newSize <= POOL_MAX_BLOCK &&
+            POOL_CLASS(oldSize) == POOL_CLASS(newSize)) {
+        return pointer;
+    }
+    bool moves = oldSize <= POOL_MAX_BLOCK || newSize <= POOL_MAX_BLOCK;
+#else
+    bool moves = false;
+#endif
+    if (vm->arena != NULL && !moves && isLastInArena(vm, pointer, oldSize) &&
+            ARENA_ROUND(newSize) <= vm->arenaLimit - ((uint8_t*)pointer - vm->arena)) {
+        // The last block grows or shrinks in place.
+        vm->arenaTop = (uint8_t*)pointer - vm->arena + ARENA_ROUND(newSize);
+        return pointer;
+    }
+    if (vm->arena != NULL || moves) {
+        void* result = allocateBlock(vm, newSize);
+        if (result == NULL) return NULL;
+        memcpy(result, pointer, oldSize < newSize ? oldSize : newSize);
+        freeBlock(vm, pointer, oldSize);
+        return result;
+    }
+    void* result = realloc(pointer, newSize);
+    if (result == NULL) exit(1);
+    return result;
+}
+
+static void countAllocation(SplVM* vm, size_t size) {
+    MemStats* stats = &vm->memStats;
+    if (vm->bytesAllocated > stats->peakBytes) stats->peakBytes = vm->bytesAllocated;
+    stats->allocations++;
+    int bucket = 0;
+    while (bucket < MEM_SIZE_BUCKETS - 1 && size > ((size_t)16 << bucket)) bucket++;
+    stats->sizeBuckets[bucket]++;
+}
+
+static bool gcStep(SplVM* vm, bool finish);
+
+#ifndef DEBUG_STRESS_GC
+// Whether it is time to start a cycle. An arena cannot grow, so in
+// arena mode collecting starts well before it is full.
+static bool heapFull(SplVM* vm) {
+    return vm->bytesAllocated > vm->nextGC ||
+            (vm->arena != NULL && vm->bytesAllocated > vm->arenaLimit / 2);
+}
+#endif
+
+void* reallocate(SplVM* vm, void * pointer, size_t oldSize, size_t newSize) {
+    vm->bytesAllocated += newSize - oldSize;
+    if (newSize == 0) {
+        vm->memStats.frees++;
+    } else {
+        countAllocation(vm, newSize);
+    }
+    if (newSize > oldSize) {
+#ifdef DEBUG_STRESS_GC
+        collectGarbage(vm);
+#else
+        if (vm->gcPhase != GC_IDLE) {
+            if (++vm->gcAllocations >= vm->gcStepInterval) {
+                vm->gcAllocations = 0;
+                gcStep(vm, false);
+            }
+        } else if (heapFull(vm)) {
+            gcStep(vm, false);
+        }
+#endif
+    }
+
     if (newSize == 0) {
-        free(pointer);
+        freeBlock(vm, pointer, oldSize);
         return NULL;
     }
-    void * result = realloc(pointer, newSize);
-    if(result == NULL) exit(1);
+    void* result = resizeBlock(vm, pointer, oldSize, newSize);
+    if (result == NULL) {
+        // The arena is full. A full collection may free enough of it.
+        collectGarbage(vm);
+        result = resizeBlock(vm, pointer, oldSize, newSize);
+        if (result == NULL) outOfMemory(vm);
+    }
     return result;
 }
 
-static void freeObject(Obj* object) {
+#define IS_MARKED(vm, object) ((object)->isMarked == (vm)->gcMarkBit)
+
+// The gray stack is plain malloc memory so that growing it cannot
+// start a collection of its own.
+static void pushGray(SplVM* vm, Obj* object) {
+    if (vm->grayCapacity < vm->grayCount + 1) {
+        vm->grayCapacity = GROW_CAPACITY(vm->grayCapacity);
+        vm->grayStack = (Obj**)realloc(vm->grayStack, sizeof(Obj*) * vm->grayCapacity);
+        if (vm->grayStack == NULL) exit(1);
+    }
+    vm->grayStack[vm->grayCount++] = object;
+}
+
+void markObject(SplVM* vm, Obj* object) {
+    if (object == NULL) return;
+    // Young strings belong to the minor collector. Young ropes are
+    // traced like old ones for the old objects they point to.
+    if (object->type == OBJ_STRING && IS_YOUNG(vm, object)) return;
+    if (IS_MARKED(vm, object)) return;
+#ifdef DEBUG_LOG_GC
+    printf("%p mark ", (void*)object);
+    printValue(OBJ_VAL(object));
+    printf("\n");
+#endif
+    object->isMarked = vm->gcMarkBit;
+    pushGray(vm, object);
+}
+
+void markValue(SplVM* vm, Value value) {
+    if (IS_OBJ(value)) markObject(vm, AS_OBJ(value));
+}
+
+void shadeObject(SplVM* vm, Obj* object) {
+    if (vm->gcPhase == GC_MARK) {
+        markObject(vm, object);
+    } else if (vm->gcPhase == GC_SWEEP_STRINGS) {
+        // Nothing is traced any more; marking it is enough to keep it
+        // in the table and out of the sweep.
+        object->isMarked = vm->gcMarkBit;
+    }
+}
+
+static void blackenObject(SplVM* vm, Obj* object) {
+#ifdef DEBUG_LOG_GC
+    printf("%p blacken ", (void*)object);
+    printValue(OBJ_VAL(object));
+    printf("\n");
+#endif
+    switch (object->type) {
+        // Strings hold no references.
+        case OBJ_STRING:
+            break;
+        case OBJ_ROPE: {
+            ObjRope* rope = (ObjRope*)object;
+            markObject(vm, rope->left);
+            markObject(vm, rope->right);
+            markObject(vm, (Obj*)rope->flat);
+            break;
+        }
+    }
+}
+
+static void freeObject(SplVM* vm, Obj* object) {
+#ifdef DEBUG_LOG_GC
+    printf("%p free type %d\n", (void*)object, object->type);
+#endif
 	switch(object->type) {
 	
 		case OBJ_STRING: {
 			ObjString* string = (ObjString*) object;
-			FREE_ARRAY(char, string->chars, string->length + 1);
-			FREE(ObjString, object);
+			reallocate(vm, object, STRING_SIZE(string->length), 0);
 			break;
 		}
+		case OBJ_ROPE:
+			FREE(vm, ObjRope, object);
+			break;
 	}
 }
 
-void freeObjects() {
-	Obj* object = vm.objects;
+// The value stack (which also holds the register translation's frame
+// and constants) is written without a barrier. It is small, so it is
+// rescanned whenever the gray stack runs empty.
+static void markStack(SplVM* vm) {
+    for (Value* slot = vm->stack; slot < vm->stackTop; slot++) {
+        markValue(vm, *slot);
+    }
+}
+
+// Marks the next value of 'array'. Starts over when the cursor was on
+// another array, such as the chunk the last one compiled. Returns false
+// once the whole array is marked.
+static bool markRootStep(SplVM* vm, RootCursor* cursor, ValueArray* array) {
+    if (cursor->array != array) {
+        cursor->array = array;
+        cursor->index = 0;
+    }
+    if (array == NULL || cursor->index >= array->count) return false;
+    markValue(vm, array->values[cursor->index++]);
+    return true;
+}
+
+static void startCycle(SplVM* vm) {
+    vm->memStats.cycles++;
+#ifdef DEBUG_LOG_GC
+    printf("-- gc begin\n");
+#endif
+    // Flipping the mark bit turns every object white at once; objects
+    // allocated from here on carry the new bit and so start out black.
+    vm->gcMarkBit = !vm->gcMarkBit;
+    vm->gcPhase = GC_MARK;
+    vm->gcAllocations = 0;
+    vm->gcGlobalNames.array = NULL;
+    vm->gcGlobalValues.array = NULL;
+    vm->gcConstants.array = NULL;
+    vm->gcCompilingConstants.array = NULL;
+    markStack(vm);
+}
+
+// Does one unit of marking. Returns false once marking is complete.
+static bool markStep(SplVM* vm) {
+    if (vm->grayCount == 0) {
+        // The globals and the constant pools are scanned a value per
+        // step; globalSlots only maps the same names to numbers.
+        if (markRootStep(vm, &vm->gcGlobalNames, &vm->globalNames) ||
+                markRootStep(vm, &vm->gcGlobalValues, &vm->globalValues) ||
+                markRootStep(vm, &vm->gcConstants,
+                             vm->chunk != NULL ? &vm->chunk->constants : NULL) ||
+                markRootStep(vm, &vm->gcCompilingConstants,
+                             vm->compilingChunk != NULL ? &vm->compilingChunk->constants : NULL)) {
+            return true;
+        }
+        markStack(vm);
+        if (vm->grayCount == 0) return false;
+    }
+    blackenObject(vm, vm->grayStack[--vm->grayCount]);
+    return true;
+}
+
+// Does one unit of dropping white strings from vm->strings. Returns false
+// once the table is clean.
+//
+// The walk covers the old arrays of a table that is growing before the
+// current ones, so an entry that an insert moves over in between is
+// seen at least once.
+static bool sweepStringsStep(SplVM* vm) {
+    Table* table = &vm->strings;
+    // Inserts may have grown the table or finished moving it since the
+    // last step; either changes the number of slots.
+    int slots = table->oldCapacity + table->capacity;
+    if (vm->gcSweepCapacity != slots) {
+        vm->gcSweepCapacity = slots;
+        vm->gcSweepIndex = 0;
+    }
+    if (vm->gcSweepIndex >= slots) return false;
+    int index = vm->gcSweepIndex++;
+    bool old = index < table->oldCapacity;
+    if (!old) index -= table->oldCapacity;
+    if (!CTRL_IS_FULL(old ? table->oldControl[index] : table->control[index])) return true;
+    ObjString* key = old ? table->oldEntries[index].key : table->entries[index].key;
+    if (!IS_MARKED(vm, &key->obj)) tableDelete(table, key);
+    return true;
+}
+
+// Frees one unreached object. Objects allocated during the cycle are
+// pushed in front of the cursor and never visited. Returns false at the
+// end of the list.
+static bool sweepStep(SplVM* vm) {
+    Obj* object = *vm->gcSweepCursor;
+    if (object == NULL) return false;
+    if (IS_MARKED(vm, object)) {
+        vm->gcSweepCursor = &object->next;
+    } else {
+        *vm->gcSweepCursor = object->next;
+        freeObject(vm, object);
+    }
+    return true;
+}
+
+static void finishCycle(SplVM* vm) {
+    vm->gcPhase = GC_IDLE;
+    vm->nextGC = vm->bytesAllocated * GC_HEAP_GROW_FACTOR;
+    if (vm->nextGC < GC_INITIAL_HEAP) vm->nextGC = GC_INITIAL_HEAP;
+#ifdef DEBUG_LOG_GC
+    printf("-- gc end\n");
+    printf("   %zu bytes in use, next at %zu\n", vm->bytesAllocated, vm->nextGC);
+#endif
+}
+
+// Advances the collector by up to vm->gcStepWork units of work, or
+// until vm->gcPauseLimit nanoseconds have passed, or to the end of the
+// cycle if 'finish' is set. Starts a cycle when idle. Returns true while
+// the cycle is still in progress.
+static bool gcStep(SplVM* vm, bool finish) {
+    uint64_t start = nowNanos();
+    if (vm->gcPhase == GC_IDLE) startCycle(vm);
+
+    for (int work = 1; ; work++) {
+        bool more;
+        switch (vm->gcPhase) {
+            case GC_MARK:
+                more = markStep(vm);
+                if (!more) {
+                    vm->gcPhase = GC_SWEEP_STRINGS;
+                    vm->gcSweepCapacity = vm->strings.oldCapacity + vm->strings.capacity;
+                    vm->gcSweepIndex = 0;
+                }
+                break;
+            case GC_SWEEP_STRINGS:
+                more = sweepStringsStep(vm);
+                if (!more) {
+                    vm->gcPhase = GC_SWEEP;
+                    vm->gcSweepCursor = &vm->objects;
+                }
+                break;
+            case GC_SWEEP:
+                more = sweepStep(vm);
+                if (!more) finishCycle(vm);
+                break;
+            default:
+                more = false;
+                break;
+        }
+        if (vm->gcPhase == GC_IDLE) break;
+        if (finish) continue;
+        if (work >= vm->gcStepWork) break;
+        if (work % GC_CLOCK_STRIDE == 0 && nowNanos() - start >= vm->gcPauseLimit) break;
+    }
+
+    recordPause(vm, nowNanos() - start);
+    return vm->gcPhase != GC_IDLE;
+}
+
+static size_t objectSize(Obj* object) {
+    switch (object->type) {
+        case OBJ_STRING: return STRING_SIZE(((ObjString*)object)->length);
+        case OBJ_ROPE: return sizeof(ObjRope);
+    }
+    return 0;
+}
+
+#define YOUNG_SIZE(object) ((objectSize(object) + 7) & ~(size_t)7)
+
+// Heap memory for promoted objects. Counted like any other allocation
+// but never starts a collection, since one is already running.
+static void* allocatePromoted(SplVM* vm, size_t size) {
+    vm->bytesAllocated += size;
+    countAllocation(vm, size);
+    vm->memStats.promotions++;
+    void* result = allocateBlock(vm, size);
+    if (result == NULL) outOfMemory(vm);
+    return result;
+}
+
+// Copies a young object to the heap the first time it is reached and
+// leaves a forwarding pointer in its 'next' field, which young objects
+// do not otherwise use. Promoted ropes go on the gray stack for
+// minorCollect() to forward their children.
+static Obj* promote(SplVM* vm, Obj* object) {
+    if (object->next != NULL) return object->next;
+
+    size_t size = objectSize(object);
+    Obj* copy = (Obj*)allocatePromoted(vm, size);
+    memcpy(copy, object, size);
+    if (object->type == OBJ_STRING) {
+        // Like any new object: black during a major cycle, white in the
+        // next. Young strings are never marked, so this is the only way
+        // one reached by the running cycle stays alive.
+        copy->isMarked = vm->gcMarkBit;
+    } else {
+        // Ropes keep their color; a black one has its children marked.
+        pushGray(vm, copy);
+    }
+    copy->next = vm->objects;
+    vm->objects = copy;
+
+    object->next = copy;
+    return copy;
+}
+
+static void forwardObject(SplVM* vm, Obj** slot) {
+    if (*slot != NULL && IS_YOUNG(vm, *slot)) *slot = promote(vm, *slot);
+}
+
+static void forwardValue(SplVM* vm, Value* slot) {
+    if (IS_OBJ(*slot) && IS_YOUNG(vm, AS_OBJ(*slot))) {
+        *slot = OBJ_VAL(promote(vm, AS_OBJ(*slot)));
+    }
+}
+
+// Only young ropes point to young objects: an old rope's children were
+// forwarded when it was promoted, and a flattened rope's string is
+// always old. So the roots, plus the gray stack during a major cycle,
+// are all a minor collection has to look at; of the globals, only the
+// slots in vm->youngGlobals. Young strings are never interned, so the weak intern table
+// needs no fixing up either.
+static void minorCollect(SplVM* vm) {
+    uint64_t start = nowNanos();
+    vm->memStats.minorCollections++;
+#ifdef DEBUG_LOG_GC
+    printf("-- minor gc: %zu nursery bytes\n", vm->nurseryTop);
+#endif
+    int grayCount = vm->grayCount;
+    for (int i = 0; i < grayCount; i++) {
+        // Promoting may grow the gray stack and move it.
+        Obj* object = vm->grayStack[i];
+        forwardObject(vm, &object);
+        vm->grayStack[i] = object;
+    }
+    for (Value* slot = vm->stack; slot < vm->stackTop; slot++) {
+        forwardValue(vm, slot);
+    }
+    // Global names and constants are interned strings or numbers, never
+    // young, and GLOBAL_BARRIER remembers the global slots that can be.
+    for (int i = 0; i < vm->youngGlobalCount; i++) {
+        int slot = vm->youngGlobals[i];
+        vm->rememberedGlobals[slot] = false;
+        forwardValue(vm, &vm->globalValues.values[slot]);
+    }
+    vm->youngGlobalCount = 0;
+    while (vm->grayCount > grayCount) {
+        ObjRope* rope = (ObjRope*)vm->grayStack[--vm->grayCount];
+        forwardObject(vm, &rope->left);
+        forwardObject(vm, &rope->right);
+    }
+
+    vm->nurseryTop = 0;
+    recordPause(vm, nowNanos() - start);
+}
+
+void rememberGlobal(SplVM* vm, int slot) {
+    if (vm->rememberedGlobals[slot]) return;
+    vm->rememberedGlobals[slot] = true;
+    vm->youngGlobals[vm->youngGlobalCount++] = slot;
+}
+
+void* allocateYoung(SplVM* vm, size_t size) {
+    if (size > NURSERY_MAX_OBJECT) return NULL;
+    // A small arena cannot spare the room; everything goes to the heap.
+    if (vm->arena != NULL && NURSERY_SIZE > vm->arenaLimit / 8) return NULL;
+    size = (size + 7) & ~(size_t)7;
+    if (vm->nursery == NULL) {
+        vm->nursery = ALLOCATE(vm, uint8_t, NURSERY_SIZE);
+        vm->nurseryTop = 0;
+    }
+#ifdef DEBUG_STRESS_GC
+    bool collect = true;
+#else
+    bool collect = vm->nurseryTop + size > NURSERY_SIZE;
+#endif
+    if (collect) {
+#ifndef DEBUG_STRESS_GC
+        // Promotion cannot collect when the arena runs out, so make room
+        // for the survivors first.
+        if (vm->arena != NULL && heapFull(vm)) collectGarbage(vm);
+#endif
+        minorCollect(vm);
+        // Promotion allocates without pacing the collector; catch up.
+#ifdef DEBUG_STRESS_GC
+        collectGarbage(vm);
+#else
+        if (vm->gcPhase != GC_IDLE || heapFull(vm)) gcStep(vm, false);
+#endif
+    }
+    void* result = vm->nursery + vm->nurseryTop;
+    vm->nurseryTop += size;
+    vm->memStats.youngAllocations++;
+    return result;
+}
+
+void collectGarbage(SplVM* vm) {
+    if (vm->gcPhase != GC_IDLE) gcStep(vm, true);
+    gcStep(vm, true);
+}
+
+void freeObjects(SplVM* vm) {
+	Obj* object = vm->objects;
 	while(object != NULL) {
 		Obj* next = object->next;
-		freeObject(object);
+		freeObject(vm, object);
 		object = next;
 	}
+	vm->objects = NULL;
+	FREE_ARRAY(vm, uint8_t, vm->nursery, NURSERY_SIZE);
+	vm->nursery = NULL;
+	vm->nurseryTop = 0;
+
+	free(vm->grayStack);
+	vm->grayStack = NULL;
+	vm->grayCount = 0;
+	vm->grayCapacity = 0;
+	vm->gcPhase = GC_IDLE;
+}
+
+static const char* objectTypeName(ObjType type) {
+    switch (type) {
+        case OBJ_STRING: return "string";
+        case OBJ_ROPE: return "rope";
+    }
+    return "unknown";
+}
+
+void getMemStats(SplVM* vm, MemStats* stats) {
+    *stats = vm->memStats;
+    stats->currentBytes = vm->bytesAllocated;
+    stats->nurseryBytes = vm->nurseryTop;
+    stats->arenaBytes = vm->arenaTop;
+    stats->arenaLimit = vm->arenaLimit;
+    stats->youngObjects = 0;
+    for (int i = 0; i < OBJ_TYPE_COUNT; i++) {
+        stats->liveObjects[i] = 0;
+        stats->liveObjectBytes[i] = 0;
+    }
+    for (Obj* object = vm->objects; object != NULL; object = object->next) {
+        stats->liveObjects[object->type]++;
+        stats->liveObjectBytes[object->type] += objectSize(object);
+    }
+    size_t offset = 0;
+    while (offset < vm->nurseryTop) {
+        Obj* object = (Obj*)(vm->nursery + offset);
+        stats->youngObjects++;
+        offset += YOUNG_SIZE(object);
+    }
+}
+
+void printMemStats(SplVM* vm, const MemStats* stats, FILE* out, bool json) {
+    const GcPauseHistogram* pauses = &vm->gcPauses;
+    double p50 = gcPausePercentile(pauses, 50);
+    double p99 = gcPausePercentile(pauses, 99);
+    double maxPause = pauses->maxNanos / 1000.0;
+
+    if (json) {
+        fprintf(out, "{\"currentBytes\":%zu,\"peakBytes\":%zu,"
+                "\"arenaBytes\":%zu,\"arenaLimit\":%zu,"
+                "\"allocations\":%llu,\"frees\":%llu,\"sizeBuckets\":{",
+                stats->currentBytes, stats->peakBytes,
+                stats->arenaBytes, stats->arenaLimit,
+                (unsigned long long)stats->allocations,
+                (unsigned long long)stats->frees);
+        for (int i = 0; i < MEM_SIZE_BUCKETS; i++) {
+            fprintf(out, "%s\"%s%zu\":%llu", i == 0 ? "" : ",",
+                    i == MEM_SIZE_BUCKETS - 1 ? ">" : "",
+                    (size_t)16 << (i == MEM_SIZE_BUCKETS - 1 ? i - 1 : i),
+                    (unsigned long long)stats->sizeBuckets[i]);
+        }
+        fprintf(out, "},\"objects\":{");
+        for (int i = 0; i < OBJ_TYPE_COUNT; i++) {
+            fprintf(out, "%s\"%s\":{\"count\":%llu,\"bytes\":%zu}", i == 0 ? "" : ",",
+                    objectTypeName((ObjType)i),
+                    (unsigned long long)stats->liveObjects[i], stats->liveObjectBytes[i]);
+        }
+        fprintf(out, "},\"nursery\":{\"objects\":%llu,\"bytes\":%zu,"
+                "\"allocations\":%llu,\"promotions\":%llu,\"collections\":%llu},",
+                (unsigned long long)stats->youngObjects, stats->nurseryBytes,
+                (unsigned long long)stats->youngAllocations,
+                (unsigned long long)stats->promotions,
+                (unsigned long long)stats->minorCollections);
+        fprintf(out, "\"gc\":{\"cycles\":%llu,\"pauses\":%llu,"
+                "\"p50Us\":%g,\"p99Us\":%g,\"maxUs\":%.1f}}\n",
+                (unsigned long long)stats->cycles, (unsigned long long)pauses->count,
+                p50, p99, maxPause);
+        return;
+    }
 
-}
\ No newline at end of file
+    fprintf(out, "heap:     %zu bytes in use, %zu at peak\n",
+            stats->currentBytes, stats->peakBytes);
+    if (stats->arenaLimit != 0) {
+        fprintf(out, "arena:    %zu of %zu bytes used\n",
+                stats->arenaBytes, stats->arenaLimit);
+    }
+    fprintf(out, "requests: %llu allocations, %llu frees\n",
+            (unsigned long long)stats->allocations, (unsigned long long)stats->frees);
+    for (int i = 0; i < MEM_SIZE_BUCKETS; i++) {
+        if (stats->sizeBuckets[i] == 0) continue;
+        if (i == MEM_SIZE_BUCKETS - 1) {
+            fprintf(out, "  > %7zu B: %llu\n", (size_t)16 << (i - 1),
+                    (unsigned long long)stats->sizeBuckets[i]);
+        } else {
+            fprintf(out, "  <= %6zu B: %llu\n", (size_t)16 << i,
+                    (unsigned long long)stats->sizeBuckets[i]);
+        }
+    }
+    for (int i = 0; i < OBJ_TYPE_COUNT; i++) {
+        fprintf(out, "objects:  %llu %s (%zu bytes)\n",
+                (unsigned long long)stats->liveObjects[i],
+                objectTypeName((ObjType)i), stats->liveObjectBytes[i]);
+    }
+    fprintf(out, "nursery:  %llu objects (%zu bytes), %llu allocated, "
+            "%llu promoted, %llu minor collections\n",
+            (unsigned long long)stats->youngObjects, stats->nurseryBytes,
+            (unsigned long long)stats->youngAllocations,
+            (unsigned long long)stats->promotions,
+            (unsigned long long)stats->minorCollections);
+    fprintf(out, "gc:       %llu cycles, %llu pauses, p50 <= %g us, "
+            "p99 <= %g us, max %.1f us\n",
+            (unsigned long long)stats->cycles, (unsigned long long)pauses->count,
+            p50, p99, maxPause);
+}
@@ -1,24 +1,174 @@
 #ifndef SPL_MEMORY_H
 #define SPL_MEMORY_H
 
+#include <stdio.h>
+
 #include "spl_common.h"
 #include "spl_object.h"
 
-#define ALLOCATE(type, count) \
-		(type*)reallocate(NULL,0 , sizeof(type) * (count))
+// Heap size that triggers the first collection.
+#define GC_INITIAL_HEAP (1024 * 1024)
+
+// Runtime strings are bump-allocated in a nursery of this size and
+// promoted to the heap if they survive a minor collection. Larger
+// strings go straight to the heap.
+#define NURSERY_SIZE (256 * 1024)
+#define NURSERY_MAX_OBJECT (NURSERY_SIZE / 8)
+
+#define IS_YOUNG(vm, object) \
+        ((uintptr_t)(object) - (uintptr_t)(vm)->nursery < NURSERY_SIZE)
 
-#define FREE(type, pointer) reallocate(pointer, sizeof(type), 0)
+#define ALLOCATE(vm, type, count) \
+		(type*)reallocate(vm, NULL, 0, sizeof(type) * (count))
+
+#define FREE(vm, type, pointer) reallocate(vm, pointer, sizeof(type), 0)
 
 #define GROW_CAPACITY(capacity) \
         ((capacity) < 8 ? 8 : (capacity) * 2)
 
-#define GROW_ARRAY(type, pointer, oldCount, newCount) \
-        (type *)reallocate(pointer, sizeof(type) * (oldCount), \
+#define GROW_ARRAY(vm, type, pointer, oldCount, newCount) \
+        (type *)reallocate(vm, pointer, sizeof(type) * (oldCount), \
             sizeof(type) * (newCount))
-#define FREE_ARRAY(type, pointer, oldCount) \
-        reallocate(pointer, sizeof(type) * (oldCount), 0)
+#define FREE_ARRAY(vm, type, pointer, oldCount) \
+        reallocate(vm, pointer, sizeof(type) * (oldCount), 0)
+
+#ifdef SPL_POOL
+
+// Blocks of up to POOL_MAX_BLOCK bytes are rounded up to a multiple of
+// POOL_GRANULE and taken from a free list per size class. Empty lists
+// are refilled by carving a POOL_SLAB_SIZE slab from malloc (a smaller
+// one from a small arena); slabs are only returned when the VM is freed.
+#define POOL_GRANULE 16
+#define POOL_MAX_BLOCK 256
+#define POOL_CLASSES (POOL_MAX_BLOCK / POOL_GRANULE)
+#define POOL_SLAB_SIZE (64 * 1024)
+
+typedef struct PoolBlock {
+    struct PoolBlock* next;
+} PoolBlock;
+
+typedef struct PoolSlab {
+    struct PoolSlab* next;
+} PoolSlab;
+
+typedef struct {
+    PoolBlock* freeLists[POOL_CLASSES];
+    PoolSlab* slabs;
+} Pool;
+
+void initPool(Pool* pool);
+void freePool(Pool* pool);
+
+#endif
+
+// In arena mode, blocks the pools do not serve are bumped off the arena.
+// Freed ones go on a first-fit list unless they are the last block,
+// which is simply given back to the bump pointer.
+typedef struct ArenaBlock {
+    struct ArenaBlock* next;
+    size_t size;
+} ArenaBlock;
+
+// The collector runs incrementally: a cycle marks the roots, then traces
+// and sweeps in small steps interleaved with the program.
+typedef enum {
+    GC_IDLE,
+    GC_MARK,
+    // Dropping unmarked strings from the weak vm->strings table.
+    GC_SWEEP_STRINGS,
+    GC_SWEEP,
+} GcPhase;
+
+// Where the mark phase has got to in a root array. The arrays behind
+// these cursors are only written through the barrier, so they can be
+// scanned a value at a time.
+typedef struct {
+    ValueArray* array;
+    int index;
+} RootCursor;
+
+// Pause times of the collector. Bucket i counts pauses shorter than
+// 2^i microseconds (and not shorter than 2^(i-1)); the last bucket also
+// takes everything longer.
+#define GC_PAUSE_BUCKETS 24
+
+typedef struct {
+    uint64_t buckets[GC_PAUSE_BUCKETS];
+    uint64_t count;
+    uint64_t totalNanos;
+    uint64_t maxNanos;
+} GcPauseHistogram;
+
+// Bucket i counts requests for at most 16 << i bytes; the last bucket
+// also takes everything larger.
+#define MEM_SIZE_BUCKETS 16
+
+typedef struct {
+    // Kept up to date by the allocator and the collector.
+    size_t peakBytes;
+    // reallocate() calls that returned memory (new blocks and resizes),
+    // and calls that freed it.
+    uint64_t allocations;
+    uint64_t frees;
+    uint64_t sizeBuckets[MEM_SIZE_BUCKETS];
+    uint64_t youngAllocations;
+    uint64_t promotions;
+    uint64_t minorCollections;
+    uint64_t cycles;
+
+    // Filled in by getMemStats().
+    size_t currentBytes;
+    size_t nurseryBytes;
+    // Zero unless the VM is in arena mode.
+    size_t arenaBytes;
+    size_t arenaLimit;
+    uint64_t youngObjects;
+    // Objects on the heap, including dead ones not yet swept.
+    uint64_t liveObjects[OBJ_TYPE_COUNT];
+    size_t liveObjectBytes[OBJ_TYPE_COUNT];
+} MemStats;
+
+// Dijkstra insertion barrier: a value stored into a heap slot or global
+// while marking must not stay white behind the collector's back. The
+// value stack needs none; it is rescanned before marking ends.
+#define WRITE_BARRIER(vm, value) \
+        do { if ((vm)->gcPhase == GC_MARK) markValue(vm, value); } while (false)
+
+// The write barrier for storing 'value' into global 'slot'. Also
+// remembers the slot if the value is young, so that minor collections
+// need not scan every global.
+#define GLOBAL_BARRIER(vm, slot, value) \
+        do { \
+            WRITE_BARRIER(vm, value); \
+            if (IS_OBJ(value) && IS_YOUNG(vm, AS_OBJ(value))) rememberGlobal(vm, slot); \
+        } while (false)
 
-void * reallocate(void * pointer, size_t oldSize, size_t newSize);
-void freeObjects();
+// Puts a VM straight after initVM() into arena mode: all its memory is
+// carved from one block of 'limit' bytes, and a script that needs more
+// fails with a runtime error. freeVM() and resetVM() drop the whole
+// arena at once.
+void initArena(SplVM* vm, size_t limit);
+void * reallocate(SplVM* vm, void * pointer, size_t oldSize, size_t newSize);
+void markObject(SplVM* vm, Obj* object);
+void markValue(SplVM* vm, Value value);
+void rememberGlobal(SplVM* vm, int slot);
+// Keeps an object the running cycle may have found unreachable alive,
+// e.g. an interned string handed out again by a lookup.
+void shadeObject(SplVM* vm, Obj* object);
+// Finishes the cycle in progress, if any, and runs a complete one.
+void collectGarbage(SplVM* vm);
+// Returns 'size' bytes from the nursery, running a minor collection
+// first if it is full, or NULL if 'size' exceeds NURSERY_MAX_OBJECT or
+// the VM runs in an arena too small to hold a nursery.
+void* allocateYoung(SplVM* vm, size_t size);
+void freeObjects(SplVM* vm);
+// Copies the counters and walks the heap and nursery for the object
+// census. Costs time proportional to the number of objects.
+void getMemStats(SplVM* vm, MemStats* stats);
+// Prints 'stats' and the collector's pauses as a summary or as JSON.
+void printMemStats(SplVM* vm, const MemStats* stats, FILE* out, bool json);
+// Upper bound, in microseconds, of the bucket holding the given
+// percentile (0-100) of all recorded pauses; 0 if there were none.
+double gcPausePercentile(const GcPauseHistogram* histogram, double percentile);
 
 #endif
\ No newline at end of file
@@ -7,55 +7,231 @@
 #include "spl_value.h"
 #include "spl_vm.h"
 
-#define ALLOCATE_OBJ(type, objectType) \
-		(type*)allocateObject(sizeof(type), objectType)
-
-
-static Obj* allocateObject(size_t size, ObjType type) {
-	Obj* object = (Obj*)reallocate(NULL, 0, size);
+static Obj* allocateObject(SplVM* vm, size_t size, ObjType type) {
+	Obj* object = (Obj*)reallocate(vm, NULL, 0, size);
 	object->type = type;
-	object->next = vm.objects;
-	vm.objects = object;
+	object->isMarked = vm->gcMarkBit;
+	object->next = vm->objects;
+	vm->objects = object;
 	return object;
 }
 
 
-static ObjString* allocateString(char* chars, int length, uint32_t hash) {
-	ObjString* string = ALLOCATE_OBJ(ObjString, OBJ_STRING);
+static ObjString* allocateString(SplVM* vm, const char* chars, int length, uint32_t hash) {
+	ObjString* string = (ObjString*)allocateObject(vm, STRING_SIZE(length), OBJ_STRING);
 	string->length = length;
-	string->chars = chars;
 	string->hash = hash;
-	tableSet(&vm.strings, string, NIL_VAL);
+	string->interned = true;
+	memcpy(string->chars, chars, length);
+	string->chars[length] = '\0';
+	// Growing the intern table may collect; keep the string reachable.
+	push(vm, OBJ_VAL(string));
+	tableSet(vm, &vm->strings, string, NIL_VAL);
+	pop(vm);
 	return string;
 }
 
-static uint32_t hashString(const char* key, int length) {
-	uint32_t hash = 2166136261u;
-	for (int i = 0; i < length; i++) {
-		hash ^= key[i];
-		hash *= 16777619;
+// wyhash: 8 or 16 bytes per step, each mixed in by one 64x64->128-bit
+// multiply whose halves are folded together.
+#define HASH_P0 0xa0761d6478bd642full
+#define HASH_P1 0xe7037ed1a0b428dbull
+#define HASH_P2 0x8ebc6af09c88c6e3ull
+#define HASH_P3 0x589965cc75374cc3ull
+
+static inline void multiply128(uint64_t* a, uint64_t* b) {
+#ifdef __SIZEOF_INT128__
+	__uint128_t product = (__uint128_t)*a * *b;
+	*a = (uint64_t)product;
+	*b = (uint64_t)(product >> 64);
+#else
+	uint64_t ha = *a >> 32, hb = *b >> 32, la = (uint32_t)*a, lb = (uint32_t)*b;
+	uint64_t hh = ha * hb, hl = ha * lb, lh = la * hb, ll = la * lb;
+	uint64_t t = ll + (hl << 32);
+	uint64_t low = t + (lh << 32);
+	uint64_t carry = (t < ll) + (low < t);
+	*a = low;
+	*b = hh + (hl >> 32) + (lh >> 32) + carry;
+#endif
+}
+
+static inline uint64_t mix(uint64_t a, uint64_t b) {
+	multiply128(&a, &b);
+	return a ^ b;
+}
+
+static inline uint64_t read64(const uint8_t* p) {
+	uint64_t v;
+	memcpy(&v, p, 8);
+	return v;
+}
+
+static inline uint64_t read32(const uint8_t* p) {
+	uint32_t v;
+	memcpy(&v, p, 4);
+	return v;
+}
+
+uint32_t hashString(const char* key, int length) {
+	const uint8_t* p = (const uint8_t*)key;
+	size_t left = (size_t)length;
+	uint64_t seed = HASH_P0;
+	uint64_t a, b;
+	if (left <= 16) {
+		if (left >= 4) {
+			// Two overlapping pairs of 4-byte reads cover 4 to 16 bytes.
+			size_t middle = (left >> 3) << 2;
+			a = (read32(p) << 32) | read32(p + middle);
+			b = (read32(p + left - 4) << 32) | read32(p + left - 4 - middle);
+		} else if (left > 0) {
+			a = ((uint64_t)p[0] << 16) | ((uint64_t)p[left >> 1] << 8) | p[left - 1];
+			b = 0;
+		} else {
+			a = b = 0;
+		}
+	} else {
+		if (left > 48) {
+			uint64_t seed1 = seed, seed2 = seed;
+			do {
+				seed = mix(read64(p) ^ HASH_P1, read64(p + 8) ^ seed);
+				seed1 = mix(read64(p + 16) ^ HASH_P2, read64(p + 24) ^ seed1);
+				seed2 = mix(read64(p + 32) ^ HASH_P3, read64(p + 40) ^ seed2);
+				p += 48;
+				left -= 48;
+			} while (left > 48);
+			seed ^= seed1 ^ seed2;
+		}
+		while (left > 16) {
+			seed = mix(read64(p) ^ HASH_P1, read64(p + 8) ^ seed);
+			p += 16;
+			left -= 16;
+		}
+		// The last 16 bytes, overlapping what came before.
+		a = read64(p + left - 16);
+		b = read64(p + left - 8);
 	}
-	return hash;
+	a ^= HASH_P1;
+	b ^= seed;
+	multiply128(&a, &b);
+	return (uint32_t)mix(a ^ HASH_P0 ^ (uint64_t)length, b ^ HASH_P1);
 }
 
-ObjString* takeString(char* chars, int length) {
+ObjString* takeString(SplVM* vm, char* chars, int length) {
 	uint32_t hash = hashString(chars, length);
-	ObjString* interned = tableFindString(&vm.strings, chars, length, hash);
+	ObjString* interned = tableFindString(&vm->strings, chars, length, hash);
 	if (interned != NULL) {
-		FREE_ARRAY(char, chars, length + 1);
+		FREE_ARRAY(vm, char, chars, length + 1);
+		shadeObject(vm, &interned->obj);
 		return interned;
 	}
-	return allocateString(chars, length, hash);
+	ObjString* string = allocateString(vm, chars, length, hash);
+	FREE_ARRAY(vm, char, chars, length + 1);
+	return string;
 }
 
-ObjString* copyString(const char* chars, int length) {
+ObjString* copyString(SplVM* vm, const char* chars, int length) {
 	uint32_t hash = hashString(chars, length);
-	ObjString* interned = tableFindString(&vm.strings, chars, length, hash);
-	if (interned != NULL) return interned;
-	char* heapChars = ALLOCATE(char, length + 1);
-	memcpy(heapChars, chars, length);
-	heapChars[length] = '\0';
-	return allocateString(heapChars, length, hash);
+	ObjString* interned = tableFindString(&vm->strings, chars, length, hash);
+	if (interned != NULL) {
+		shadeObject(vm, &interned->obj);
+		return interned;
+	}
+	return allocateString(vm, chars, length, hash);
+}
+
+static ObjString* initReserved(SplVM* vm, ObjString* string, int length) {
+	string->obj.type = OBJ_STRING;
+	string->obj.isMarked = vm->gcMarkBit;
+	string->obj.next = NULL;
+	string->length = length;
+	string->interned = false;
+	return string;
+}
+
+static ObjString* reserveOldString(SplVM* vm, int length) {
+	ObjString* string = (ObjString*)reallocate(vm, NULL, 0, STRING_SIZE(length));
+	initReserved(vm, string, length);
+	string->obj.next = vm->objects;
+	vm->objects = &string->obj;
+	return string;
+}
+
+ObjString* reserveString(SplVM* vm, int length) {
+	ObjString* string = (ObjString*)allocateYoung(vm, STRING_SIZE(length));
+	// Too big for the nursery.
+	if (string == NULL) return reserveOldString(vm, length);
+	return initReserved(vm, string, length);
+}
+
+ObjRope* reserveRope(SplVM* vm) {
+	ObjRope* rope = (ObjRope*)allocateYoung(vm, sizeof(ObjRope));
+	if (rope == NULL) {
+		// No nursery in a small arena.
+		rope = (ObjRope*)reallocate(vm, NULL, 0, sizeof(ObjRope));
+		rope->obj.next = vm->objects;
+		vm->objects = &rope->obj;
+	} else {
+		rope->obj.next = NULL;
+	}
+	rope->obj.type = OBJ_ROPE;
+	rope->obj.isMarked = vm->gcMarkBit;
+	return rope;
+}
+
+static int textLength(Obj* text) {
+	return text->type == OBJ_ROPE ? ((ObjRope*)text)->length : ((ObjString*)text)->length;
+}
+
+static int textDepth(Obj* text) {
+	return text->type == OBJ_ROPE ? ((ObjRope*)text)->depth : 0;
+}
+
+void initRope(SplVM* vm, ObjRope* rope, Obj* left, Obj* right) {
+	rope->length = textLength(left) + textLength(right);
+	int depth = textDepth(left) > textDepth(right) ? textDepth(left) : textDepth(right);
+	rope->depth = depth + 1;
+	rope->left = left;
+	rope->right = right;
+	rope->flat = NULL;
+	// The rope may be born black.
+	WRITE_BARRIER(vm, OBJ_VAL(left));
+	WRITE_BARRIER(vm, OBJ_VAL(right));
+}
+
+// Copies the characters of 'text' so that they end just before 'end'.
+// Only the shallower child of each rope is recursed into, which bounds
+// the recursion by log2 of the number of leaves.
+static void copyText(Obj* text, char* end) {
+	while (text->type == OBJ_ROPE) {
+		ObjRope* rope = (ObjRope*)text;
+		if (rope->flat != NULL) {
+			text = &rope->flat->obj;
+			break;
+		}
+		if (textDepth(rope->left) < textDepth(rope->right)) {
+			copyText(rope->left, end - textLength(rope->right));
+			text = rope->right;
+		} else {
+			copyText(rope->right, end);
+			end -= textLength(rope->right);
+			text = rope->left;
+		}
+	}
+	ObjString* string = (ObjString*)text;
+	memcpy(end - string->length, string->chars, string->length);
+}
+
+ObjString* flattenRope(SplVM* vm, ObjRope* rope) {
+	if (rope->flat != NULL) return rope->flat;
+	// Old, so that an old rope never points into the nursery.
+	ObjString* string = reserveOldString(vm, rope->length);
+	copyText(&rope->obj, string->chars + rope->length);
+	string->chars[rope->length] = '\0';
+
+	rope->flat = string;
+	rope->depth = 0;
+	rope->left = NULL;
+	rope->right = NULL;
+	return string;
 }
 
 void printObject(Value value) {
@@ -63,6 +239,17 @@ void printObject(Value value) {
 		case OBJ_STRING: 
 			printf("%s", AS_CSTRING(value));
 			break;
+		case OBJ_ROPE: {
+			// The VM flattens before printing; this is for debug output.
+			ObjRope* rope = AS_ROPE(value);
+			if (rope->flat != NULL) {
+				printObject(OBJ_VAL(rope->flat));
+			} else {
+				printObject(OBJ_VAL(rope->left));
+				printObject(OBJ_VAL(rope->right));
+			}
+			break;
+		}
 	}
 
 }
\ No newline at end of file
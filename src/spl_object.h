@@ -8,28 +8,72 @@
 #define OBJ_TYPE(value)				(AS_OBJ(value)->type)
 
 #define IS_STRING(value)			isObjType(value, OBJ_STRING)
+#define IS_ROPE(value)				isObjType(value, OBJ_ROPE)
+// Anything '+' concatenates: a string or a rope.
+#define IS_TEXT(value)				(IS_STRING(value) || IS_ROPE(value))
 
 #define AS_STRING(value)			((ObjString*)AS_OBJ(value))
 #define AS_CSTRING(value)			(((ObjString*)AS_OBJ(value))->chars)
+#define AS_ROPE(value)				((ObjRope*)AS_OBJ(value))
 
 typedef enum {
 	OBJ_STRING,
+	OBJ_ROPE,
 } ObjType;
 
+#define OBJ_TYPE_COUNT (OBJ_ROPE + 1)
+
 struct Obj {
 	ObjType type;
+	bool isMarked;
 	struct Obj* next;
 };
 
+// The characters, NUL-terminated, follow the header in the same block.
+// Strings the compiler makes are interned, so equal ones are the same
+// object and can be table keys. Strings built at runtime are not: they
+// skip hashing and the intern table, and compare by content.
 struct ObjString {
 	Obj obj;
 	int length;
-	char* chars;
+	// Only set for interned strings.
 	uint32_t hash;
+	bool interned;
+	char chars[];
 };
 
-ObjString* takeString(char* chars, int length);
-ObjString* copyString(const char * chars, int length);
+#define STRING_SIZE(length) (sizeof(ObjString) + (length) + 1)
+
+// Concatenations shorter than this are copied right away.
+#define ROPE_MIN_LENGTH 64
+
+// The concatenation of 'left' and 'right', each a string or a rope,
+// whose characters are only copied together once they are needed.
+// Flattening keeps the result in 'flat' and drops the children.
+typedef struct {
+	Obj obj;
+	int length;
+	// Longest path down to a string; 0 once flat.
+	int depth;
+	Obj* left;
+	Obj* right;
+	ObjString* flat;
+} ObjRope;
+
+uint32_t hashString(const char* key, int length);
+ObjString* takeString(SplVM* vm, char* chars, int length);
+ObjString* copyString(SplVM* vm, const char * chars, int length);
+// Runtime strings are built in place: reserveString() returns a string
+// of 'length' characters, young if it fits the nursery, for the caller
+// to fill in before anything else allocates.
+ObjString* reserveString(SplVM* vm, int length);
+// Like reserveString(), a rope for the caller to fill in with
+// initRope() before anything else allocates.
+ObjRope* reserveRope(SplVM* vm);
+void initRope(SplVM* vm, ObjRope* rope, Obj* left, Obj* right);
+// The characters of 'rope' as one string, copied on first use.
+// The caller keeps the rope reachable.
+ObjString* flattenRope(SplVM* vm, ObjRope* rope);
 
 void printObject(Value value);
 
@@ -37,4 +81,10 @@ static inline bool isObjType(Value value, ObjType type) {
 	return IS_OBJ(value) && AS_OBJ(value)->type == type;
 }
 
+// Equality and printing need the characters in one piece: replaces a
+// rope in '*slot', which keeps it reachable, by its flat string.
+static inline void flattenValue(SplVM* vm, Value* slot) {
+	if (IS_ROPE(*slot)) *slot = OBJ_VAL(flattenRope(vm, AS_ROPE(*slot)));
+}
+
 #endif
\ No newline at end of file
@@ -0,0 +1,194 @@
+#include <stdlib.h>
+
+#include "spl_memory.h"
+#include "spl_peephole.h"
+
+// Rewrites the instruction sequences the compiler emits most often in
+// loops into single superinstructions:
+//
+//   GET_LOCAL s; CONSTANT k; ADD         -> ADD_LOCAL_CONSTANT s k
+//   GREATER; NOT                         -> NOT_GREATER            (<=)
+//   LESS; NOT                            -> NOT_LESS               (>=)
+//   SET_LOCAL s; POP                     -> SET_LOCAL_POP s
+//   SET_GLOBAL k; POP                    -> SET_GLOBAL_POP k
+//   LESS; JUMP_IF_FALSE; POP             -> JUMP_IF_NOT_LESS
+//   GREATER; JUMP_IF_FALSE; POP          -> JUMP_IF_NOT_GREATER
+//   LESS; NOT; JUMP_IF_FALSE; POP        -> JUMP_IF_LESS
+//   GREATER; NOT; JUMP_IF_FALSE; POP     -> JUMP_IF_GREATER
+//
+// The fused jumps consume the condition, so they land one byte past the
+// POP that normally discards it at the jump target. Sequences are never
+// fused across a jump target.
+
+typedef struct {
+    uint8_t ops[4];
+    int length;
+    uint8_t fused;
+} Pattern;
+
+static const Pattern patterns[] = {
+    {{OP_GREATER, OP_NOT, OP_JUMP_IF_FALSE, OP_POP}, 4, OP_JUMP_IF_GREATER},
+    {{OP_LESS, OP_NOT, OP_JUMP_IF_FALSE, OP_POP}, 4, OP_JUMP_IF_LESS},
+    {{OP_LESS, OP_JUMP_IF_FALSE, OP_POP}, 3, OP_JUMP_IF_NOT_LESS},
+    {{OP_GREATER, OP_JUMP_IF_FALSE, OP_POP}, 3, OP_JUMP_IF_NOT_GREATER},
+    {{OP_GET_LOCAL, OP_CONSTANT, OP_ADD}, 3, OP_ADD_LOCAL_CONSTANT},
+    {{OP_GREATER, OP_NOT}, 2, OP_NOT_GREATER},
+    {{OP_LESS, OP_NOT}, 2, OP_NOT_LESS},
+    {{OP_SET_LOCAL, OP_POP}, 2, OP_SET_LOCAL_POP},
+    {{OP_SET_GLOBAL, OP_POP}, 2, OP_SET_GLOBAL_POP},
+};
+
+#define PATTERN_COUNT (int)(sizeof(patterns) / sizeof(patterns[0]))
+
+typedef struct {
+    int operand;
+    int target;
+} PendingJump;
+
+static bool isJump(uint8_t instruction) {
+    switch (instruction) {
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_LOOP:
+        case OP_JUMP_IF_GREATER:
+        case OP_JUMP_IF_NOT_GREATER:
+        case OP_JUMP_IF_LESS:
+        case OP_JUMP_IF_NOT_LESS:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static int jumpTarget(Chunk* chunk, int offset) {
+    uint16_t jump = (uint16_t)((chunk->code[offset + 1] << 8) | chunk->code[offset + 2]);
+    if (chunk->code[offset] == OP_LOOP) return offset + 3 - jump;
+    return offset + 3 + jump;
+}
+
+// Returns the offsets of the instructions that make up pattern at
+// offset, or false if it does not match there.
+static bool matchPattern(Chunk* chunk, bool* isTarget, const Pattern* pattern,
+        int offset, int* offsets) {
+    for (int i = 0; i < pattern->length; i++) {
+        if (offset >= chunk->count) return false;
+        if (i > 0 && isTarget[offset]) return false;
+        if (chunk->code[offset] != pattern->ops[i]) return false;
+        offsets[i] = offset;
+        offset += instructionLength(chunk->code[offset]);
+    }
+    if (isJump(pattern->fused)) {
+        int jump = offsets[pattern->length - 2];
+        int target = jumpTarget(chunk, jump);
+        if (target >= chunk->count || chunk->code[target] != OP_POP) return false;
+    }
+    return true;
+}
+
+void fuseSuperinstructions(SplVM* vm, Chunk* chunk) {
+    int size = chunk->count + 1;
+    bool* isTarget = ALLOCATE(vm, bool, size);
+    int* newOffsets = ALLOCATE(vm, int, size);
+    PendingJump* jumps = ALLOCATE(vm, PendingJump, size);
+    int jumpCount = 0;
+
+    for (int i = 0; i < size; i++) {
+        isTarget[i] = false;
+        newOffsets[i] = -1;
+    }
+    for (int offset = 0; offset < chunk->count;
+            offset += instructionLength(chunk->code[offset])) {
+        if (isJump(chunk->code[offset])) {
+            int target = jumpTarget(chunk, offset);
+            isTarget[target] = true;
+            // A fused jump may land right behind the POP at its target.
+            if (target < chunk->count && chunk->code[target] == OP_POP) {
+                isTarget[target + 1] = true;
+            }
+        }
+    }
+
+    Chunk fused;
+    initChunk(&fused);
+    LineCursor lines;
+    initLineCursor(&lines, &chunk->lines);
+    int offset = 0;
+    while (offset < chunk->count) {
+        int offsets[4];
+        const Pattern* pattern = NULL;
+        for (int i = 0; i < PATTERN_COUNT; i++) {
+            if (matchPattern(chunk, isTarget, &patterns[i], offset, offsets)) {
+                pattern = &patterns[i];
+                break;
+            }
+        }
+        newOffsets[offset] = fused.count;
+
+        if (pattern == NULL) {
+            int line = cursorLine(&lines, offset);
+            int length = instructionLength(chunk->code[offset]);
+            if (isJump(chunk->code[offset])) {
+                jumps[jumpCount].operand = fused.count + 1;
+                jumps[jumpCount].target = jumpTarget(chunk, offset);
+                jumpCount++;
+            }
+            for (int i = 0; i < length; i++) {
+                writeChunk(vm, &fused, chunk->code[offset + i], line);
+            }
+            offset += length;
+            continue;
+        }
+
+        // Report errors against the instruction in the sequence that can
+        // actually fail.
+        int failing = pattern->fused == OP_ADD_LOCAL_CONSTANT ? offsets[2] : offsets[0];
+        int line = cursorLine(&lines, failing);
+        writeChunk(vm, &fused, pattern->fused, line);
+        switch (pattern->fused) {
+            case OP_ADD_LOCAL_CONSTANT:
+                writeChunk(vm, &fused, chunk->code[offsets[0] + 1], line);
+                writeChunk(vm, &fused, chunk->code[offsets[1] + 1], line);
+                break;
+            case OP_SET_LOCAL_POP:
+            case OP_SET_GLOBAL_POP:
+                writeChunk(vm, &fused, chunk->code[offsets[0] + 1], line);
+                break;
+            case OP_JUMP_IF_GREATER:
+            case OP_JUMP_IF_NOT_GREATER:
+            case OP_JUMP_IF_LESS:
+            case OP_JUMP_IF_NOT_LESS: {
+                int jump = offsets[pattern->length - 2];
+                jumps[jumpCount].operand = fused.count;
+                jumps[jumpCount].target = jumpTarget(chunk, jump) + 1;
+                jumpCount++;
+                writeChunk(vm, &fused, 0xff, line);
+                writeChunk(vm, &fused, 0xff, line);
+                break;
+            }
+            default:
+                break;
+        }
+        int last = offsets[pattern->length - 1];
+        offset = last + instructionLength(chunk->code[last]);
+    }
+    newOffsets[chunk->count] = fused.count;
+
+    for (int i = 0; i < jumpCount; i++) {
+        int operand = jumps[i].operand;
+        int target = newOffsets[jumps[i].target];
+        int jump = operand + 2 > target ? operand + 2 - target : target - operand - 2;
+        fused.code[operand] = (jump >> 8) & 0xff;
+        fused.code[operand + 1] = jump & 0xff;
+    }
+
+    FREE_ARRAY(vm, uint8_t, chunk->code, chunk->capacity);
+    freeLineArray(vm, &chunk->lines);
+    chunk->code = fused.code;
+    chunk->count = fused.count;
+    chunk->capacity = fused.capacity;
+    chunk->lines = fused.lines;
+
+    FREE_ARRAY(vm, bool, isTarget, size);
+    FREE_ARRAY(vm, int, newOffsets, size);
+    FREE_ARRAY(vm, PendingJump, jumps, size);
+}
@@ -0,0 +1,8 @@
+#ifndef SPL_PEEPHOLE_H
+#define SPL_PEEPHOLE_H
+
+#include "spl_chunk.h"
+
+void fuseSuperinstructions(SplVM* vm, Chunk* chunk);
+
+#endif
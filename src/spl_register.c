@@ -0,0 +1,390 @@
+#include <stdlib.h>
+
+#include "spl_memory.h"
+#include "spl_register.h"
+#include "spl_vm.h"
+
+// Constants are addressed as negative operands while translating and
+// moved above the registers once the register count is known.
+#define CONSTANT_OPERAND(index) (-1 - (index))
+#define IS_CONSTANT_OPERAND(operand) ((operand) < 0)
+#define NO_INSTRUCTION -1
+
+typedef struct {
+    SplVM* vm;
+    Chunk* chunk;
+    RegChunk* out;
+    // Stack offset -> index of the first register instruction for it.
+    int* targetIndex;
+    // Stack depth recorded by the jumps that land on an offset.
+    int* targetDepth;
+    bool* isTarget;
+    // Frame operand currently holding the value of each stack slot.
+    // Loads are forwarded lazily, so a slot may still live in a local
+    // register or a constant.
+    int* slots;
+    int depth;
+    int maxDepth;
+    bool reachable;
+    int offset;
+    // Index of the last instruction that wrote the top slot's canonical
+    // register, or NO_INSTRUCTION if something happened since.
+    int lastWrite;
+    int labelIndex;
+    int nilConstant;
+    int trueConstant;
+    int falseConstant;
+} Translator;
+
+void initRegChunk(RegChunk* chunk) {
+    chunk->count = 0;
+    chunk->capacity = 0;
+    chunk->code = NULL;
+    chunk->offsets = NULL;
+    chunk->registerCount = 0;
+    initValueArray(&chunk->constants);
+}
+
+void freeRegChunk(SplVM* vm, RegChunk* chunk) {
+    FREE_ARRAY(vm, RegInstr, chunk->code, chunk->capacity);
+    FREE_ARRAY(vm, int, chunk->offsets, chunk->capacity);
+    freeValueArray(vm, &chunk->constants);
+    initRegChunk(chunk);
+}
+
+static int emit(Translator* t, uint8_t op, int32_t a, int32_t b, int32_t c) {
+    RegChunk* out = t->out;
+    if (out->capacity < out->count + 1) {
+        int oldCapacity = out->capacity;
+        out->capacity = GROW_CAPACITY(oldCapacity);
+        out->code = GROW_ARRAY(t->vm, RegInstr, out->code, oldCapacity, out->capacity);
+        out->offsets = GROW_ARRAY(t->vm, int, out->offsets, oldCapacity, out->capacity);
+    }
+    RegInstr* instr = &out->code[out->count];
+    instr->op = op;
+    instr->a = a;
+    instr->b = b;
+    instr->c = c;
+    out->offsets[out->count] = t->offset;
+    return out->count++;
+}
+
+static int readOperand(Chunk* chunk, int offset) {
+    uint8_t op = chunk->code[offset];
+    if (instructionLength(op) == 1 + CONSTANT_LONG_BYTE_SIZE) {
+        return CONVERT_BYTE_ARRAY_TO_INT(&chunk->code[offset + 1], CONSTANT_LONG_BYTE_SIZE);
+    }
+    return chunk->code[offset + 1];
+}
+
+static int jumpTarget(Chunk* chunk, int offset) {
+    uint16_t jump = (uint16_t)((chunk->code[offset + 1] << 8) | chunk->code[offset + 2]);
+    if (chunk->code[offset] == OP_LOOP) return offset + 3 - jump;
+    return offset + 3 + jump;
+}
+
+static int extraConstant(Translator* t, int* index, Value value) {
+    if (*index == -1) {
+        writeValueArray(t->vm, &t->out->constants, value);
+        *index = t->out->constants.count - 1;
+    }
+    return CONSTANT_OPERAND(*index);
+}
+
+static void pushSlot(Translator* t, int operand) {
+    t->slots[t->depth++] = operand;
+    if (t->depth > t->maxDepth) t->maxDepth = t->depth;
+}
+
+static int popSlot(Translator* t) {
+    t->lastWrite = NO_INSTRUCTION;
+    return t->slots[--t->depth];
+}
+
+// Make the canonical register of a stack slot hold its value.
+static void materialize(Translator* t, int slot) {
+    if (t->slots[slot] != slot) {
+        emit(t, ROP_MOVE, slot, t->slots[slot], 0);
+        t->slots[slot] = slot;
+    }
+}
+
+// Materialize every other slot that still reads its value out of reg
+// before reg gets overwritten.
+static void flushReferences(Translator* t, int reg, int except) {
+    for (int slot = 0; slot < t->depth; slot++) {
+        if (slot != except && slot != reg && t->slots[slot] == reg) {
+            materialize(t, slot);
+        }
+    }
+}
+
+static void flushAll(Translator* t) {
+    for (int slot = 0; slot < t->depth; slot++) {
+        materialize(t, slot);
+    }
+}
+
+static void recordJump(Translator* t, int target) {
+    if (t->targetDepth[target] == -1) t->targetDepth[target] = t->depth;
+}
+
+static void binary(Translator* t, uint8_t op) {
+    int right = popSlot(t);
+    int left = popSlot(t);
+    int dest = t->depth;
+    int index = emit(t, op, dest, left, right);
+    pushSlot(t, dest);
+    t->lastWrite = index;
+}
+
+static void unary(Translator* t, uint8_t op) {
+    int operand = popSlot(t);
+    int dest = t->depth;
+    int index = emit(t, op, dest, operand, 0);
+    pushSlot(t, dest);
+    t->lastWrite = index;
+}
+
+static void setLocal(Translator* t, int local) {
+    int top = t->depth - 1;
+    int value = t->slots[top];
+    RegChunk* out = t->out;
+    if (value == local) return;
+
+    bool referenced = false;
+    for (int slot = 0; slot < t->depth; slot++) {
+        if (slot != local && slot != top && t->slots[slot] == local) {
+            referenced = true;
+        }
+    }
+
+    if (!referenced && value == top &&
+            t->lastWrite == out->count - 1 &&
+            out->code[t->lastWrite].a == top) {
+        // Write the result straight into the local instead of
+        // computing it into a temporary and moving it.
+        out->code[t->lastWrite].a = local;
+    } else {
+        flushReferences(t, local, top);
+        emit(t, ROP_MOVE, local, value, 0);
+    }
+    t->slots[local] = local;
+    t->slots[top] = local;
+    t->lastWrite = NO_INSTRUCTION;
+}
+
+static uint8_t fusedBranch(uint8_t compare, bool negated) {
+    switch (compare) {
+        case ROP_EQUAL: return negated ? ROP_JUMP_IF_EQUAL : ROP_JUMP_IF_NOT_EQUAL;
+        case ROP_GREATER: return negated ? ROP_JUMP_IF_GREATER : ROP_JUMP_IF_NOT_GREATER;
+        case ROP_LESS: return negated ? ROP_JUMP_IF_LESS : ROP_JUMP_IF_NOT_LESS;
+        default: return ROP_JUMP_IF_FALSE;
+    }
+}
+
+// A condition that only feeds a branch and is popped on both edges never
+// needs to exist as a value: compare-and-branch on the operands instead.
+static bool fuseConditionalJump(Translator* t, int target) {
+    Chunk* chunk = t->chunk;
+    RegChunk* out = t->out;
+    int top = t->depth - 1;
+    int next = t->offset + 3;
+
+    if (next >= chunk->count || chunk->code[next] != OP_POP) return false;
+    if (target >= chunk->count || chunk->code[target] != OP_POP) return false;
+    if (t->lastWrite != out->count - 1 || t->slots[top] != top) return false;
+
+    RegInstr* last = &out->code[out->count - 1];
+    bool negated = false;
+    if (last->op == ROP_NOT && last->b == top && out->count - 2 >= t->labelIndex) {
+        RegInstr* compare = &out->code[out->count - 2];
+        if (compare->a != top) return false;
+        negated = true;
+        last = compare;
+    }
+    uint8_t branch = fusedBranch(last->op, negated);
+    if (branch == ROP_JUMP_IF_FALSE || last->a != top) return false;
+
+    int left = last->b;
+    int right = last->c;
+    out->count -= negated ? 2 : 1;
+    flushAll(t);
+    emit(t, branch, target, left, right);
+    return true;
+}
+
+static void translateInstruction(Translator* t) {
+    Chunk* chunk = t->chunk;
+    int offset = t->offset;
+    uint8_t op = chunk->code[offset];
+
+    switch (op) {
+        case OP_CONSTANT:
+        case OP_CONSTANT_LONG:
+            pushSlot(t, CONSTANT_OPERAND(readOperand(chunk, offset)));
+            break;
+        case OP_NIL:
+            pushSlot(t, extraConstant(t, &t->nilConstant, NIL_VAL));
+            break;
+        case OP_TRUE:
+            pushSlot(t, extraConstant(t, &t->trueConstant, BOOL_VAL(true)));
+            break;
+        case OP_FALSE:
+            pushSlot(t, extraConstant(t, &t->falseConstant, BOOL_VAL(false)));
+            break;
+        case OP_POP:
+            popSlot(t);
+            break;
+        case OP_GET_LOCAL:
+        case OP_GET_LOCAL_LONG: {
+            int local = readOperand(chunk, offset);
+            materialize(t, local);
+            pushSlot(t, local);
+            break;
+        }
+        case OP_SET_LOCAL:
+        case OP_SET_LOCAL_LONG: {
+            int local = readOperand(chunk, offset);
+            setLocal(t, local);
+            break;
+        }
+        case OP_GET_GLOBAL:
+        case OP_GET_GLOBAL_LONG: {
+            int slot = readOperand(chunk, offset);
+            int dest = t->depth;
+            int index = emit(t, ROP_GET_GLOBAL, dest, slot, 0);
+            pushSlot(t, dest);
+            t->lastWrite = index;
+            break;
+        }
+        case OP_DEFINE_GLOBAL:
+        case OP_DEFINE_GLOBAL_LONG: {
+            int slot = readOperand(chunk, offset);
+            emit(t, ROP_DEFINE_GLOBAL, 0, slot, t->slots[t->depth - 1]);
+            popSlot(t);
+            break;
+        }
+        case OP_SET_GLOBAL:
+        case OP_SET_GLOBAL_LONG: {
+            int slot = readOperand(chunk, offset);
+            emit(t, ROP_SET_GLOBAL, 0, slot, t->slots[t->depth - 1]);
+            t->lastWrite = NO_INSTRUCTION;
+            break;
+        }
+        case OP_EQUAL: binary(t, ROP_EQUAL); break;
+        case OP_GREATER: binary(t, ROP_GREATER); break;
+        case OP_LESS: binary(t, ROP_LESS); break;
+        case OP_ADD: binary(t, ROP_ADD); break;
+        case OP_SUBTRACT: binary(t, ROP_SUBTRACT); break;
+        case OP_MULTIPLY: binary(t, ROP_MULTIPLY); break;
+        case OP_DIVIDE: binary(t, ROP_DIVIDE); break;
+        case OP_NOT: unary(t, ROP_NOT); break;
+        case OP_NEGATE: unary(t, ROP_NEGATE); break;
+        case OP_PRINT:
+            emit(t, ROP_PRINT, 0, popSlot(t), 0);
+            break;
+        case OP_JUMP_IF_FALSE: {
+            int target = jumpTarget(chunk, offset);
+            if (!fuseConditionalJump(t, target)) {
+                flushAll(t);
+                emit(t, ROP_JUMP_IF_FALSE, target, t->depth - 1, 0);
+            }
+            recordJump(t, target);
+            t->lastWrite = NO_INSTRUCTION;
+            break;
+        }
+        case OP_JUMP:
+        case OP_LOOP: {
+            int target = jumpTarget(chunk, offset);
+            flushAll(t);
+            emit(t, ROP_JUMP, target, 0, 0);
+            recordJump(t, target);
+            t->reachable = false;
+            break;
+        }
+        case OP_RETURN:
+            emit(t, ROP_RETURN, 0, 0, 0);
+            t->reachable = false;
+            break;
+    }
+}
+
+static bool isJump(uint8_t op) {
+    return op == ROP_JUMP || op == ROP_JUMP_IF_FALSE ||
+        (op >= ROP_JUMP_IF_EQUAL && op <= ROP_JUMP_IF_NOT_LESS);
+}
+
+bool translateChunk(SplVM* vm, Chunk* chunk, RegChunk* regChunk) {
+    Translator t;
+    t.vm = vm;
+    int size = chunk->count + 1;
+    t.chunk = chunk;
+    t.out = regChunk;
+    t.targetIndex = ALLOCATE(vm, int, size);
+    t.targetDepth = ALLOCATE(vm, int, size);
+    t.isTarget = ALLOCATE(vm, bool, size);
+    t.slots = ALLOCATE(vm, int, size);
+    t.depth = 0;
+    t.maxDepth = 0;
+    t.reachable = true;
+    t.lastWrite = NO_INSTRUCTION;
+    t.labelIndex = 0;
+    t.nilConstant = -1;
+    t.trueConstant = -1;
+    t.falseConstant = -1;
+
+    for (int i = 0; i < size; i++) {
+        t.targetIndex[i] = -1;
+        t.targetDepth[i] = -1;
+        t.isTarget[i] = false;
+    }
+    for (int offset = 0; offset < chunk->count;
+            offset += instructionLength(chunk->code[offset])) {
+        uint8_t op = chunk->code[offset];
+        if (op == OP_JUMP || op == OP_JUMP_IF_FALSE || op == OP_LOOP) {
+            t.isTarget[jumpTarget(chunk, offset)] = true;
+        }
+    }
+
+    for (int i = 0; i < chunk->constants.count; i++) {
+        writeValueArray(vm, &regChunk->constants, chunk->constants.values[i]);
+    }
+
+    for (t.offset = 0; t.offset < chunk->count;
+            t.offset += instructionLength(chunk->code[t.offset])) {
+        if (t.isTarget[t.offset]) {
+            if (t.reachable) {
+                flushAll(&t);
+                recordJump(&t, t.offset);
+            }
+            if (t.targetDepth[t.offset] == -1) continue;
+            t.depth = t.targetDepth[t.offset];
+            for (int slot = 0; slot < t.depth; slot++) t.slots[slot] = slot;
+            t.reachable = true;
+            t.lastWrite = NO_INSTRUCTION;
+            t.labelIndex = regChunk->count;
+            t.targetIndex[t.offset] = regChunk->count;
+        }
+        if (!t.reachable) continue;
+        translateInstruction(&t);
+    }
+
+    // Constants go right above the registers; jumps get instruction
+    // indices instead of stack offsets.
+    regChunk->registerCount = t.maxDepth;
+    // Leave the stack reserve above the frame for concatenate()'s operands.
+    bool fits = t.maxDepth + regChunk->constants.count + STACK_RESERVE <= STACK_MAX;
+    for (int i = 0; i < regChunk->count; i++) {
+        RegInstr* instr = &regChunk->code[i];
+        if (IS_CONSTANT_OPERAND(instr->b)) instr->b = t.maxDepth - 1 - instr->b;
+        if (IS_CONSTANT_OPERAND(instr->c)) instr->c = t.maxDepth - 1 - instr->c;
+        if (isJump(instr->op)) instr->a = t.targetIndex[instr->a];
+    }
+
+    FREE_ARRAY(vm, int, t.targetIndex, size);
+    FREE_ARRAY(vm, int, t.targetDepth, size);
+    FREE_ARRAY(vm, bool, t.isTarget, size);
+    FREE_ARRAY(vm, int, t.slots, size);
+    return fits;
+}
@@ -0,0 +1,69 @@
+#ifndef SPL_REGISTER_H
+#define SPL_REGISTER_H
+
+#include "spl_common.h"
+#include "spl_chunk.h"
+#include "spl_value.h"
+
+// Three-address register code. Register n is stack slot n of the stack
+// bytecode it was translated from, so locals keep their slot numbers.
+// Constants are copied into the frame right above the registers, which
+// lets every source operand be a plain frame index.
+//
+//   a: destination register or jump target (instruction index)
+//   b, c: source frame operands; b is the global slot for the
+//         *_GLOBAL instructions
+#define SPL_REG_OPCODES(X) \
+    X(ROP_MOVE) \
+    X(ROP_GET_GLOBAL) \
+    X(ROP_DEFINE_GLOBAL) \
+    X(ROP_SET_GLOBAL) \
+    X(ROP_EQUAL) \
+    X(ROP_GREATER) \
+    X(ROP_LESS) \
+    X(ROP_NOT) \
+    X(ROP_NEGATE) \
+    X(ROP_ADD) \
+    X(ROP_SUBTRACT) \
+    X(ROP_MULTIPLY) \
+    X(ROP_DIVIDE) \
+    X(ROP_PRINT) \
+    X(ROP_JUMP) \
+    X(ROP_JUMP_IF_FALSE) \
+    X(ROP_JUMP_IF_EQUAL) \
+    X(ROP_JUMP_IF_NOT_EQUAL) \
+    X(ROP_JUMP_IF_GREATER) \
+    X(ROP_JUMP_IF_NOT_GREATER) \
+    X(ROP_JUMP_IF_LESS) \
+    X(ROP_JUMP_IF_NOT_LESS) \
+    X(ROP_RETURN)
+
+typedef enum {
+#define SPL_REG_OPCODE_ENUM(name) name,
+    SPL_REG_OPCODES(SPL_REG_OPCODE_ENUM)
+#undef SPL_REG_OPCODE_ENUM
+} RegOpCode;
+
+typedef struct {
+    uint8_t op;
+    int32_t a;
+    int32_t b;
+    int32_t c;
+} RegInstr;
+
+typedef struct {
+    int count;
+    int capacity;
+    RegInstr* code;
+    // Offset of the stack instruction each register instruction came
+    // from, used to report runtime errors against the right line.
+    int* offsets;
+    int registerCount;
+    ValueArray constants;
+} RegChunk;
+
+void initRegChunk(RegChunk* chunk);
+void freeRegChunk(SplVM* vm, RegChunk* chunk);
+bool translateChunk(SplVM* vm, Chunk* chunk, RegChunk* regChunk);
+
+#endif
@@ -5,122 +5,334 @@
 #include "spl_object.h"
 #include "spl_table.h"
 #include "spl_value.h"
+#include "spl_vm.h"
 
-#define TABLE_MAX_LOAD 0.75
+#ifdef SPL_SSE2
+#include <emmintrin.h>
+#endif
+
+// A table grows once live entries and tombstones fill 7/8 of it.
+#define TABLE_MAX_LOAD(capacity) ((capacity) - (capacity) / 8)
+
+// The high bits of the hash pick the first group, the low seven are
+// stored in the control byte.
+#define HASH_GROUP(hash) ((hash) >> 7)
+#define HASH_TAG(hash) ((int8_t)((hash) & 0x7f))
+
+#ifdef SPL_SSE2
+typedef __m128i Group;
+
+static inline Group loadGroup(const int8_t* control) {
+    return _mm_loadu_si128((const __m128i*)control);
+}
+
+// One bit per slot whose control byte is 'byte'.
+static inline uint32_t matchByte(Group group, int8_t byte) {
+    return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8(byte)));
+}
+
+// Empty and deleted slots are the ones with the sign bit set.
+static inline uint32_t matchFree(Group group) {
+    return (uint32_t)_mm_movemask_epi8(group);
+}
+#else
+typedef const int8_t* Group;
+
+static inline Group loadGroup(const int8_t* control) {
+    return control;
+}
+
+static inline uint32_t matchByte(Group group, int8_t byte) {
+    uint32_t bits = 0;
+    for (int i = 0; i < TABLE_GROUP_WIDTH; i++) {
+        bits |= (uint32_t)(group[i] == byte) << i;
+    }
+    return bits;
+}
+
+static inline uint32_t matchFree(Group group) {
+    uint32_t bits = 0;
+    for (int i = 0; i < TABLE_GROUP_WIDTH; i++) {
+        bits |= (uint32_t)(group[i] < 0) << i;
+    }
+    return bits;
+}
+#endif
+
+// Tables up to this many slots are still moved in one go when they
+// grow, which takes a few microseconds and spares lookups the second
+// probe.
+#define TABLE_INCREMENTAL_MIN 1024
+// Old groups moved per insert. The new arrays are twice the size of the
+// old ones, so even one per insert empties them long before the new
+// ones fill up.
+#define TABLE_MIGRATE_GROUPS 1
+
+// Groups are visited at triangular offsets from the first one, which
+// reaches every group of a power-of-two table. The load limit keeps
+// an empty slot in some group, so every probe ends.
+#define FOR_EACH_GROUP(capacity, hash, group) \
+    for (uint32_t group##Mask = (uint32_t)(capacity) / TABLE_GROUP_WIDTH - 1, \
+             group = HASH_GROUP(hash) & group##Mask, group##Stride = 1; ; \
+         group = (group + group##Stride++) & group##Mask)
+
+static size_t tableSize(int capacity) {
+    return (size_t)capacity * (sizeof(Entry) + 1);
+}
 
 void initTable(Table* table) {
     table->count = 0;
+    table->tombstones = 0;
     table->capacity = 0;
     table->entries = NULL;
+    table->control = NULL;
+    table->oldCapacity = 0;
+    table->oldEntries = NULL;
+    table->oldControl = NULL;
+    table->migrated = 0;
 }
 
-void freeTable(Table* table) {
-    FREE_ARRAY(Entry, table->entries, table->capacity);
+void freeTable(SplVM* vm, Table* table) {
+    FREE_ARRAY(vm, char, table->entries, tableSize(table->capacity));
+    FREE_ARRAY(vm, char, table->oldEntries, tableSize(table->oldCapacity));
     initTable(table);
 }
 
-static Entry* findEntry(Entry* entries, int capacity, ObjString* key) {
-    uint32_t index = key->hash % capacity;
-    Entry* tombstone = NULL;
-    for (;;) {
-        Entry* entry = &entries[index];
-        if(entry->key == NULL) {
-            if (IS_NIL(entry->value)) {
-                return tombstone != NULL ? tombstone : entry;
-            } else {
-                if (tombstone == NULL) tombstone = entry;
-            }
-        } else if(entry->key == key) {
-            return entry;
+// Returns the slot of 'entries' holding 'key', or -1. If 'freeSlot' is
+// not NULL it gets the first empty or deleted slot on the way, where
+// 'key' would go.
+static inline int findKey(Entry* entries, int8_t* controls, int capacity,
+                          ObjString* key, int* freeSlot) {
+    if (capacity == 0) return -1;
+    uint32_t hash = key->hash;
+    FOR_EACH_GROUP(capacity, hash, group) {
+        int base = (int)group * TABLE_GROUP_WIDTH;
+        Group control = loadGroup(controls + base);
+        for (uint32_t bits = matchByte(control, HASH_TAG(hash)); bits != 0; bits &= bits - 1) {
+            int slot = base + __builtin_ctz(bits);
+            if (entries[slot].key == key) return slot;
+        }
+        if (freeSlot != NULL && *freeSlot < 0) {
+            uint32_t bits = matchFree(control);
+            if (bits != 0) *freeSlot = base + __builtin_ctz(bits);
         }
-        index = (index + 1) % capacity;
+        if (matchByte(control, CTRL_EMPTY) != 0) return -1;
     }
 }
 
+// Returns the first empty or deleted slot on the probe path of 'hash'.
+static int findFree(int8_t* controls, int capacity, uint32_t hash) {
+    FOR_EACH_GROUP(capacity, hash, group) {
+        uint32_t bits = matchFree(loadGroup(controls + group * TABLE_GROUP_WIDTH));
+        if (bits != 0) return (int)group * TABLE_GROUP_WIDTH + __builtin_ctz(bits);
+    }
+}
+
+// Points 'entry' at the entry for 'key' in either array. Returns false
+// if there is none.
+static inline bool findEntry(Table* table, ObjString* key, Entry** entry) {
+    int slot = findKey(table->entries, table->control, table->capacity, key, NULL);
+    if (slot >= 0) {
+        *entry = &table->entries[slot];
+        return true;
+    }
+    if (table->oldCapacity == 0) return false;
+    slot = findKey(table->oldEntries, table->oldControl, table->oldCapacity, key, NULL);
+    if (slot < 0) return false;
+    *entry = &table->oldEntries[slot];
+    return true;
+}
+
 bool tableGet(Table* table, ObjString* key, Value* value) {
-    if (table->count == 0) return false;
-    Entry* entry = findEntry(table->entries, table->capacity, key);
-    if (entry->key == NULL) return false;
+    Entry* entry;
+    if (!findEntry(table, key, &entry)) return false;
 
     *value = entry->value;
     return true;
 }
 
-static void adjustCapacity(Table* table, int capacity) {
-    Entry* entries = ALLOCATE(Entry, capacity);
-    for(int i = 0; i < capacity; i++) {
-        entries[i].key = NULL;
-        entries[i].value = NIL_VAL;
+// Frees 'slot'. A probe stops at the first group with an empty slot,
+// so no probe passes through such a group and the slot can simply
+// become empty. Otherwise it becomes a tombstone; returns true then.
+static bool clearSlot(int8_t* control, int slot) {
+    int base = slot & ~(TABLE_GROUP_WIDTH - 1);
+    if (matchByte(loadGroup(control + base), CTRL_EMPTY) != 0) {
+        control[slot] = CTRL_EMPTY;
+        return false;
     }
-    table->count = 0;
-    for(int i = 0; i <table->capacity; i++) {
-        Entry* entry = &table->entries[i];
-        if(entry->key == NULL) continue;
-        Entry* dest = findEntry(entries, capacity, entry->key);
-        dest->key = entry->key;
-        dest->value = entry->value;
-        table->count++;
-    }
-    FREE_ARRAY(Entry, table->entries, table->capacity);
-    table->entries = entries;
+    control[slot] = CTRL_DELETED;
+    return true;
+}
+
+// Inserts an entry whose key is in neither array into the current one.
+static void insertEntry(Table* table, int slot, ObjString* key, Value value) {
+    if (table->control[slot] == CTRL_DELETED) table->tombstones--;
+    table->control[slot] = HASH_TAG(key->hash);
+    table->entries[slot].key = key;
+    table->entries[slot].value = value;
+}
+
+// Moves up to 'groups' groups of the old arrays into the current ones,
+// freeing the old arrays once they are empty. The moved slots become
+// tombstones so that the entries still left can be found.
+static void migrate(SplVM* vm, Table* table, int groups) {
+    int groupCount = table->oldCapacity / TABLE_GROUP_WIDTH;
+    for (; groups > 0 && table->migrated < groupCount; groups--) {
+        int base = table->migrated++ * TABLE_GROUP_WIDTH;
+        for (int i = base; i < base + TABLE_GROUP_WIDTH; i++) {
+            if (!CTRL_IS_FULL(table->oldControl[i])) continue;
+            Entry* entry = &table->oldEntries[i];
+            int slot = findFree(table->control, table->capacity, entry->key->hash);
+            insertEntry(table, slot, entry->key, entry->value);
+            table->oldControl[i] = CTRL_DELETED;
+        }
+    }
+    if (table->migrated < groupCount) return;
+
+    FREE_ARRAY(vm, char, table->oldEntries, tableSize(table->oldCapacity));
+    table->oldCapacity = 0;
+    table->oldEntries = NULL;
+    table->oldControl = NULL;
+    table->migrated = 0;
+}
+
+// Switches to fresh arrays of 'capacity' slots, which drops the
+// tombstones, and starts moving the entries over.
+static void adjustCapacity(SplVM* vm, Table* table, int capacity) {
+    // Only one move at a time.
+    if (table->oldCapacity > 0) migrate(vm, table, INT_MAX);
+
+    Entry* entries = (Entry*)ALLOCATE(vm, char, tableSize(capacity));
+    int8_t* control = (int8_t*)(entries + capacity);
+    memset(control, CTRL_EMPTY, capacity);
+
+    // Allocating may have collected, which can delete from 'table' but
+    // never starts a move.
+    table->oldCapacity = table->capacity;
+    table->oldEntries = table->entries;
+    table->oldControl = table->control;
+    table->migrated = 0;
     table->capacity = capacity;
+    table->entries = entries;
+    table->control = control;
+    table->tombstones = 0;
+    if (table->oldCapacity <= TABLE_INCREMENTAL_MIN) migrate(vm, table, INT_MAX);
 }
 
+bool tableSet(SplVM* vm, Table* table, ObjString* key, Value value) {
+    WRITE_BARRIER(vm, OBJ_VAL(key));
+    WRITE_BARRIER(vm, value);
 
-bool tableSet(Table* table, ObjString* key, Value value) {
-    if(table->count + 1 > table->capacity * TABLE_MAX_LOAD) {
-        int capacity = GROW_CAPACITY(table->capacity);
-        adjustCapacity(table, capacity);
+    int slot = -1;
+    int existing = findKey(table->entries, table->control, table->capacity, key, &slot);
+    if (existing >= 0) {
+        table->entries[existing].value = value;
+        return false;
+    }
+    if (table->oldCapacity > 0) {
+        existing = findKey(table->oldEntries, table->oldControl, table->oldCapacity, key, NULL);
+        if (existing >= 0) {
+            table->oldEntries[existing].value = value;
+            return false;
+        }
     }
 
-    Entry* entry = findEntry(table->entries, table->capacity, key);
-    bool isNewKey = entry->key == NULL;
-    if(isNewKey && IS_NIL(entry->value)) table->count++;
+    // Entries still in the old arrays will need room here too.
+    if (table->count + table->tombstones + 1 > TABLE_MAX_LOAD(table->capacity)) {
+        int capacity = table->capacity < TABLE_GROUP_WIDTH ?
+                TABLE_GROUP_WIDTH : table->capacity * 2;
+        adjustCapacity(vm, table, capacity);
+        slot = findFree(table->control, table->capacity, key->hash);
+    }
 
-    entry->key = key;
-    entry->value = value;
-    return isNewKey;
+    insertEntry(table, slot, key, value);
+    table->count++;
+    if (table->oldCapacity > 0) migrate(vm, table, TABLE_MIGRATE_GROUPS);
+    return true;
 }
 
 bool tableDelete(Table* table, ObjString* key) {
-    if (table->count == 0) return false;
-    
-    // Find the entry
-    Entry* entry = findEntry(table->entries, table->capacity, key);
-    if(entry->key == NULL) return false;
-
-    // Place a tombsone in the entry
-    entry->key = NULL;
-    entry->value = BOOL_VAL(true);
-    
+    int slot = findKey(table->entries, table->control, table->capacity, key, NULL);
+    if (slot >= 0) {
+        if (clearSlot(table->control, slot)) table->tombstones++;
+    } else {
+        if (table->oldCapacity == 0) return false;
+        slot = findKey(table->oldEntries, table->oldControl, table->oldCapacity, key, NULL);
+        if (slot < 0) return false;
+        clearSlot(table->oldControl, slot);
+    }
+    table->count--;
     return true;
 }
 
-void tableAddAll(Table* from, Table* to) {
+void tableAddAll(SplVM* vm, Table* from, Table* to) {
+    for (int i = 0; i < from->oldCapacity; i++) {
+        Entry* entry = &from->oldEntries[i];
+        if (CTRL_IS_FULL(from->oldControl[i])) {
+            tableSet(vm, to, entry->key, entry->value);
+        }
+    }
     for (int i = 0; i < from->capacity; i++) {
         Entry* entry = &from->entries[i];
-        if (entry->key != NULL) {
-            tableSet(to, entry->key, entry->value);
+        if (CTRL_IS_FULL(from->control[i])) {
+            tableSet(vm, to, entry->key, entry->value);
         }
     }
 }
 
-ObjString* tableFindString(Table* table, const char* chars, int length, uint32_t hash) {
-    if (table->count == 0) return NULL;
+static inline uint64_t load64(const char* p) {
+    uint64_t v;
+    memcpy(&v, p, 8);
+    return v;
+}
 
-    uint32_t index = hash % table->capacity;
-    
-    for(;;) {
-        Entry* entry = &table->entries[index];
-        if (entry->key == NULL) {
-            // Stop if we find an empty non-tombstone entry
-            if (IS_NIL(entry->value)) return NULL;
-        } else if (entry->key->length == length && 
-                entry->key->hash == hash && 
-                memcmp(entry->key->chars, chars, length) == 0) {
-            // Found String
-            return entry->key;
+static inline uint32_t load32(const char* p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+// Most names are short. Up to 16 bytes are compared with two
+// overlapping word loads instead of a call to memcmp(), which is
+// already vectorized for longer strings.
+static inline bool charsEqual(const char* a, const char* b, int length) {
+    if (length >= 8) {
+        if (length > 16) return memcmp(a, b, length) == 0;
+        return ((load64(a) ^ load64(b)) |
+                (load64(a + length - 8) ^ load64(b + length - 8))) == 0;
+    }
+    if (length >= 4) {
+        return ((load32(a) ^ load32(b)) |
+                (load32(a + length - 4) ^ load32(b + length - 4))) == 0;
+    }
+    for (int i = 0; i < length; i++) {
+        if (a[i] != b[i]) return false;
+    }
+    return true;
+}
+
+static ObjString* findString(Entry* entries, int8_t* controls, int capacity,
+                             const char* chars, int length, uint32_t hash) {
+    FOR_EACH_GROUP(capacity, hash, group) {
+        int base = (int)group * TABLE_GROUP_WIDTH;
+        Group control = loadGroup(controls + base);
+        for (uint32_t bits = matchByte(control, HASH_TAG(hash)); bits != 0; bits &= bits - 1) {
+            ObjString* key = entries[base + __builtin_ctz(bits)].key;
+            if (key->hash == hash && key->length == length &&
+                    charsEqual(key->chars, chars, length)) {
+                return key;
+            }
         }
-        index = (index + 1 ) % table->capacity;
+        if (matchByte(control, CTRL_EMPTY) != 0) return NULL;
     }
-}
\ No newline at end of file
+}
+
+ObjString* tableFindString(Table* table, const char* chars, int length, uint32_t hash) {
+    if (table->count == 0) return NULL;
+
+    ObjString* key = findString(table->entries, table->control, table->capacity,
+                                chars, length, hash);
+    if (key != NULL || table->oldCapacity == 0) return key;
+    return findString(table->oldEntries, table->oldControl, table->oldCapacity,
+                      chars, length, hash);
+}
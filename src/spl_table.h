@@ -4,6 +4,25 @@
 #include "spl_common.h"
 #include "spl_value.h"
 
+// Open addressing over groups of TABLE_GROUP_WIDTH slots. control has
+// one byte per slot: CTRL_EMPTY, CTRL_DELETED (a tombstone) or the low
+// seven bits of the key's hash, so one compare checks a whole group for
+// a key before any entry is touched. An entry is only valid while its
+// control byte is CTRL_IS_FULL; the others are never initialized, so
+// growing only has to clear the control bytes. capacity is zero or a
+// power of two no smaller than a group, and both arrays share one
+// allocation.
+//
+// Growing does not move the entries at once. The previous arrays stay
+// behind as oldEntries/oldControl, every insert moves the next
+// 'migrated' group of them over, and lookups check both until the old
+// arrays are empty and freed. count covers both arrays, tombstones only
+// the current one.
+#define TABLE_GROUP_WIDTH 16
+#define CTRL_EMPTY ((int8_t)-128)
+#define CTRL_DELETED ((int8_t)-2)
+#define CTRL_IS_FULL(control) ((control) >= 0)
+
 typedef struct {
     ObjString* key;
     Value value;
@@ -11,16 +30,22 @@ typedef struct {
 
 typedef struct {
     int count;
+    int tombstones;
     int capacity;
     Entry* entries;
+    int8_t* control;
+    int oldCapacity;
+    Entry* oldEntries;
+    int8_t* oldControl;
+    int migrated;
 } Table;
 
 void initTable(Table* table);
-void freeTable(Table* table);
+void freeTable(SplVM* vm, Table* table);
 bool tableGet(Table* table, ObjString* key, Value* value);
-bool tableSet(Table* table, ObjString* key, Value value);
+bool tableSet(SplVM* vm, Table* table, ObjString* key, Value value);
 bool tableDelete(Table* table, ObjString* key);
-void tableAddAll(Table* from, Table* to);
+void tableAddAll(SplVM* vm, Table* from, Table* to);
 ObjString* tableFindString(Table* table, const char* chars, int length, uint32_t hash);
 
 #endif
\ No newline at end of file
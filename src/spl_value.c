@@ -6,17 +6,35 @@
 #include "spl_value.h"
 
 
+// Runtime strings are not interned, so two string objects can still
+// hold the same characters.
+static bool stringsEqual(Value a, Value b) {
+	if (!IS_STRING(a) || !IS_STRING(b)) return false;
+	ObjString* x = AS_STRING(a);
+	ObjString* y = AS_STRING(b);
+	if (x->interned && y->interned) return false;
+	return x->length == y->length && memcmp(x->chars, y->chars, x->length) == 0;
+}
+
 bool valuesEqual(Value a, Value b) {
+#ifdef NAN_BOXING
+	if (IS_NUMBER(a) && IS_NUMBER(b)) {
+		return AS_NUMBER(a) == AS_NUMBER(b);
+	}
+	return a == b || stringsEqual(a, b);
+#else
 	if (a.type != b.type) return false;
 	switch(a.type) {
 		case VAL_BOOL: return AS_BOOL(a) == AS_BOOL(b);
 		case VAL_NIL: return true;
+		case VAL_UNDEFINED: return true;
 		case VAL_NUMBER: return AS_NUMBER(a) == AS_NUMBER(b);
-		case VAL_OBJ: return AS_OBJ(a) == AS_OBJ(b);
+		case VAL_OBJ: return AS_OBJ(a) == AS_OBJ(b) || stringsEqual(a, b);
 		default:
 			return false; // Unreachable
 
 	}
+#endif
 
 }
 
@@ -26,23 +44,34 @@ void initValueArray(ValueArray* array) {
     array->count = 0;
 }
 
-void writeValueArray(ValueArray* array, Value value) {
+void writeValueArray(SplVM* vm, ValueArray* array, Value value) {
     if(array->capacity < array->count + 1) {
         int oldCapacity = array->capacity;
         array->capacity = GROW_CAPACITY(oldCapacity);
-        array->values = GROW_ARRAY(Value, array->values,
+        array->values = GROW_ARRAY(vm, Value, array->values,
                              oldCapacity, array->capacity);
     }
     array->values[array->count] = value;
     array->count++;
 }
 
-void freeValueArray(ValueArray* array) {
-    FREE_ARRAY(Value, array->values, array->capacity);
+void freeValueArray(SplVM* vm, ValueArray* array) {
+    FREE_ARRAY(vm, Value, array->values, array->capacity);
     initValueArray(array);
 }
 
 void printValue(Value value) {
+#ifdef NAN_BOXING
+	if (IS_BOOL(value)) {
+		printf(AS_BOOL(value) ? "true" : "false");
+	} else if (IS_NIL(value)) {
+		printf("nil");
+	} else if (IS_NUMBER(value)) {
+		printf("%g", AS_NUMBER(value));
+	} else if (IS_OBJ(value)) {
+		printObject(value);
+	}
+#else
     switch(value.type) {
 		case VAL_BOOL:
 			printf(AS_BOOL(value) ? "true" : "false");
@@ -50,6 +79,8 @@ void printValue(Value value) {
 		case VAL_NIL: printf("nil"); break;
 		case VAL_NUMBER: printf("%g", AS_NUMBER(value)); break;
 		case VAL_OBJ: printObject(value); break;
+		case VAL_UNDEFINED: printf("undefined"); break;
 	}
+#endif
 
 }
\ No newline at end of file
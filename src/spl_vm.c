@@ -1,5 +1,7 @@
+#include <limits.h>
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "spl_common.h"
@@ -8,54 +10,185 @@
 #include "spl_vm.h"
 #include "spl_compiler.h"
 #include "spl_debug.h"
+#include "spl_peephole.h"
+#include "spl_register.h"
+#include "spl_jit.h"
 
 
-VM vm;
-
-static void resetStack() {
-    vm.stackTop = vm.stack;
+static void resetStack(SplVM* vm) {
+    vm->stackTop = vm->stack;
 }
 
-static void runtimeError(const char * format, ... ) {
+static void runtimeError(SplVM* vm, const char * format, ... ) {
 	va_list args;
 	va_start(args, format);
 	vfprintf(stderr, format, args);
 	va_end(args);
 	fputs("\n", stderr);
 
-	size_t instruction = vm.ip - vm.chunk->code - 1;
-	int line = getLine(&(vm.chunk->lines), instruction);
+	size_t instruction = vm->ip - vm->chunk->code - 1;
+	int line = getLine(&(vm->chunk->lines), instruction);
 	fprintf(stderr, "[line %d] in script\n", line);
 	
 
-	resetStack();
+	resetStack(vm);
+}
+
+// Everything resetVM() starts over with; the configuration fields are
+// left alone.
+static void initHeap(SplVM* vm) {
+    vm->chunk = NULL;
+    vm->compilingChunk = NULL;
+    vm->compiler = NULL;
+    vm->bytesAllocated = 0;
+    vm->nextGC = GC_INITIAL_HEAP;
+    vm->gcPhase = GC_IDLE;
+    vm->gcMarkBit = true;
+    vm->gcAllocations = 0;
+    vm->gcGlobalNames.array = NULL;
+    vm->gcGlobalValues.array = NULL;
+    vm->gcConstants.array = NULL;
+    vm->gcCompilingConstants.array = NULL;
+    vm->gcSweepIndex = 0;
+    vm->gcSweepCapacity = 0;
+    vm->gcSweepCursor = NULL;
+    vm->grayCount = 0;
+    vm->grayCapacity = 0;
+    vm->grayStack = NULL;
+#ifdef SPL_POOL
+    initPool(&vm->pool);
+#endif
+    vm->arenaTop = 0;
+    vm->arenaFree = NULL;
+    vm->outOfMemory = false;
+    vm->errorJump = NULL;
+    vm->nursery = NULL;
+    vm->nurseryTop = 0;
+    memset(&vm->gcPauses, 0, sizeof(vm->gcPauses));
+    memset(&vm->memStats, 0, sizeof(vm->memStats));
+    vm->stack = NULL;
+    vm->stackCapacity = 0;
+    resetStack(vm);
+	vm->objects = NULL;
+#ifdef SPL_JIT
+	vm->jit = NULL;
+	initJit(vm, &vm->jitState, NULL, NULL);
+#endif
+	initTable(&vm->globalSlots);
+	initValueArray(&vm->globalNames);
+	initValueArray(&vm->globalValues);
+	vm->youngGlobals = NULL;
+	vm->rememberedGlobals = NULL;
+	vm->youngGlobalCount = 0;
+	vm->youngGlobalCapacity = 0;
+	initTable(&vm->strings);
+}
+
+// In arena mode every block but the gray stack lives in the arena, so
+// there is nothing to walk.
+static void freeHeap(SplVM* vm) {
+	if (vm->arena != NULL) {
+		free(vm->grayStack);
+		return;
+	}
+	freeTable(vm, &vm->globalSlots);
+	freeValueArray(vm, &vm->globalNames);
+	freeValueArray(vm, &vm->globalValues);
+	FREE_ARRAY(vm, int, vm->youngGlobals, vm->youngGlobalCapacity);
+	FREE_ARRAY(vm, bool, vm->rememberedGlobals, vm->youngGlobalCapacity);
+	freeTable(vm, &vm->strings);
+	freeObjects(vm);
+	FREE_ARRAY(vm, Value, vm->stack, vm->stackCapacity);
+	vm->stack = NULL;
+	vm->stackCapacity = 0;
+#ifdef SPL_POOL
+	freePool(&vm->pool);
+#endif
+}
+
+void initVM(SplVM* vm) {
+    vm->arena = NULL;
+    vm->arenaLimit = 0;
+    vm->gcStepInterval = 16;
+    vm->gcStepWork = 4096;
+    vm->gcPauseLimit = 500000;
+	vm->useRegisters = false;
+	vm->useJit = false;
+	vm->optimize = false;
+	initHeap(vm);
+}
+
+void freeVM(SplVM* vm) {
+	freeHeap(vm);
+	free(vm->arena);
+	vm->arena = NULL;
+	vm->arenaLimit = 0;
+}
+
+void resetVM(SplVM* vm) {
+	freeHeap(vm);
+	initHeap(vm);
 }
 
-void initVM() {
-    resetStack();
-	vm.objects = NULL;
-	initTable(&vm.globals);
-	initTable(&vm.strings);
+int globalSlot(SplVM* vm, ObjString* name) {
+	Value slot;
+	if (tableGet(&vm->globalSlots, name, &slot)) {
+		return (int)AS_NUMBER(slot);
+	}
+	push(vm, OBJ_VAL(name));
+	WRITE_BARRIER(vm, OBJ_VAL(name));
+	writeValueArray(vm, &vm->globalNames, OBJ_VAL(name));
+	writeValueArray(vm, &vm->globalValues, UNDEFINED_VAL);
+	if (vm->youngGlobalCapacity < vm->globalValues.capacity) {
+		int oldCapacity = vm->youngGlobalCapacity;
+		vm->youngGlobalCapacity = vm->globalValues.capacity;
+		vm->youngGlobals = GROW_ARRAY(vm, int, vm->youngGlobals,
+		                              oldCapacity, vm->youngGlobalCapacity);
+		vm->rememberedGlobals = GROW_ARRAY(vm, bool, vm->rememberedGlobals,
+		                                   oldCapacity, vm->youngGlobalCapacity);
+		for (int i = oldCapacity; i < vm->youngGlobalCapacity; i++) {
+			vm->rememberedGlobals[i] = false;
+		}
+	}
+	tableSet(vm, &vm->globalSlots, name, NUMBER_VAL(vm->globalValues.count - 1));
+	pop(vm);
+	return vm->globalValues.count - 1;
 }
 
-void freeVM() {
-	freeTable(&vm.globals);
-	freeTable(&vm.strings);
-	freeObjects();
+// Makes room for 'slots' values plus STACK_RESERVE, reporting an error
+// if that exceeds STACK_MAX.
+static bool ensureStack(SplVM* vm, int slots) {
+	slots += STACK_RESERVE;
+	if (slots > STACK_MAX) {
+		fprintf(stderr, "Stack overflow: the script needs %d stack slots, "
+				"the limit is %d.\n", slots, STACK_MAX);
+		return false;
+	}
+	if (slots <= vm->stackCapacity) return true;
+
+	int oldCapacity = vm->stackCapacity;
+	int depth = (int)(vm->stackTop - vm->stack);
+	vm->stackCapacity = oldCapacity;
+	while (vm->stackCapacity < slots) {
+		vm->stackCapacity = GROW_CAPACITY(vm->stackCapacity);
+	}
+	vm->stack = GROW_ARRAY(vm, Value, vm->stack, oldCapacity, vm->stackCapacity);
+	vm->stackTop = vm->stack + depth;
+	return true;
 }
 
-void push(Value value) {
-    *vm.stackTop = value;
-    vm.stackTop++;
+void push(SplVM* vm, Value value) {
+    *vm->stackTop = value;
+    vm->stackTop++;
 }
 
-Value pop() {
-    vm.stackTop--;
-    return *vm.stackTop;
+Value pop(SplVM* vm) {
+    vm->stackTop--;
+    return *vm->stackTop;
 }
 
-static Value peek(int distance) {
-	return vm.stackTop[-1 - distance];
+static Value peek(SplVM* vm, int distance) {
+	return vm->stackTop[-1 - distance];
 
 }
 
@@ -65,218 +198,603 @@ static bool isFalsey(Value value) {
 
 }
 
-static void concatenate() {
-	ObjString* b = AS_STRING(pop());
-	ObjString* a = AS_STRING(pop());
-	int length = a->length + b->length;
-	char* chars = ALLOCATE(char, length + 1);
-	memcpy(chars, a->chars, a->length);
-	memcpy(chars + a->length, b->chars, b->length);
-	chars[length] = '\0';
-
-	ObjString* result = takeString(chars, length);
-	push(OBJ_VAL(result));
+// Copies the strings 'left' and 'right' slots below the top of the stack
+// into a new string. A minor collection moves young operands, so they
+// are only read once it is allocated.
+static ObjString* joinStrings(SplVM* vm, int left, int right) {
+	int length = AS_STRING(peek(vm, left))->length + AS_STRING(peek(vm, right))->length;
+	ObjString* result = reserveString(vm, length);
+	ObjString* b = AS_STRING(peek(vm, right));
+	ObjString* a = AS_STRING(peek(vm, left));
+	memcpy(result->chars, a->chars, a->length);
+	memcpy(result->chars + a->length, b->chars, b->length);
+	result->chars[length] = '\0';
+	return result;
 }
 
-static InterpretResult run() {
-#define READ_BYTE() (*vm.ip++)
-#define READ_CONSTANT() (vm.chunk->constants.values[READ_BYTE()])
-#define READ_LONG_CONSTANT(byteArray) \
-        (vm.chunk->constants.values[CONVERT_BYTE_ARRAY_TO_INT(byteArray,4)])
-#define READ_SHORT() \
-		(vm.ip += 2, (uint16_t) ((vm.ip[-2] << 8) | vm.ip[-1]))
-#define READ_STRING() AS_STRING(READ_CONSTANT())
-#define READ_STRING_LONG(byteArray) AS_STRING(READ_LONG_CONSTANT(byteArray))
-#define BINARY_OP(valueType, op) \
+static int textLength(Value value) {
+	return IS_ROPE(value) ? AS_ROPE(value)->length : AS_STRING(value)->length;
+}
+
+// Leaves both operands on the stack until the result exists, so a
+// collection while allocating it cannot free them. Short results are
+// copied; longer ones become ropes, so that building a string piece by
+// piece does not copy it over and over.
+//
+// Returns false, with the operands still on the stack, if the result
+// would be longer than INT_MAX. Every string and rope is built here, so
+// joinStrings(), initRope() and flattenRope() can count in int.
+static bool concatenate(SplVM* vm) {
+	for (int i = 0; i < 2; i++) {
+		Value* slot = &vm->stackTop[-1 - i];
+		if (IS_ROPE(*slot) && AS_ROPE(*slot)->flat != NULL) {
+			*slot = OBJ_VAL(AS_ROPE(*slot)->flat);
+		}
+	}
+
+	int64_t length = (int64_t)textLength(peek(vm, 0)) + textLength(peek(vm, 1));
+	if (length > INT_MAX) return false;
+
+	Value result;
+	if (length < ROPE_MIN_LENGTH) {
+		// Ropes are never this short.
+		result = OBJ_VAL(joinStrings(vm, 1, 0));
+	} else if (IS_ROPE(peek(vm, 1)) && IS_STRING(peek(vm, 0)) &&
+			AS_ROPE(peek(vm, 1))->right->type == OBJ_STRING &&
+			((ObjString*)AS_ROPE(peek(vm, 1))->right)->length +
+				AS_STRING(peek(vm, 0))->length < ROPE_MIN_LENGTH) {
+		// Appending in small pieces: grow the rope's last leaf instead of
+		// adding a node per piece.
+		push(vm, OBJ_VAL(AS_ROPE(peek(vm, 1))->right));
+		vm->stackTop[-1] = OBJ_VAL(joinStrings(vm, 0, 1));
+		ObjRope* rope = reserveRope(vm);
+		initRope(vm, rope, AS_ROPE(peek(vm, 2))->left, AS_OBJ(peek(vm, 0)));
+		pop(vm);
+		result = OBJ_VAL(rope);
+	} else {
+		ObjRope* rope = reserveRope(vm);
+		initRope(vm, rope, AS_OBJ(peek(vm, 1)), AS_OBJ(peek(vm, 0)));
+		result = OBJ_VAL(rope);
+	}
+	pop(vm);
+	pop(vm);
+	push(vm, result);
+	return true;
+}
+
+// Adds the two values on top of the stack, returning false if their
+// types cannot be added or the string would be too long.
+bool addValues(SplVM* vm) {
+	if (IS_TEXT(peek(vm, 0)) && IS_TEXT(peek(vm, 1))) {
+		return concatenate(vm);
+	} else if (IS_NUMBER(peek(vm, 0)) && IS_NUMBER(peek(vm, 1))) {
+		double b = AS_NUMBER(pop(vm));
+		double a = AS_NUMBER(pop(vm));
+		push(vm, NUMBER_VAL(a+b));
+	} else {
+		return false;
+	}
+	return true;
+}
+
+// Why addValues() failed on the two values on top of the stack.
+static const char* addError(SplVM* vm) {
+	if (IS_TEXT(peek(vm, 0)) && IS_TEXT(peek(vm, 1))) return "String too long.";
+	return "Operands must be two numbers or two strings";
+}
+
+#define GLOBAL_NAME(slot) AS_STRING(vm->globalNames.values[slot])
+
+static InterpretResult run(SplVM* vm, DecodedChunk* decoded) {
+    // The instruction pointer lives in a local so the compiler can keep it
+    // in a register. It always points one past the executing instruction;
+    // runtime errors map it back to a byte offset for the line number.
+    Instruction* code = decoded->code;
+    Instruction* ip = code;
+
+#define OPERAND() (ip[-1].a)
+#define READ_CONSTANT() (vm->chunk->constants.values[OPERAND()])
+#define RUNTIME_ERROR(...) \
         do { \
-			if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) { \
-				runtimeError("Operands must be numbers."); \
-				return INTERPRET_RUNTIME_ERROR; \
+            vm->ip = vm->chunk->code + decoded->offsets[ip - 1 - code] + 1; \
+            runtimeError(vm, __VA_ARGS__); \
+            return INTERPRET_RUNTIME_ERROR; \
+        } while (false)
+// Once an arithmetic or comparison opcode has seen number operands it
+// rewrites itself into its *_NUM form. That form only guards the operand
+// types and turns back into the generic opcode if the guard fails.
+#define QUICKEN(quickened) (ip[-1].op = (quickened))
+#define DEQUICKEN(generic) ip--; ip->op = (generic); NEXT()
+#define BINARY_OP(valueType, op, quickened) \
+        do { \
+			if (!IS_NUMBER(peek(vm, 0)) || !IS_NUMBER(peek(vm, 1))) { \
+				RUNTIME_ERROR("Operands must be numbers."); \
 			}\
-            double b = AS_NUMBER(pop()); \
-            double a = AS_NUMBER(pop()); \
-            push(valueType(a op b)); \
+            QUICKEN(quickened); \
+            double b = AS_NUMBER(pop(vm)); \
+            double a = AS_NUMBER(pop(vm)); \
+            push(vm, valueType(a op b)); \
         } while(false) \
 
-    for (;;) {
-#ifdef DEBUG_TRACE_EXECUTION
-        printf("           ");
-        for (Value* slot = vm.stack; slot < vm.stackTop; slot++) {
-            printf("[ ");
-            printValue(*slot);
-            printf(" ]");
+#define BINARY_NUM_OP(valueType, op, generic) \
+        { \
+            Value b = peek(vm, 0); \
+            Value a = peek(vm, 1); \
+            if (!IS_NUMBER(a) || !IS_NUMBER(b)) { \
+                DEQUICKEN(generic); \
+            } \
+            vm->stackTop[-2] = valueType(AS_NUMBER(a) op AS_NUMBER(b)); \
+            vm->stackTop--; \
         }
-        printf("\n");
-        disassembleInstruction(vm.chunk,
-        (int)(vm.ip - vm.chunk->code));
+
+#define NOT_COMPARE_OP(op) \
+        do { \
+			if (!IS_NUMBER(peek(vm, 0)) || !IS_NUMBER(peek(vm, 1))) { \
+				RUNTIME_ERROR("Operands must be numbers."); \
+			}\
+            double b = AS_NUMBER(pop(vm)); \
+            double a = AS_NUMBER(pop(vm)); \
+            push(vm, BOOL_VAL(!(a op b))); \
+        } while(false)
+#define JUMP_IF(condition) \
+        do { \
+			if (!IS_NUMBER(peek(vm, 0)) || !IS_NUMBER(peek(vm, 1))) { \
+				RUNTIME_ERROR("Operands must be numbers."); \
+			}\
+            double b = AS_NUMBER(pop(vm)); \
+            double a = AS_NUMBER(pop(vm)); \
+            if (condition) ip = code + OPERAND(); \
+        } while(false)
+
+#ifdef DEBUG_TRACE_EXECUTION
+#define TRACE_EXECUTION() \
+        do { \
+            printf("           "); \
+            for (Value* slot = vm->stack; slot < vm->stackTop; slot++) { \
+                printf("[ "); \
+                printValue(*slot); \
+                printf(" ]"); \
+            } \
+            printf("\n"); \
+            disassembleInstruction(vm, vm->chunk, decoded->offsets[ip - code]); \
+        } while (false)
+#else
+#define TRACE_EXECUTION() do { } while (false)
 #endif
-        uint8_t instruction;
-        switch (instruction = READ_BYTE())
+
+#ifdef SPL_COMPUTED_GOTO
+    // One indirect jump per handler instead of a single shared one at
+    // the top of the switch, so the branch predictor sees each opcode's
+    // successor separately.
+    static void* dispatchTable[] = {
+#define SPL_OPCODE_LABEL(name) &&TARGET_##name,
+        SPL_OPCODES(SPL_OPCODE_LABEL)
+#undef SPL_OPCODE_LABEL
+    };
+#define DISPATCH() \
+        do { \
+            TRACE_EXECUTION(); \
+            goto *dispatchTable[(ip++)->op]; \
+        } while (false)
+#define CASE(name) TARGET_##name
+#define NEXT() DISPATCH()
+
+    DISPATCH();
+#else
+#define CASE(name) case name
+#define NEXT() break
+
+    for (;;) {
+        TRACE_EXECUTION();
+        switch ((ip++)->op)
         {
-            case OP_CONSTANT_LONG:
-                uint8_t byteArray[CONSTANT_LONG_BYTE_SIZE];
-                for (int i = 0; i< CONSTANT_LONG_BYTE_SIZE; i++)
-                    byteArray[i] = READ_BYTE();
-                Value longConstant = READ_LONG_CONSTANT(byteArray);
-                push(longConstant);
-                break;
-            case OP_CONSTANT: 
-                Value constant = READ_CONSTANT();
-                push(constant);
-                break;
-			case OP_NIL: push(NIL_VAL); break;
-			case OP_TRUE: push(BOOL_VAL(true)); break;
-			case OP_FALSE: push(BOOL_VAL(false)); break;
-			case OP_POP: pop(); break;
-			case OP_GET_LOCAL: {
-				uint8_t slot = READ_BYTE();
-				push(vm.stack[slot]);
-				break;
-			}
-			case OP_SET_LOCAL: {
-				uint8_t slot = READ_BYTE();
-				vm.stack[slot] = peek(0);
-				break;
-			}
-			case OP_GET_GLOBAL: {
-				ObjString* name = READ_STRING();
-				Value value;
-				if (!tableGet(&vm.globals, name, &value)) {
-					runtimeError("Undefined variable '%s'.", name->chars);
-					return INTERPRET_RUNTIME_ERROR;
+#endif
+            // decodeChunk() rewrites the *_LONG opcodes to their short
+            // forms, so they share a handler.
+            CASE(OP_CONSTANT_LONG):
+            CASE(OP_CONSTANT): push(vm, READ_CONSTANT()); NEXT();
+			CASE(OP_NIL): push(vm, NIL_VAL); NEXT();
+			CASE(OP_TRUE): push(vm, BOOL_VAL(true)); NEXT();
+			CASE(OP_FALSE): push(vm, BOOL_VAL(false)); NEXT();
+			CASE(OP_POP): pop(vm); NEXT();
+			CASE(OP_GET_LOCAL_LONG):
+			CASE(OP_GET_LOCAL): push(vm, vm->stack[OPERAND()]); NEXT();
+			CASE(OP_SET_LOCAL_LONG):
+			CASE(OP_SET_LOCAL): vm->stack[OPERAND()] = peek(vm, 0); NEXT();
+			CASE(OP_GET_GLOBAL_LONG):
+			CASE(OP_GET_GLOBAL): {
+				int slot = OPERAND();
+				Value value = vm->globalValues.values[slot];
+				if (IS_UNDEFINED(value)) {
+					RUNTIME_ERROR("Undefined variable '%s'.", GLOBAL_NAME(slot)->chars);
 				}
-				push(value);
-				break;
+				push(vm, value);
+				NEXT();
 			}
-			case OP_GET_GLOBAL_LONG: {
-				uint8_t byteArray[CONSTANT_LONG_BYTE_SIZE];
-                for (int i = 0; i < CONSTANT_LONG_BYTE_SIZE; i++)
-                    byteArray[i] = READ_BYTE();
-				ObjString* name = READ_STRING_LONG(byteArray);
-				Value value;
-				if (!tableGet(&vm.globals, name, &value)) {
-					runtimeError("Undefined variable '%s'.", name->chars);
-					return INTERPRET_RUNTIME_ERROR;
+			CASE(OP_DEFINE_GLOBAL_LONG):
+			CASE(OP_DEFINE_GLOBAL):
+				GLOBAL_BARRIER(vm, OPERAND(), peek(vm, 0));
+				vm->globalValues.values[OPERAND()] = pop(vm);
+				NEXT();
+			CASE(OP_SET_GLOBAL_LONG):
+			CASE(OP_SET_GLOBAL): {
+				int slot = OPERAND();
+				if (IS_UNDEFINED(vm->globalValues.values[slot])) {
+					RUNTIME_ERROR("Undefined variable '%s'.", GLOBAL_NAME(slot)->chars);
 				}
-				push(value);
-				break;
+				GLOBAL_BARRIER(vm, slot, peek(vm, 0));
+				vm->globalValues.values[slot] = peek(vm, 0);
+				NEXT();
 			}
-			case OP_DEFINE_GLOBAL: {
-				ObjString* name = READ_STRING();
-				tableSet(&vm.globals, name, peek(0));
-				pop();
-				break;
+			CASE(OP_EQUAL): {
+				flattenValue(vm, &vm->stackTop[-1]);
+				flattenValue(vm, &vm->stackTop[-2]);
+				Value b = pop(vm);
+				Value a = pop(vm);
+				push(vm, BOOL_VAL(valuesEqual(a,b)));
+				NEXT();
 			}
-			case OP_DEFINE_GLOBAL_LONG: {
-				uint8_t byteArray[CONSTANT_LONG_BYTE_SIZE];
-                for (int i = 0; i < CONSTANT_LONG_BYTE_SIZE; i++)
-                    byteArray[i] = READ_BYTE();
-				ObjString* name = READ_STRING_LONG(byteArray);
-				tableSet(&vm.globals, name, peek(0));
-				pop();
-                break;
+			CASE(OP_GREATER): BINARY_OP(BOOL_VAL, >, OP_GREATER_NUM); NEXT();
+			CASE(OP_LESS): BINARY_OP(BOOL_VAL, <, OP_LESS_NUM); NEXT();
+			CASE(OP_ADD): {
+				if (IS_NUMBER(peek(vm, 0)) && IS_NUMBER(peek(vm, 1))) QUICKEN(OP_ADD_NUM);
+				if (!addValues(vm)) RUNTIME_ERROR("%s", addError(vm));
+				NEXT();
 			}
-			case OP_SET_GLOBAL: {
-				ObjString* name = READ_STRING();
-				if (tableSet(&vm.globals, name, peek(0))) {
-					tableDelete(&vm.globals, name);
-					runtimeError("Undefined variable '%s'.", name->chars);
-					return INTERPRET_RUNTIME_ERROR;
+			CASE(OP_SUBTRACT): BINARY_OP(NUMBER_VAL, -, OP_SUBTRACT_NUM); NEXT();
+            CASE(OP_MULTIPLY): BINARY_OP(NUMBER_VAL, *, OP_MULTIPLY_NUM); NEXT();
+            CASE(OP_DIVIDE): BINARY_OP(NUMBER_VAL, /, OP_DIVIDE_NUM); NEXT();
+			CASE(OP_NOT): push(vm, BOOL_VAL(isFalsey(pop(vm)))); NEXT();
+            CASE(OP_NEGATE):
+				if (!IS_NUMBER(peek(vm, 0))) {
+					RUNTIME_ERROR("Operand must be a number.");
 				}
-				break;
+				push(vm, NUMBER_VAL(-AS_NUMBER(pop(vm))));
+				NEXT();
+			CASE(OP_PRINT): {
+				flattenValue(vm, &vm->stackTop[-1]);
+				printValue(pop(vm));
+				printf("\n");
+				NEXT();
 			}
-			case OP_SET_GLOBAL_LONG: {
-				uint8_t byteArray[CONSTANT_LONG_BYTE_SIZE];
-                for (int i = 0; i < CONSTANT_LONG_BYTE_SIZE; i++)
-                    byteArray[i] = READ_BYTE();
-				ObjString* name = READ_STRING_LONG(byteArray);
-				if (tableSet(&vm.globals, name, peek(0))) {
-					tableDelete(&vm.globals, name);
-					runtimeError("Undefined variable '%s'.", name->chars);
-					return INTERPRET_RUNTIME_ERROR;
+			CASE(OP_JUMP): ip = code + OPERAND(); NEXT();
+			CASE(OP_JUMP_IF_FALSE):
+				if (isFalsey(peek(vm, 0))) ip = code + OPERAND();
+				NEXT();
+			CASE(OP_LOOP): {
+#ifdef SPL_JIT
+				if (vm->jit != NULL) {
+					int resume = jitLoop(vm->jit, OPERAND(), (int)(ip - code));
+					if (resume >= 0) {
+						ip = code + resume;
+						NEXT();
+					}
 				}
-				break;
-			}
-			case OP_EQUAL: {
-				Value b = pop();
-				Value a = pop();
-				push(BOOL_VAL(valuesEqual(a,b)));
-				break;
+#endif
+				ip = code + OPERAND();
+				NEXT();
 			}
-			case OP_GREATER: BINARY_OP(BOOL_VAL, >); break;
-			case OP_LESS: BINARY_OP(BOOL_VAL, <); break;
-			case OP_ADD: {
-				if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
-					concatenate();
-				} else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
-					double b = AS_NUMBER(pop());
-					double a = AS_NUMBER(pop());
-					push(NUMBER_VAL(a+b));
-				} else {
-					runtimeError(
-							"Operands must be two numbers or two strings");
-					return INTERPRET_RUNTIME_ERROR;
+            CASE(OP_RETURN):
+				// Exit interpreter
+                return INTERPRET_OK;
+			CASE(OP_NOT_GREATER): NOT_COMPARE_OP(>); NEXT();
+			CASE(OP_NOT_LESS): NOT_COMPARE_OP(<); NEXT();
+			CASE(OP_ADD_LOCAL_CONSTANT): {
+				Value a = vm->stack[OPERAND()];
+				Value b = vm->chunk->constants.values[ip[-1].b];
+				if (IS_NUMBER(a) && IS_NUMBER(b)) {
+					QUICKEN(OP_ADD_LOCAL_CONSTANT_NUM);
+					push(vm, NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b)));
+					NEXT();
 				}
-				break;
+				push(vm, a);
+				push(vm, b);
+				if (!addValues(vm)) RUNTIME_ERROR("%s", addError(vm));
+				NEXT();
 			}
-			case OP_SUBTRACT: BINARY_OP(NUMBER_VAL, -); break;
-            case OP_MULTIPLY: BINARY_OP(NUMBER_VAL, *); break;
-            case OP_DIVIDE: BINARY_OP(NUMBER_VAL, /); break;
-			case OP_NOT: push(BOOL_VAL(isFalsey(pop()))); break;
-            case OP_NEGATE: 
-				if (!IS_NUMBER(peek(0))) {
-					runtimeError("Operand must be a number.");
-					return INTERPRET_RUNTIME_ERROR;
+			CASE(OP_SET_LOCAL_POP): vm->stack[OPERAND()] = pop(vm); NEXT();
+			CASE(OP_SET_GLOBAL_POP): {
+				int slot = OPERAND();
+				if (IS_UNDEFINED(vm->globalValues.values[slot])) {
+					RUNTIME_ERROR("Undefined variable '%s'.", GLOBAL_NAME(slot)->chars);
 				}
-				push(NUMBER_VAL(-AS_NUMBER(pop())));
-				break;
-			case OP_PRINT: {
-				printValue(pop());
-				printf("\n");
-				break;
-			}
-			case OP_JUMP: {
-				uint16_t offset = READ_SHORT();
-				vm.ip += offset;
-				break;
-			}
-			case OP_JUMP_IF_FALSE: {
-				uint16_t offset = READ_SHORT();
-				if (isFalsey(peek(0))) vm.ip += offset;
-				break;
+				GLOBAL_BARRIER(vm, slot, peek(vm, 0));
+				vm->globalValues.values[slot] = pop(vm);
+				NEXT();
 			}
-			case OP_LOOP: {
-				uint16_t offset = READ_SHORT();
-				vm.ip -= offset;
-				break;
+			CASE(OP_JUMP_IF_GREATER): JUMP_IF(a > b); NEXT();
+			CASE(OP_JUMP_IF_NOT_GREATER): JUMP_IF(!(a > b)); NEXT();
+			CASE(OP_JUMP_IF_LESS): JUMP_IF(a < b); NEXT();
+			CASE(OP_JUMP_IF_NOT_LESS): JUMP_IF(!(a < b)); NEXT();
+			CASE(OP_ADD_NUM): BINARY_NUM_OP(NUMBER_VAL, +, OP_ADD); NEXT();
+			CASE(OP_SUBTRACT_NUM): BINARY_NUM_OP(NUMBER_VAL, -, OP_SUBTRACT); NEXT();
+			CASE(OP_MULTIPLY_NUM): BINARY_NUM_OP(NUMBER_VAL, *, OP_MULTIPLY); NEXT();
+			CASE(OP_DIVIDE_NUM): BINARY_NUM_OP(NUMBER_VAL, /, OP_DIVIDE); NEXT();
+			CASE(OP_GREATER_NUM): BINARY_NUM_OP(BOOL_VAL, >, OP_GREATER); NEXT();
+			CASE(OP_LESS_NUM): BINARY_NUM_OP(BOOL_VAL, <, OP_LESS); NEXT();
+			CASE(OP_ADD_LOCAL_CONSTANT_NUM): {
+				Value a = vm->stack[OPERAND()];
+				Value b = vm->chunk->constants.values[ip[-1].b];
+				if (!IS_NUMBER(a) || !IS_NUMBER(b)) {
+					DEQUICKEN(OP_ADD_LOCAL_CONSTANT);
+				}
+				push(vm, NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b)));
+				NEXT();
 			}
-            case OP_RETURN:
-				// Exit interpreter
-                return INTERPRET_OK;
-
+#ifndef SPL_COMPUTED_GOTO
         }
     }
-#undef READ_BYTE
+#endif
+#undef OPERAND
 #undef READ_CONSTANT
-#undef READ_LONG_CONSTANT
-#undef READ_STRING
-#undef READ_SHORT
-#undef READ_STRING_LONG
 #undef BINARY_OP
+#undef QUICKEN
+#undef DEQUICKEN
+#undef BINARY_NUM_OP
+#undef NOT_COMPARE_OP
+#undef JUMP_IF
+#undef RUNTIME_ERROR
+#undef TRACE_EXECUTION
+#undef CASE
+#undef NEXT
+#ifdef SPL_COMPUTED_GOTO
+#undef DISPATCH
+#endif
+}
+
+static InterpretResult runRegisters(SplVM* vm, RegChunk* regChunk) {
+    // Registers first, then the constants; everything above is free for
+    // push() and pop().
+    Value* frame = vm->stack;
+    Value* constants = frame + regChunk->registerCount;
+    // The collector scans the registers before they are all written.
+    for (int i = 0; i < regChunk->registerCount; i++) {
+        frame[i] = NIL_VAL;
+    }
+    for (int i = 0; i < regChunk->constants.count; i++) {
+        constants[i] = regChunk->constants.values[i];
+    }
+    vm->stackTop = constants + regChunk->constants.count;
+
+    RegInstr* code = regChunk->code;
+    RegInstr* ip = code;
+    RegInstr* instr;
+
+#define R(operand) (frame[operand])
+#define RUNTIME_ERROR(...) \
+        do { \
+            vm->ip = vm->chunk->code + regChunk->offsets[instr - code] + 1; \
+            runtimeError(vm, __VA_ARGS__); \
+            return INTERPRET_RUNTIME_ERROR; \
+        } while (false)
+#define CHECK_NUMBERS() \
+        do { \
+            if (!IS_NUMBER(R(instr->b)) || !IS_NUMBER(R(instr->c))) { \
+                RUNTIME_ERROR("Operands must be numbers."); \
+            } \
+        } while (false)
+#define BINARY_OP(valueType, op) \
+        do { \
+            CHECK_NUMBERS(); \
+            R(instr->a) = valueType(AS_NUMBER(R(instr->b)) op AS_NUMBER(R(instr->c))); \
+        } while (false)
+#define BRANCH_IF(condition) \
+        do { \
+            CHECK_NUMBERS(); \
+            if (condition) ip = code + instr->a; \
+        } while (false)
+
+#ifdef DEBUG_TRACE_EXECUTION
+#define TRACE_EXECUTION() disassembleRegisterInstruction(vm, regChunk, (int)(ip - code))
+#else
+#define TRACE_EXECUTION() do { } while (false)
+#endif
+
+#ifdef SPL_COMPUTED_GOTO
+    static void* dispatchTable[] = {
+#define SPL_REG_OPCODE_LABEL(name) &&TARGET_##name,
+        SPL_REG_OPCODES(SPL_REG_OPCODE_LABEL)
+#undef SPL_REG_OPCODE_LABEL
+    };
+#define DISPATCH() \
+        do { \
+            TRACE_EXECUTION(); \
+            instr = ip++; \
+            goto *dispatchTable[instr->op]; \
+        } while (false)
+#define CASE(name) TARGET_##name
+#define NEXT() DISPATCH()
+
+    DISPATCH();
+#else
+#define CASE(name) case name
+#define NEXT() break
+
+    for (;;) {
+        TRACE_EXECUTION();
+        instr = ip++;
+        switch (instr->op)
+        {
+#endif
+            CASE(ROP_MOVE): R(instr->a) = R(instr->b); NEXT();
+            CASE(ROP_GET_GLOBAL): {
+                Value value = vm->globalValues.values[instr->b];
+                if (IS_UNDEFINED(value)) {
+                    RUNTIME_ERROR("Undefined variable '%s'.", GLOBAL_NAME(instr->b)->chars);
+                }
+                R(instr->a) = value;
+                NEXT();
+            }
+            CASE(ROP_DEFINE_GLOBAL):
+                GLOBAL_BARRIER(vm, instr->b, R(instr->c));
+                vm->globalValues.values[instr->b] = R(instr->c);
+                NEXT();
+            CASE(ROP_SET_GLOBAL):
+                if (IS_UNDEFINED(vm->globalValues.values[instr->b])) {
+                    RUNTIME_ERROR("Undefined variable '%s'.", GLOBAL_NAME(instr->b)->chars);
+                }
+                GLOBAL_BARRIER(vm, instr->b, R(instr->c));
+                vm->globalValues.values[instr->b] = R(instr->c);
+                NEXT();
+            CASE(ROP_EQUAL):
+                flattenValue(vm, &R(instr->b));
+                flattenValue(vm, &R(instr->c));
+                R(instr->a) = BOOL_VAL(valuesEqual(R(instr->b), R(instr->c)));
+                NEXT();
+            CASE(ROP_GREATER): BINARY_OP(BOOL_VAL, >); NEXT();
+            CASE(ROP_LESS): BINARY_OP(BOOL_VAL, <); NEXT();
+            CASE(ROP_NOT): R(instr->a) = BOOL_VAL(isFalsey(R(instr->b))); NEXT();
+            CASE(ROP_NEGATE):
+                if (!IS_NUMBER(R(instr->b))) {
+                    RUNTIME_ERROR("Operand must be a number.");
+                }
+                R(instr->a) = NUMBER_VAL(-AS_NUMBER(R(instr->b)));
+                NEXT();
+            CASE(ROP_ADD): {
+                Value b = R(instr->c);
+                Value a = R(instr->b);
+                if (IS_NUMBER(a) && IS_NUMBER(b)) {
+                    R(instr->a) = NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b));
+                } else if (IS_TEXT(a) && IS_TEXT(b)) {
+                    push(vm, a);
+                    push(vm, b);
+                    if (!concatenate(vm)) RUNTIME_ERROR("String too long.");
+                    R(instr->a) = pop(vm);
+                } else {
+                    RUNTIME_ERROR("Operands must be two numbers or two strings");
+                }
+                NEXT();
+            }
+            CASE(ROP_SUBTRACT): BINARY_OP(NUMBER_VAL, -); NEXT();
+            CASE(ROP_MULTIPLY): BINARY_OP(NUMBER_VAL, *); NEXT();
+            CASE(ROP_DIVIDE): BINARY_OP(NUMBER_VAL, /); NEXT();
+            CASE(ROP_PRINT):
+                flattenValue(vm, &R(instr->b));
+                printValue(R(instr->b));
+                printf("\n");
+                NEXT();
+            CASE(ROP_JUMP): ip = code + instr->a; NEXT();
+            CASE(ROP_JUMP_IF_FALSE):
+                if (isFalsey(R(instr->b))) ip = code + instr->a;
+                NEXT();
+            CASE(ROP_JUMP_IF_EQUAL):
+                flattenValue(vm, &R(instr->b));
+                flattenValue(vm, &R(instr->c));
+                if (valuesEqual(R(instr->b), R(instr->c))) ip = code + instr->a;
+                NEXT();
+            CASE(ROP_JUMP_IF_NOT_EQUAL):
+                flattenValue(vm, &R(instr->b));
+                flattenValue(vm, &R(instr->c));
+                if (!valuesEqual(R(instr->b), R(instr->c))) ip = code + instr->a;
+                NEXT();
+            CASE(ROP_JUMP_IF_GREATER):
+                BRANCH_IF(AS_NUMBER(R(instr->b)) > AS_NUMBER(R(instr->c)));
+                NEXT();
+            CASE(ROP_JUMP_IF_NOT_GREATER):
+                BRANCH_IF(!(AS_NUMBER(R(instr->b)) > AS_NUMBER(R(instr->c))));
+                NEXT();
+            CASE(ROP_JUMP_IF_LESS):
+                BRANCH_IF(AS_NUMBER(R(instr->b)) < AS_NUMBER(R(instr->c)));
+                NEXT();
+            CASE(ROP_JUMP_IF_NOT_LESS):
+                BRANCH_IF(!(AS_NUMBER(R(instr->b)) < AS_NUMBER(R(instr->c))));
+                NEXT();
+            CASE(ROP_RETURN):
+                resetStack(vm);
+                return INTERPRET_OK;
+#ifndef SPL_COMPUTED_GOTO
+        }
+    }
+#endif
+#undef R
+#undef RUNTIME_ERROR
+#undef CHECK_NUMBERS
+#undef BINARY_OP
+#undef BRANCH_IF
+#undef TRACE_EXECUTION
+#undef CASE
+#undef NEXT
+#ifdef SPL_COMPUTED_GOTO
+#undef DISPATCH
+#endif
 }
 
-InterpretResult interpret(const char* source) {
+static InterpretResult runDecoded(SplVM* vm, DecodedChunk* decoded) {
+#ifdef SPL_JIT
+    Jit* jit = &vm->jitState;
+    initJit(vm, jit, vm->chunk, decoded);
+    if (vm->useJit) vm->jit = jit;
+    InterpretResult result = run(vm, decoded);
+    vm->jit = NULL;
+    freeJit(jit);
+    return result;
+#else
+    return run(vm, decoded);
+#endif
+}
+
+static InterpretResult compileAndRun(SplVM* vm, const char* source) {
+    // The compiler needs the reserve slots for the strings it creates.
+    resetStack(vm);
+    ensureStack(vm, 0);
     Chunk chunk;
     initChunk(&chunk);
-    if(!compile(source, &chunk)) {
-        freeChunk(&chunk);
+    if(!compile(vm, source, &chunk)) {
+        freeChunk(vm, &chunk);
         return INTERPRET_COMPILE_ERROR;
     }
-    vm.chunk = &chunk;
-    vm.ip = vm.chunk->code;
+    vm->chunk = &chunk;
+    vm->ip = vm->chunk->code;
+
+    InterpretResult result;
+    RegChunk regChunk;
+    initRegChunk(&regChunk);
+    if (vm->useRegisters && translateChunk(vm, &chunk, &regChunk)) {
+#ifdef DEBUG_PRINT_CODE
+        disassembleRegisterChunk(vm, &regChunk, "registers");
+#endif
+        // Registers and constants, plus two slots for concatenation.
+        int slots = regChunk.registerCount + regChunk.constants.count + 2;
+        result = ensureStack(vm, slots) ? runRegisters(vm, &regChunk) : INTERPRET_RUNTIME_ERROR;
+    } else {
+        fuseSuperinstructions(vm, &chunk);
+#ifdef DEBUG_PRINT_CODE
+        disassembleChunk(vm, &chunk, "fused");
+#endif
+        DecodedChunk decoded;
+        decodeChunk(vm, &chunk, &decoded);
+        result = ensureStack(vm, decoded.maxDepth) ? runDecoded(vm, &decoded) : INTERPRET_RUNTIME_ERROR;
+        freeDecodedChunk(vm, &decoded);
+    }
 
-    InterpretResult result = run();
+    freeRegChunk(vm, &regChunk);
+    freeChunk(vm, &chunk);
+    vm->chunk = NULL;
+    return result;
+}
 
-    freeChunk(&chunk);
+InterpretResult interpret(SplVM* vm, const char* source) {
+    // After running out of its arena the heap is in no state to run
+    // anything until resetVM().
+    if (vm->outOfMemory) return INTERPRET_RUNTIME_ERROR;
+    jmp_buf errorJump;
+    vm->errorJump = &errorJump;
+    InterpretResult result;
+    if (setjmp(errorJump) == 0) {
+        result = compileAndRun(vm, source);
+    } else {
+        // Out of memory. What the script allocated goes with the arena;
+        // only the JIT's code pages live outside it.
+#ifdef SPL_JIT
+        vm->jit = NULL;
+        freeJit(&vm->jitState);
+#endif
+        vm->compiler = NULL;
+        vm->compilingChunk = NULL;
+        vm->chunk = NULL;
+        resetStack(vm);
+        result = INTERPRET_RUNTIME_ERROR;
+    }
+    vm->errorJump = NULL;
     return result;
-}
\ No newline at end of file
+}
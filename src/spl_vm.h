@@ -1,21 +1,108 @@
 #ifndef SPL_VM_H
 #define SPL_VM_H
 
+#include <setjmp.h>
+
 #include "spl_chunk.h"
+#include "spl_compiler.h"
+#include "spl_lexer.h"
+#include "spl_memory.h"
+#include "spl_jit.h"
 #include "spl_table.h"
 #include "spl_value.h"
 
-#define STACK_MAX 65535 // 4 * Bytes
+// Largest value stack a chunk may ask for.
+#define STACK_MAX 65535
+// Slots kept free above what a chunk needs, for values the runtime and
+// the compiler push to keep them reachable while they allocate.
+#define STACK_RESERVE 2
 
-typedef struct {
+// Everything one interpreter instance owns: the front end's state while
+// compiling, the heap and the runtime. Separate SplVMs share nothing, so
+// they can run on different threads.
+struct SplVM {
+    spl_lexer lexer;
+    Parser parser;
+    Compiler* compiler;
+    Chunk* compilingChunk;
     Chunk* chunk;
     uint8_t * ip;
-    Value stack[STACK_MAX];
+    // Allocated on demand and grown before each chunk runs to the depth
+    // that chunk needs, so push() never has to check for overflow.
+    Value* stack;
+    int stackCapacity;
     Value* stackTop;
-    Table globals;
+    // Globals are resolved to dense slots at compile time. A slot holds
+    // UNDEFINED_VAL until its 'var' declaration has run.
+    Table globalSlots;
+    ValueArray globalNames;
+    ValueArray globalValues;
+    // Slots of globalValues that were given a young object since the
+    // last minor collection, and a flag per slot for whether it is in
+    // the list. Room for every slot, so storing never allocates.
+    int* youngGlobals;
+    bool* rememberedGlobals;
+    int youngGlobalCount;
+    int youngGlobalCapacity;
+    // Weak: interning alone does not keep a string alive.
     Table strings;
 	Obj* objects;
-} VM;
+	// Collector state. reallocate() counts every byte it hands out and
+	// starts a cycle once bytesAllocated passes nextGC.
+	size_t bytesAllocated;
+	size_t nextGC;
+	GcPhase gcPhase;
+	// Objects whose isMarked equals this are marked in the current cycle.
+	bool gcMarkBit;
+	int gcAllocations;
+	RootCursor gcGlobalNames;
+	RootCursor gcGlobalValues;
+	RootCursor gcConstants;
+	RootCursor gcCompilingConstants;
+	int gcSweepIndex;
+	int gcSweepCapacity;
+	Obj** gcSweepCursor;
+	int grayCount;
+	int grayCapacity;
+	Obj** grayStack;
+#ifdef SPL_POOL
+	Pool pool;
+#endif
+	// Arena mode, see initArena(): every block comes from one region of
+	// arenaLimit bytes, and running out of it ends the script through
+	// errorJump instead of exiting.
+	uint8_t* arena;
+	size_t arenaLimit;
+	size_t arenaTop;
+	ArenaBlock* arenaFree;
+	bool outOfMemory;
+	jmp_buf* errorJump;
+	// Young generation: NURSERY_SIZE bytes, allocated on first use.
+	uint8_t* nursery;
+	size_t nurseryTop;
+	// Tuning, set by the embedder after initVM(): during a cycle, do a
+	// step every gcStepInterval allocations, and stop a step after
+	// gcStepWork units of work or gcPauseLimit nanoseconds, whichever
+	// comes first.
+	int gcStepInterval;
+	int gcStepWork;
+	uint64_t gcPauseLimit;
+	GcPauseHistogram gcPauses;
+	MemStats memStats;
+	// Execute through the register translation of each chunk instead
+	// of the stack bytecode.
+	bool useRegisters;
+	// Compile hot loops of the stack bytecode to native code.
+	bool useJit;
+	// Compile through a tree and optimize it (see spl_ir.h) instead of
+	// writing bytecode in one pass.
+	bool optimize;
+#ifdef SPL_JIT
+	// Points at jitState while a chunk runs with useJit set.
+	Jit* jit;
+	Jit jitState;
+#endif
+};
 
 typedef enum {
     INTERPRET_OK,
@@ -23,12 +110,15 @@ typedef enum {
     INTERPRET_RUNTIME_ERROR
 } InterpretResult;
 
-extern VM vm;
-
-void initVM();
-void freeVM();
-InterpretResult interpret(const char* chunk);
-void push(Value value);
-Value pop();
+void initVM(SplVM* vm);
+void freeVM(SplVM* vm);
+// Drops every object and global but keeps the configuration, so the VM
+// can run the next script from scratch. Constant time in arena mode.
+void resetVM(SplVM* vm);
+InterpretResult interpret(SplVM* vm, const char* chunk);
+int globalSlot(SplVM* vm, ObjString* name);
+void push(SplVM* vm, Value value);
+Value pop(SplVM* vm);
+bool addValues(SplVM* vm);
 
 #endif
\ No newline at end of file
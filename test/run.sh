@@ -0,0 +1,43 @@
+#!/bin/sh
+# Runs every test/scripts/*.spl script with the given interpreter in each
+# of $MODES and compares what it prints with the .out file next to it.
+# A script may start with comment lines giving extra arguments and the
+# exit code it should stop with (0 if there is none):
+#
+#   // args: --arena=1m
+#   // exit: 70
+#
+# usage: test/run.sh <spl binary>
+
+MODES=${MODES:-"default -O --registers --jit"}
+DIR=$(dirname "$0")/scripts
+SPL=$1
+failed=0
+count=0
+
+for script in "$DIR"/*.spl; do
+    expected="${script%.spl}.out"
+    args=$(sed -n 's|^// args: ||p' "$script")
+    status=$(sed -n 's|^// exit: ||p' "$script")
+    for mode in $MODES; do
+        [ "$mode" = default ] && mode=""
+        count=$((count + 1))
+        output=$($SPL $mode $args "$script" 2>/dev/null)
+        code=$?
+        if [ "$code" != "${status:-0}" ]; then
+            echo "FAILED: $(basename "$script") $mode: exit code $code, expected ${status:-0}"
+            failed=$((failed + 1))
+        elif [ "$output" != "$(cat "$expected")" ]; then
+            echo "FAILED: $(basename "$script") $mode: output differs from $(basename "$expected")"
+            printf '%s\n' "$output" | diff "$expected" - | head -10
+            failed=$((failed + 1))
+        fi
+    done
+done
+
+if [ $failed -eq 0 ]; then
+    echo "SUCCESS: All $count script runs have passed."
+else
+    echo "FAILED: $failed of $count script runs have failed."
+    exit 1
+fi
@@ -1,23 +1,25 @@
 #include "../src/spl_lexer.h"
 #include "../include/acutest.h"
 
+static spl_lexer lexer;
+
 void should_identify_single_character_tokens(void)
 {
     // given
     const char *source = "(){}[].;!";
-    spl_lex_init(source);
+    spl_lex_init(&lexer, source);
 
     // when
-    spl_token should_left_paren = next_token();
-    spl_token should_right_paren = next_token();
-    spl_token should_left_brace = next_token();
-    spl_token should_right_brace = next_token();
-    spl_token should_left_bracket = next_token();
-    spl_token should_right_bracket = next_token();
-    spl_token should_dot = next_token();
-    spl_token should_semi_colon = next_token();
-    spl_token should_bang = next_token();
-    spl_token should_eof = next_token();
+    spl_token should_left_paren = next_token(&lexer);
+    spl_token should_right_paren = next_token(&lexer);
+    spl_token should_left_brace = next_token(&lexer);
+    spl_token should_right_brace = next_token(&lexer);
+    spl_token should_left_bracket = next_token(&lexer);
+    spl_token should_right_bracket = next_token(&lexer);
+    spl_token should_dot = next_token(&lexer);
+    spl_token should_semi_colon = next_token(&lexer);
+    spl_token should_bang = next_token(&lexer);
+    spl_token should_eof = next_token(&lexer);
 
     // then
     TEST_CHECK(should_left_paren.type == TK_LEFT_PAREN);
@@ -58,19 +60,19 @@ void should_identify_single_character_tokens(void)
 
     TEST_CHECK(should_eof.type == TK_EOF);
 
-    spl_lex_free();
+    spl_lex_free(&lexer);
 }
 
 void should_increment_line_number_with_comments(void)
 {
     // given
     const char *source = "/*This is a \n multi line \n comment*/\n(\n//Comment\n)";
-    spl_lex_init(source);
+    spl_lex_init(&lexer, source);
 
     // when
-    spl_token should_left_paren = next_token();
-    spl_token should_right_paren = next_token();
-    spl_token should_eof = next_token();
+    spl_token should_left_paren = next_token(&lexer);
+    spl_token should_right_paren = next_token(&lexer);
+    spl_token should_eof = next_token(&lexer);
 
     // then
     TEST_CHECK(should_left_paren.type == TK_LEFT_PAREN);
@@ -82,21 +84,21 @@ void should_increment_line_number_with_comments(void)
     TEST_CHECK(should_left_paren.length == 1);
 
     TEST_CHECK(should_eof.type == TK_EOF);
-    spl_lex_free();
+    spl_lex_free(&lexer);
 }
 
 void should_identify_operators(void)
 {
     // given
     const char *source = "- + * /";
-    spl_lex_init(source);
+    spl_lex_init(&lexer, source);
 
     // when
-    spl_token should_minus = next_token();
-    spl_token should_plus = next_token();
-    spl_token should_star = next_token();
-    spl_token should_slash = next_token();
-    spl_token should_eof = next_token();
+    spl_token should_minus = next_token(&lexer);
+    spl_token should_plus = next_token(&lexer);
+    spl_token should_star = next_token(&lexer);
+    spl_token should_slash = next_token(&lexer);
+    spl_token should_eof = next_token(&lexer);
 
     // then
     TEST_CHECK(should_minus.type == TK_MINUS);
@@ -108,22 +110,22 @@ void should_identify_operators(void)
     TEST_CHECK(should_slash.type == TK_SLASH);
     TEST_CHECK(should_slash.length == 1);
     TEST_CHECK(should_eof.type == TK_EOF);
-    spl_lex_free();
+    spl_lex_free(&lexer);
 }
 
 void should_identify_comparisons(void)
 {
     // given
     const char *source = "< > <= >= ==";
-    spl_lex_init(source);
+    spl_lex_init(&lexer, source);
 
     // when
-    spl_token should_less = next_token();
-    spl_token should_greater = next_token();
-    spl_token should_less_equal = next_token();
-    spl_token should_greater_equal = next_token();
-    spl_token should_equal_equal = next_token();
-    spl_token should_eof = next_token();
+    spl_token should_less = next_token(&lexer);
+    spl_token should_greater = next_token(&lexer);
+    spl_token should_less_equal = next_token(&lexer);
+    spl_token should_greater_equal = next_token(&lexer);
+    spl_token should_equal_equal = next_token(&lexer);
+    spl_token should_eof = next_token(&lexer);
 
     // then
     TEST_CHECK(should_less.type == TK_LESS);
@@ -138,7 +140,7 @@ void should_identify_comparisons(void)
     TEST_CHECK(should_equal_equal.length == 2);
 
     TEST_CHECK(should_eof.type == TK_EOF);
-    spl_lex_free();
+    spl_lex_free(&lexer);
 }
 
 
@@ -146,12 +148,12 @@ void should_identify_and_or(void)
 {
     // given
     const char *source = "& |";
-    spl_lex_init(source);
+    spl_lex_init(&lexer, source);
 
     // when
-    spl_token should_and = next_token();
-    spl_token should_or = next_token();
-    spl_token should_eof = next_token();
+    spl_token should_and = next_token(&lexer);
+    spl_token should_or = next_token(&lexer);
+    spl_token should_eof = next_token(&lexer);
 
     // then
     TEST_CHECK_(should_and.type == TK_AND, "Type: %d == %d", should_and.type, TK_AND);
@@ -159,7 +161,7 @@ void should_identify_and_or(void)
     TEST_CHECK_(should_or.type == TK_OR, "Type: %d == %d", should_or.type, TK_OR);
     TEST_CHECK_(should_or.length == 1, "Length: %d == %d", should_or.length, 2);
     TEST_CHECK(should_eof.type == TK_EOF);
-    spl_lex_free();
+    spl_lex_free(&lexer);
 }
 
 
@@ -171,18 +173,18 @@ void should_identify_numbers(void)
     for (int i = 0; i < 5; i++)
     {
         // given
-        spl_lex_init(types[i]);
+        spl_lex_init(&lexer, types[i]);
 
         // when
-        spl_token token = next_token();
-        spl_token eof = next_token();
+        spl_token token = next_token(&lexer);
+        spl_token eof = next_token(&lexer);
         // then
         TEST_CHECK_(token.type == TK_NUMBER_VAL, "Type: %d == %d", token.type, TK_NUMBER_VAL);
         TEST_CHECK_(token.length == lengths[i], "Length: %d == %d", token.length, lengths[i]);
 
         TEST_CHECK(eof.type == TK_EOF);
 
-        spl_lex_free();
+        spl_lex_free(&lexer);
     }
 }
 
@@ -196,11 +198,11 @@ void should_identify_reserved_words()
     for (int i = 0; i < 9; i++)
     {
         // given
-        spl_lex_init(types[i]);
+        spl_lex_init(&lexer, types[i]);
 
         // when
-        spl_token token = next_token();
-        spl_token eof = next_token();
+        spl_token token = next_token(&lexer);
+        spl_token eof = next_token(&lexer);
         // then
         TEST_CHECK_(token.type == start_token, "Type: %d == %d", token.type, start_token);
         TEST_CHECK_(token.length == lengths[i], "Length: %d == %d", token.length, lengths[i]);
@@ -209,7 +211,7 @@ void should_identify_reserved_words()
 
         start_token += 1;
 
-        spl_lex_free();
+        spl_lex_free(&lexer);
     }
 }
 
@@ -221,18 +223,18 @@ void should_identify_identifier()
     for (int i = 0; i < 4; i++)
     {
         // given
-        spl_lex_init(types[i]);
+        spl_lex_init(&lexer, types[i]);
 
         // when
-        spl_token token = next_token();
-        spl_token eof = next_token();
+        spl_token token = next_token(&lexer);
+        spl_token eof = next_token(&lexer);
         // then
         TEST_CHECK_(token.type == TK_IDENTIFIER, "Type: %d == %d", token.type, TK_IDENTIFIER);
         TEST_CHECK_(token.length == lengths[i], "Length: %d == %d", token.length, lengths[i]);
 
         TEST_CHECK(eof.type == TK_EOF);
 
-        spl_lex_free();
+        spl_lex_free(&lexer);
     }
 }
 
@@ -0,0 +1,376 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../src/spl_object.h"
+#include "../src/spl_table.h"
+#include "../src/spl_vm.h"
+#include "../include/acutest.h"
+
+// Keys are built by hand so that the tests can pick their hashes; they
+// are not on the VM's heap, so the collector is kept out of the way.
+static ObjString* makeKey(const char* chars, uint32_t hash)
+{
+    int length = (int)strlen(chars);
+    ObjString* key = calloc(1, STRING_SIZE(length));
+    key->obj.type = OBJ_STRING;
+    key->length = length;
+    key->hash = hash;
+    key->interned = true;
+    memcpy(key->chars, chars, length + 1);
+    return key;
+}
+
+static ObjString** makeKeys(int count, uint32_t hash)
+{
+    ObjString** keys = malloc(sizeof(ObjString*) * count);
+    char name[32];
+    for (int i = 0; i < count; i++)
+    {
+        int length = snprintf(name, sizeof(name), "key%d", i);
+        keys[i] = makeKey(name, hash != 0 ? hash : hashString(name, length));
+    }
+    return keys;
+}
+
+static void freeKeys(ObjString** keys, int count)
+{
+    for (int i = 0; i < count; i++) free(keys[i]);
+    free(keys);
+}
+
+static void setUp(SplVM* vm, Table* table)
+{
+    initVM(vm);
+    vm->nextGC = SIZE_MAX;
+    initTable(table);
+}
+
+static void tearDown(SplVM* vm, Table* table)
+{
+    freeTable(vm, table);
+    freeVM(vm);
+}
+
+// A hash whose first group is 'group' and whose control byte is 'tag'.
+static uint32_t groupHash(uint32_t group, uint32_t tag)
+{
+    return group << 7 | tag;
+}
+
+static int fullSlots(Table* table, int group)
+{
+    int full = 0;
+    for (int i = 0; i < TABLE_GROUP_WIDTH; i++)
+    {
+        full += CTRL_IS_FULL(table->control[group * TABLE_GROUP_WIDTH + i]);
+    }
+    return full;
+}
+
+static bool hasValue(Table* table, ObjString* key, double number)
+{
+    Value value;
+    return tableGet(table, key, &value) && IS_NUMBER(value) && AS_NUMBER(value) == number;
+}
+
+void should_set_get_and_delete_across_growth(void)
+{
+    // given
+    SplVM vm;
+    Table table;
+    setUp(&vm, &table);
+    int count = 3000;
+    ObjString** keys = makeKeys(count, 0);
+
+    // when
+    for (int i = 0; i < count; i++)
+    {
+        TEST_CHECK(tableSet(&vm, &table, keys[i], NUMBER_VAL(i)));
+    }
+
+    // then
+    TEST_CHECK_(table.count == count, "%d == %d", table.count, count);
+    for (int i = 0; i < count; i++)
+    {
+        TEST_CHECK_(hasValue(&table, keys[i], i), "key%d", i);
+    }
+
+    // when
+    for (int i = 0; i < count; i += 2)
+    {
+        TEST_CHECK(!tableSet(&vm, &table, keys[i], NUMBER_VAL(-i)));
+    }
+    for (int i = 1; i < count; i += 2)
+    {
+        TEST_CHECK(tableDelete(&table, keys[i]));
+    }
+
+    // then
+    TEST_CHECK(table.count == count / 2);
+    for (int i = 0; i < count; i++)
+    {
+        Value value;
+        if (i % 2 == 0) TEST_CHECK_(hasValue(&table, keys[i], -i), "key%d", i);
+        else TEST_CHECK_(!tableGet(&table, keys[i], &value), "key%d", i);
+    }
+    TEST_CHECK(!tableDelete(&table, keys[1]));
+
+    freeKeys(keys, count);
+    tearDown(&vm, &table);
+}
+
+void should_reinsert_onto_tombstones(void)
+{
+    // given 16 keys filling the first group of a 32-slot table, and one
+    // more that had to go on to the second group
+    SplVM vm;
+    Table table;
+    setUp(&vm, &table);
+    ObjString** keys = makeKeys(17, groupHash(0, 1));
+    for (int i = 0; i < 17; i++) tableSet(&vm, &table, keys[i], NUMBER_VAL(i));
+    TEST_CHECK_(table.capacity == 32, "%d == 32", table.capacity);
+    TEST_CHECK(fullSlots(&table, 0) == 16);
+    TEST_CHECK(fullSlots(&table, 1) == 1);
+
+    // when a key of the full group is deleted
+    TEST_CHECK(tableDelete(&table, keys[3]));
+
+    // then it leaves a tombstone that lookups pass over
+    TEST_CHECK(table.tombstones == 1);
+    TEST_CHECK(hasValue(&table, keys[16], 16));
+
+    // when the key in the group with empty slots is deleted
+    TEST_CHECK(tableDelete(&table, keys[16]));
+
+    // then its slot becomes empty again
+    TEST_CHECK(table.tombstones == 1);
+    TEST_CHECK(fullSlots(&table, 1) == 0);
+
+    // when a key is inserted along the same probe path
+    ObjString* reinserted = makeKey("reinserted", groupHash(0, 1));
+    TEST_CHECK(tableSet(&vm, &table, reinserted, NUMBER_VAL(99)));
+
+    // then it takes the tombstone's slot
+    TEST_CHECK(table.tombstones == 0);
+    TEST_CHECK(table.count == 16);
+    TEST_CHECK(fullSlots(&table, 0) == 16);
+    TEST_CHECK(hasValue(&table, reinserted, 99));
+    for (int i = 0; i < 16; i++)
+    {
+        if (i != 3) TEST_CHECK_(hasValue(&table, keys[i], i), "key%d", i);
+    }
+
+    free(reinserted);
+    freeKeys(keys, 17);
+    tearDown(&vm, &table);
+}
+
+void should_wrap_probes_around_full_groups(void)
+{
+    // given 50 keys that all start probing at the last group of a
+    // 64-slot table
+    SplVM vm;
+    Table table;
+    setUp(&vm, &table);
+    ObjString** keys = makeKeys(50, groupHash(3, 5));
+
+    // when
+    for (int i = 0; i < 50; i++) tableSet(&vm, &table, keys[i], NUMBER_VAL(i));
+
+    // then they fill groups 3, 0 and 2 in probe order, and the rest land
+    // in group 1
+    TEST_CHECK_(table.capacity == 64, "%d == 64", table.capacity);
+    TEST_CHECK(fullSlots(&table, 3) == 16);
+    TEST_CHECK(fullSlots(&table, 0) == 16);
+    TEST_CHECK(fullSlots(&table, 2) == 16);
+    TEST_CHECK(fullSlots(&table, 1) == 2);
+    for (int i = 0; i < 50; i++)
+    {
+        TEST_CHECK_(hasValue(&table, keys[i], i), "key%d", i);
+    }
+
+    // when the first three groups are emptied
+    for (int i = 0; i < 48; i++) TEST_CHECK(tableDelete(&table, keys[i]));
+
+    // then their tombstones still lead to the last keys
+    TEST_CHECK(table.count == 2);
+    TEST_CHECK(table.tombstones == 48);
+    TEST_CHECK(hasValue(&table, keys[48], 48));
+    TEST_CHECK(hasValue(&table, keys[49], 49));
+    TEST_CHECK(!tableDelete(&table, keys[0]));
+
+    freeKeys(keys, 50);
+    tearDown(&vm, &table);
+}
+
+void should_find_strings_with_colliding_hashes(void)
+{
+    // given
+    SplVM vm;
+    Table table;
+    setUp(&vm, &table);
+    ObjString* ab = makeKey("ab", 42);
+    ObjString* ba = makeKey("ba", 42);
+    ObjString* abc = makeKey("abc", 42);
+    ObjString* xy = makeKey("xy", 43);
+    tableSet(&vm, &table, ab, NIL_VAL);
+    tableSet(&vm, &table, ba, NIL_VAL);
+    tableSet(&vm, &table, abc, NIL_VAL);
+    tableSet(&vm, &table, xy, NIL_VAL);
+
+    // then
+    TEST_CHECK(tableFindString(&table, "ab", 2, 42) == ab);
+    TEST_CHECK(tableFindString(&table, "ba", 2, 42) == ba);
+    TEST_CHECK(tableFindString(&table, "abc", 3, 42) == abc);
+    TEST_CHECK(tableFindString(&table, "xy", 2, 43) == xy);
+    TEST_CHECK(tableFindString(&table, "ab", 2, 43) == NULL);
+    TEST_CHECK(tableFindString(&table, "zz", 2, 42) == NULL);
+    TEST_CHECK(tableFindString(&table, "abcd", 4, 42) == NULL);
+
+    // when
+    tableDelete(&table, ab);
+
+    // then
+    TEST_CHECK(tableFindString(&table, "ab", 2, 42) == NULL);
+    TEST_CHECK(tableFindString(&table, "ba", 2, 42) == ba);
+    TEST_CHECK(tableFindString(&table, "abc", 3, 42) == abc);
+
+    free(ab);
+    free(ba);
+    free(abc);
+    free(xy);
+    tearDown(&vm, &table);
+}
+
+// Tables of up to this many slots move their entries at once when they
+// grow (TABLE_INCREMENTAL_MIN in spl_table.c).
+#define INCREMENTAL_MIN 1024
+
+void should_move_small_tables_at_once(void)
+{
+    // given
+    SplVM vm;
+    Table table;
+    setUp(&vm, &table);
+    int count = 8000;
+    ObjString** keys = makeKeys(count, 0);
+    int grown = 0;
+
+    for (int i = 0; i < count; i++)
+    {
+        // when
+        int capacity = table.capacity;
+        tableSet(&vm, &table, keys[i], NUMBER_VAL(i));
+        if (table.capacity == capacity) continue;
+
+        // then
+        grown++;
+        if (capacity <= INCREMENTAL_MIN)
+        {
+            TEST_CHECK_(table.oldCapacity == 0, "%d slots moved at once", capacity);
+        }
+        else
+        {
+            TEST_CHECK_(table.oldCapacity == capacity, "%d slots left to move", capacity);
+            TEST_CHECK(table.migrated == 1);
+        }
+    }
+    TEST_CHECK(table.capacity > 2 * INCREMENTAL_MIN);
+    TEST_CHECK(grown > 0);
+
+    freeKeys(keys, count);
+    tearDown(&vm, &table);
+}
+
+void should_look_up_overwrite_and_delete_while_migrating(void)
+{
+    // given a table that has just started moving 2048 slots over
+    SplVM vm;
+    Table table;
+    setUp(&vm, &table);
+    int count = 4000;
+    ObjString** keys = makeKeys(count, 0);
+    int filled = 0;
+    while (table.oldCapacity == 0 || table.capacity <= 2 * INCREMENTAL_MIN)
+    {
+        tableSet(&vm, &table, keys[filled], NUMBER_VAL(filled));
+        filled++;
+    }
+    int oldCapacity = table.oldCapacity;
+    int groups = oldCapacity / TABLE_GROUP_WIDTH;
+    TEST_CHECK_(oldCapacity == 2 * INCREMENTAL_MIN, "%d == %d", oldCapacity, 2 * INCREMENTAL_MIN);
+
+    // then every key is found in one array or the other
+    for (int i = 0; i < filled; i++)
+    {
+        TEST_CHECK_(hasValue(&table, keys[i], i), "key%d", i);
+    }
+
+    // when every key is overwritten
+    for (int i = 0; i < filled; i++)
+    {
+        TEST_CHECK_(!tableSet(&vm, &table, keys[i], NUMBER_VAL(-i)), "key%d", i);
+    }
+
+    // then no entry is added and nothing more moves
+    TEST_CHECK(table.count == filled);
+    TEST_CHECK(table.oldCapacity == oldCapacity);
+    TEST_CHECK(table.migrated == 1);
+
+    // when the first 100 keys are deleted, most of them from the old arrays
+    for (int i = 0; i < 100; i++)
+    {
+        TEST_CHECK_(tableDelete(&table, keys[i]), "key%d", i);
+    }
+
+    // then
+    TEST_CHECK(table.count == filled - 100);
+    for (int i = 0; i < 100; i++)
+    {
+        Value value;
+        TEST_CHECK_(!tableGet(&table, keys[i], &value), "key%d", i);
+        TEST_CHECK_(!tableDelete(&table, keys[i]), "key%d", i);
+    }
+
+    // when half of them are inserted again and new keys are added until
+    // the move is done
+    for (int i = 0; i < 50; i++)
+    {
+        TEST_CHECK_(tableSet(&vm, &table, keys[i], NUMBER_VAL(1000 + i)), "key%d", i);
+    }
+    int added = filled;
+    while (table.oldCapacity > 0 && added < count)
+    {
+        TEST_CHECK(tableSet(&vm, &table, keys[added], NUMBER_VAL(added)));
+        added++;
+    }
+
+    // then the old arrays are gone and every entry has its latest value
+    TEST_CHECK(table.oldCapacity == 0);
+    TEST_CHECK_(added - filled + 50 == groups - 1, "%d inserts moved %d groups",
+                added - filled + 50, groups - 1);
+    TEST_CHECK(table.count == added - 50);
+    for (int i = 0; i < added; i++)
+    {
+        Value value;
+        if (i < 50) TEST_CHECK_(hasValue(&table, keys[i], 1000 + i), "key%d", i);
+        else if (i < 100) TEST_CHECK_(!tableGet(&table, keys[i], &value), "key%d", i);
+        else if (i < filled) TEST_CHECK_(hasValue(&table, keys[i], -i), "key%d", i);
+        else TEST_CHECK_(hasValue(&table, keys[i], i), "key%d", i);
+    }
+
+    freeKeys(keys, count);
+    tearDown(&vm, &table);
+}
+
+TEST_LIST = {
+    {": Should set, get and delete across growth", should_set_get_and_delete_across_growth},
+    {": Should reinsert onto tombstones", should_reinsert_onto_tombstones},
+    {": Should wrap probes around full groups", should_wrap_probes_around_full_groups},
+    {": Should find strings with colliding hashes", should_find_strings_with_colliding_hashes},
+    {": Should move small tables at once", should_move_small_tables_at_once},
+    {": Should look up, overwrite and delete while migrating",
+     should_look_up_overwrite_and_delete_while_migrating},
+    {NULL, NULL}
+};
@@ -0,0 +1,85 @@
+#include "../src/spl_value.h"
+#include "../include/acutest.h"
+
+void should_round_trip_numbers(void)
+{
+    // given
+    const double numbers[] = {0.0, -0.0, 1.0, -1.5, 1e300, -1e-300, 6.62339e+40};
+
+    for (int i = 0; i < 7; i++)
+    {
+        // when
+        Value value = NUMBER_VAL(numbers[i]);
+
+        // then
+        TEST_CHECK(IS_NUMBER(value));
+        TEST_CHECK(!IS_NIL(value));
+        TEST_CHECK(!IS_BOOL(value));
+        TEST_CHECK(!IS_OBJ(value));
+        TEST_CHECK_(AS_NUMBER(value) == numbers[i], "%g == %g", AS_NUMBER(value), numbers[i]);
+    }
+}
+
+void should_distinguish_singletons(void)
+{
+    // given
+    Value nil = NIL_VAL;
+    Value yes = BOOL_VAL(true);
+    Value no = BOOL_VAL(false);
+
+    // then
+    TEST_CHECK(IS_NIL(nil));
+    TEST_CHECK(!IS_BOOL(nil));
+    TEST_CHECK(!IS_NUMBER(nil));
+
+    TEST_CHECK(IS_BOOL(yes) && AS_BOOL(yes));
+    TEST_CHECK(IS_BOOL(no) && !AS_BOOL(no));
+    TEST_CHECK(!IS_NIL(no));
+
+    TEST_CHECK(valuesEqual(nil, NIL_VAL));
+    TEST_CHECK(!valuesEqual(yes, no));
+    TEST_CHECK(!valuesEqual(no, nil));
+    TEST_CHECK(!valuesEqual(NUMBER_VAL(0), no));
+}
+
+void should_round_trip_objects(void)
+{
+    // given
+    static Obj* objects[2];
+    Obj* pointer = (Obj*)&objects[1];
+
+    // when
+    Value value = OBJ_VAL(pointer);
+
+    // then
+    TEST_CHECK(IS_OBJ(value));
+    TEST_CHECK(!IS_NUMBER(value));
+    TEST_CHECK(!IS_NIL(value));
+    TEST_CHECK(!IS_BOOL(value));
+    TEST_CHECK(AS_OBJ(value) == pointer);
+}
+
+void should_compare_numbers_by_value(void)
+{
+    // then
+    TEST_CHECK(valuesEqual(NUMBER_VAL(0.0), NUMBER_VAL(-0.0)));
+    TEST_CHECK(!valuesEqual(NUMBER_VAL(0.0 / 0.0), NUMBER_VAL(0.0 / 0.0)));
+}
+
+void should_pack_values_into_eight_bytes(void)
+{
+#ifdef NAN_BOXING
+    TEST_CHECK(sizeof(Value) == 8);
+#else
+    TEST_CHECK(sizeof(Value) == 16);
+#endif
+}
+
+TEST_LIST = {
+    {": Should round trip numbers", should_round_trip_numbers},
+    {": Should distinguish nil, true and false", should_distinguish_singletons},
+    {": Should round trip object pointers", should_round_trip_objects},
+    {": Should compare numbers by value", should_compare_numbers_by_value},
+    {": Should pack values into eight bytes", should_pack_values_into_eight_bytes},
+    {NULL, NULL}
+};